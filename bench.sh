@@ -0,0 +1,40 @@
+#!/bin/bash
+# Runs bench.wfs against a fresh image and mount for each thread count and
+# appends its JSON lines to $OUT. Compare runs of two versions by label.
+# Write results include the fsync that flushes mount.wfs's write-back
+# buffers at the end of each run; files are synced before read runs.
+#
+#   THREADS       thread counts to run (default "1 2 4 8")
+#   IMAGE_SIZE    mkfs.wfs -s size; the image is grown on demand (default 8G)
+#   MOUNT_OPTS    mount.wfs options (default --clean-interval=0, so the
+#                 cleaner does not move the head while it is being measured)
+#   BENCH_OPTS    extra bench.wfs options, e.g. "-n 2000 -b 1048576"
+#   LABEL         recorded in every result (default the git revision)
+#   OUT           results file (default bench.jsonl)
+set -euo pipefail
+
+THREADS=${THREADS:-"1 2 4 8"}
+IMAGE_SIZE=${IMAGE_SIZE:-8G}
+MOUNT_OPTS=${MOUNT_OPTS:---clean-interval=0}
+BENCH_OPTS=${BENCH_OPTS:-}
+LABEL=${LABEL:-$(git describe --always --dirty 2>/dev/null || echo unknown)}
+OUT=${OUT:-bench.jsonl}
+
+dir=$(mktemp -d)
+mounted=
+cleanup() {
+    if [ -n "$mounted" ]; then ./umount.wfs "$dir/mnt" || true; fi
+    rm -rf "$dir"
+}
+trap cleanup EXIT
+
+for threads in $THREADS; do
+    ./mkfs.wfs -s "$IMAGE_SIZE" "$dir/disk"
+    mkdir -p "$dir/mnt"
+    ./mount.wfs $MOUNT_OPTS "$dir/disk" "$dir/mnt"
+    mounted=1
+    ./bench.wfs -t "$threads" -l "$LABEL" -i "$dir/disk" $BENCH_OPTS "$dir/mnt" | tee -a "$OUT"
+    ./umount.wfs "$dir/mnt"
+    mounted=
+    rm -f "$dir/disk"
+done
@@ -0,0 +1,421 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "wfs.h"
+
+// Runs workloads against a mounted wfs and prints one JSON object per line for
+// each: throughput, latency percentiles and, given the image, the log bytes
+// appended per logical byte written. Every thread draws from its own seeded
+// generator, so runs with the same options issue the same operations.
+
+#define DEEP_PATH_DEPTH 16
+#define SETUP_CHUNK 1048576     // write size used to fill files before timing
+
+int n_threads = 1;              // -t
+long n_ops = 10000;             // -n, operations per thread for metadata workloads
+uint64_t file_bytes = 4 << 20;  // -b, file size per thread for I/O workloads
+long dir_entries = 10000;       // -e, entries in the readdir directory
+uint64_t seed = 1;              // -r
+const char *label = "";         // -l, copied into every result
+const char *image_path = NULL;  // -i, read for the log head
+const char *mount_point;
+int sync_fd = -1;               // any file on the mount, fsync()ed to commit the log
+
+struct worker {
+    int id;
+    int fd;                     // the thread's file, for I/O workloads
+    uint64_t rng;
+    char *buf;
+    long n_ops;
+    uint64_t *latencies;        // nanoseconds per operation
+    long done;
+    uint64_t started, finished;
+    int error;                  // errno of the first failed operation
+};
+
+#define WORKLOAD_WRITE 1
+#define WORKLOAD_RANDOM 2
+
+struct workload {
+    const char *name;           // also the directory it runs in
+    size_t io_size;             // bytes per read or write, 0 for metadata workloads
+    int flags;                  // WORKLOAD_*
+    long scale;                 // metadata workloads run n_ops / scale operations per thread
+    int (*setup)(const struct workload *w);                     // untimed
+    int (*start)(const struct workload *w, struct worker *worker); // untimed, per thread
+    int (*op)(const struct workload *w, struct worker *worker, long i);
+};
+
+const struct workload *current;
+pthread_barrier_t start_barrier;
+
+uint64_t next_random(struct worker *worker) {
+    // xorshift64*
+    worker->rng ^= worker->rng >> 12;
+    worker->rng ^= worker->rng << 25;
+    worker->rng ^= worker->rng >> 27;
+    return worker->rng * 0x2545f4914f6cdd1dULL;
+}
+
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void workload_path(char *path, const struct workload *w, const char *name) {
+    snprintf(path, PATH_MAX, "%s/%s/%s", mount_point, w->name, name);
+}
+
+void deep_path(char *path, const struct workload *w, int depth) {
+    int length = snprintf(path, PATH_MAX, "%s/%s", mount_point, w->name);
+    for (int i = 0; i < depth; i++) length += snprintf(path + length, PATH_MAX - length, "/d%d", i);
+}
+
+long workload_ops(const struct workload *w) {
+    if (w->io_size != 0) return file_bytes / w->io_size;
+    return n_ops / w->scale > 0 ? n_ops / w->scale : 1;
+}
+
+int setup_dir(const struct workload *w) {
+    char path[PATH_MAX];
+    snprintf(path, PATH_MAX, "%s/%s", mount_point, w->name);
+    if (mkdir(path, 0755) != 0) {
+        fprintf(stderr, "Failed to create %s: %s (benchmarks need a fresh image)\n", path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int setup_deep(const struct workload *w) {
+    char path[PATH_MAX];
+    if (setup_dir(w) != 0) return -1;
+    for (int depth = 1; depth <= DEEP_PATH_DEPTH; depth++) {
+        deep_path(path, w, depth);
+        if (mkdir(path, 0755) != 0) {
+            perror("Failed to create directory");
+            return -1;
+        }
+    }
+    strcat(path, "/f");
+    if (mknod(path, S_IFREG | 0644, 0) != 0) {
+        perror("Failed to create file");
+        return -1;
+    }
+    return 0;
+}
+
+int setup_readdir(const struct workload *w) {
+    char path[PATH_MAX], name[MAX_FILE_NAME_LEN];
+    if (setup_dir(w) != 0) return -1;
+    for (long i = 0; i < dir_entries; i++) {
+        snprintf(name, sizeof(name), "e%ld", i);
+        workload_path(path, w, name);
+        if (mknod(path, S_IFREG | 0644, 0) != 0) {
+            perror("Failed to create file");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Creates the thread's file and, for workloads that read or overwrite it,
+// fills it first and fsyncs it, so the fill is appended before the timed run
+// rather than by its first read or counted against it.
+int start_file(const struct workload *w, struct worker *worker) {
+    char path[PATH_MAX], name[MAX_FILE_NAME_LEN];
+    snprintf(name, sizeof(name), "t%d", worker->id);
+    workload_path(path, w, name);
+    worker->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (worker->fd == -1) {
+        perror("Failed to create file");
+        return -1;
+    }
+    if ((w->flags & WORKLOAD_WRITE) && !(w->flags & WORKLOAD_RANDOM)) return 0;
+
+    char *chunk = calloc(1, SETUP_CHUNK);
+    if (chunk == NULL) return -1;
+    for (uint64_t offset = 0; offset < file_bytes; offset += SETUP_CHUNK) {
+        size_t length = file_bytes - offset < SETUP_CHUNK ? file_bytes - offset : SETUP_CHUNK;
+        memset(chunk, 'a' + offset / SETUP_CHUNK % 26, length);
+        if (pwrite(worker->fd, chunk, length, offset) != length) {
+            perror("Failed to fill file");
+            free(chunk);
+            return -1;
+        }
+    }
+    free(chunk);
+    if (fsync(worker->fd) != 0) {
+        perror("Failed to sync file");
+        return -1;
+    }
+    return 0;
+}
+
+int op_create(const struct workload *w, struct worker *worker, long i) {
+    char path[PATH_MAX], name[MAX_FILE_NAME_LEN];
+    snprintf(name, sizeof(name), "t%d_%ld", worker->id, i);
+    workload_path(path, w, name);
+    return mknod(path, S_IFREG | 0644, 0);
+}
+
+int op_stat_deep(const struct workload *w, struct worker *worker, long i) {
+    char path[PATH_MAX];
+    struct stat st;
+    deep_path(path, w, DEEP_PATH_DEPTH);
+    strcat(path, "/f");
+    return stat(path, &st);
+}
+
+int op_io(const struct workload *w, struct worker *worker, long i) {
+    long n_blocks = file_bytes / w->io_size;
+    off_t offset = (w->flags & WORKLOAD_RANDOM ? next_random(worker) % n_blocks : i) * w->io_size;
+    ssize_t done = w->flags & WORKLOAD_WRITE ? pwrite(worker->fd, worker->buf, w->io_size, offset)
+                                             : pread(worker->fd, worker->buf, w->io_size, offset);
+    if (done == w->io_size) return 0;
+    if (done >= 0) errno = EIO;
+    return -1;
+}
+
+int op_readdir(const struct workload *w, struct worker *worker, long i) {
+    char path[PATH_MAX];
+    snprintf(path, PATH_MAX, "%s/%s", mount_point, w->name);
+    DIR *dir = opendir(path);
+    if (dir == NULL) return -1;
+    long entries = 0;
+    while (readdir(dir) != NULL) entries++;
+    closedir(dir);
+    if (entries >= dir_entries) return 0;
+    errno = ENOENT;
+    return -1;
+}
+
+// A create followed by an unlink, so the directory stays the same size.
+int op_churn(const struct workload *w, struct worker *worker, long i) {
+    if (op_create(w, worker, i) != 0) return -1;
+    char path[PATH_MAX], name[MAX_FILE_NAME_LEN];
+    snprintf(name, sizeof(name), "t%d_%ld", worker->id, i);
+    workload_path(path, w, name);
+    return unlink(path);
+}
+
+#define IO_WORKLOADS(size, suffix) \
+    {"seq_write_" suffix, size, WORKLOAD_WRITE, 1, setup_dir, start_file, op_io}, \
+    {"seq_read_" suffix, size, 0, 1, setup_dir, start_file, op_io}, \
+    {"rand_write_" suffix, size, WORKLOAD_WRITE | WORKLOAD_RANDOM, 1, setup_dir, start_file, op_io}, \
+    {"rand_read_" suffix, size, WORKLOAD_RANDOM, 1, setup_dir, start_file, op_io}
+
+struct workload workloads[] = {
+    {"create", 0, 0, 1, setup_dir, NULL, op_create},
+    {"stat_deep", 0, 0, 1, setup_deep, NULL, op_stat_deep},
+    IO_WORKLOADS(4096, "4K"),
+    IO_WORKLOADS(65536, "64K"),
+    IO_WORKLOADS(1048576, "1M"),
+    {"readdir", 0, 0, 500, setup_readdir, NULL, op_readdir},
+    {"unlink_churn", 0, 0, 1, setup_dir, NULL, op_churn},
+};
+
+#define N_WORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+
+void *worker_thread(void *arg) {
+    struct worker *worker = arg;
+    pthread_barrier_wait(&start_barrier);
+    worker->started = now_ns();
+    for (long i = 0; i < worker->n_ops; i++) {
+        uint64_t start = now_ns();
+        if (current->op(current, worker, i) != 0) {
+            worker->error = errno;
+            break;
+        }
+        worker->latencies[i] = now_ns() - start;
+        worker->done++;
+    }
+    // writes may still sit in the file's write-back buffer; appending them is
+    // part of the run
+    if ((current->flags & WORKLOAD_WRITE) && worker->fd != -1 && fsync(worker->fd) != 0 && worker->error == 0) {
+        worker->error = errno;
+    }
+    worker->finished = now_ns();
+    return NULL;
+}
+
+// Commits the log and returns its head, or -1 without an image.
+int64_t log_head() {
+    if (image_path == NULL) return -1;
+    if (fsync(sync_fd) != 0) {
+        perror("Failed to sync");
+        return -1;
+    }
+    int fd = open(image_path, O_RDONLY);
+    struct wfs_sb sb;
+    int ok = fd != -1 && pread(fd, &sb, sizeof(sb), 0) == sizeof(sb) && sb.magic == WFS_MAGIC;
+    if (fd != -1) close(fd);
+    if (!ok) {
+        fprintf(stderr, "Failed to read the superblock of %s\n", image_path);
+        return -1;
+    }
+    return sb.head;
+}
+
+int compare_latencies(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+double percentile_us(const uint64_t *sorted, long n, double p) {
+    if (n == 0) return 0;
+    long rank = (long) (p * n);  // nearest rank, ceil(p * n)
+    if (rank < p * n) rank++;
+    return sorted[rank > 0 ? rank - 1 : 0] / 1000.0;
+}
+
+int run_workload(const struct workload *w) {
+    struct worker workers[n_threads];
+    long ops = workload_ops(w);
+    int failed = 0;
+
+    current = w;
+    if (w->setup(w) != 0) return -1;
+    for (int t = 0; t < n_threads; t++) {
+        struct worker *worker = &workers[t];
+        memset(worker, 0, sizeof(*worker));
+        worker->id = t;
+        worker->fd = -1;
+        worker->rng = seed * 0x9e3779b97f4a7c15ULL + t + 1;
+        worker->n_ops = ops;
+        worker->latencies = malloc(ops * sizeof(uint64_t) + 1);
+        worker->buf = malloc(w->io_size + 1);
+        if (worker->latencies == NULL || worker->buf == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            return -1;
+        }
+        memset(worker->buf, 'w', w->io_size);
+        if (w->start != NULL && w->start(w, worker) != 0) return -1;
+    }
+
+    pthread_t threads[n_threads];
+    pthread_barrier_init(&start_barrier, NULL, n_threads + 1);
+    int64_t head_before = log_head();
+    for (int t = 0; t < n_threads; t++) {
+        if (pthread_create(&threads[t], NULL, worker_thread, &workers[t]) != 0) {
+            fprintf(stderr, "Failed to start threads\n");
+            exit(1);
+        }
+    }
+    pthread_barrier_wait(&start_barrier);
+    for (int t = 0; t < n_threads; t++) pthread_join(threads[t], NULL);
+    // closing flushes anything else buffered before the head is read
+    for (int t = 0; t < n_threads; t++) {
+        if (workers[t].fd != -1) close(workers[t].fd);
+        workers[t].fd = -1;
+    }
+    int64_t head_after = log_head();
+    pthread_barrier_destroy(&start_barrier);
+
+    long total = 0;
+    uint64_t first_start = UINT64_MAX, last_finish = 0;
+    for (int t = 0; t < n_threads; t++) {
+        total += workers[t].done;
+        if (workers[t].started < first_start) first_start = workers[t].started;
+        if (workers[t].finished > last_finish) last_finish = workers[t].finished;
+    }
+    uint64_t *latencies = malloc(total * sizeof(uint64_t) + 1);
+    long n = 0;
+    for (int t = 0; t < n_threads; t++) {
+        memcpy(latencies + n, workers[t].latencies, workers[t].done * sizeof(uint64_t));
+        n += workers[t].done;
+        if (workers[t].error != 0 && !failed) {
+            fprintf(stderr, "%s: %s\n", w->name, strerror(workers[t].error));
+            failed = 1;
+        }
+        free(workers[t].latencies);
+        free(workers[t].buf);
+    }
+    qsort(latencies, n, sizeof(uint64_t), compare_latencies);
+
+    double seconds = (last_finish - first_start) / 1e9;
+    uint64_t logical = w->flags & WORKLOAD_WRITE ? total * w->io_size : 0;
+    uint64_t transferred = total * w->io_size;
+    printf("{\"label\": \"%s\", \"workload\": \"%s\", \"threads\": %d, \"ops\": %ld, \"errors\": %d, "
+           "\"seconds\": %.6f, \"ops_per_sec\": %.1f, \"mb_per_sec\": %.2f, "
+           "\"p50_us\": %.1f, \"p99_us\": %.1f, \"p999_us\": %.1f, \"max_us\": %.1f, \"logical_bytes\": %lu, ",
+           label, w->name, n_threads, total, failed, seconds, total / seconds, transferred / seconds / 1048576,
+           percentile_us(latencies, n, 0.5), percentile_us(latencies, n, 0.99),
+           percentile_us(latencies, n, 0.999), n > 0 ? latencies[n - 1] / 1000.0 : 0, (unsigned long) logical);
+    if (head_before < 0 || head_after < 0) {
+        printf("\"appended_bytes\": null, \"append_amplification\": null}\n");
+    } else if (logical == 0) {
+        printf("\"appended_bytes\": %ld, \"append_amplification\": null}\n", (long) (head_after - head_before));
+    } else {
+        printf("\"appended_bytes\": %ld, \"append_amplification\": %.3f}\n", (long) (head_after - head_before),
+               (double) (head_after - head_before) / logical);
+    }
+    fflush(stdout);
+    free(latencies);
+    return failed ? -1 : 0;
+}
+
+void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-t threads] [-n ops] [-b file_bytes] [-e dir_entries] [-r seed] [-l label] "
+            "[-i disk_path] mount_point [workload...]\nWorkloads:", program);
+    for (int i = 0; i < N_WORKLOADS; i++) fprintf(stderr, " %s", workloads[i].name);
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "t:n:b:e:r:l:i:")) != -1) {
+        switch (opt) {
+        case 't': n_threads = atoi(optarg); break;
+        case 'n': n_ops = atol(optarg); break;
+        case 'b': file_bytes = strtoull(optarg, NULL, 10); break;
+        case 'e': dir_entries = atol(optarg); break;
+        case 'r': seed = strtoull(optarg, NULL, 10); break;
+        case 'l': label = optarg; break;
+        case 'i': image_path = optarg; break;
+        default: usage(argv[0]); return 1;
+        }
+    }
+    if (optind >= argc || n_threads < 1 || n_ops < 1 || dir_entries < 1 || file_bytes < 1048576) {
+        usage(argv[0]);
+        return 1;
+    }
+    mount_point = argv[optind++];
+
+    int selected[N_WORKLOADS];
+    for (int i = 0; i < N_WORKLOADS; i++) selected[i] = optind == argc;
+    for (int a = optind; a < argc; a++) {
+        int found = 0;
+        for (int i = 0; i < N_WORKLOADS; i++) {
+            if (strcmp(argv[a], workloads[i].name) == 0) selected[i] = found = 1;
+        }
+        if (!found) {
+            fprintf(stderr, "Unknown workload %s\n", argv[a]);
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    char path[PATH_MAX];
+    snprintf(path, PATH_MAX, "%s/sync", mount_point);
+    sync_fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (sync_fd == -1) {
+        perror("Failed to create sync file");
+        return 1;
+    }
+
+    int failed = 0;
+    for (int i = 0; i < N_WORKLOADS; i++) {
+        if (selected[i] && run_workload(&workloads[i]) != 0) failed = 1;
+    }
+    close(sync_fd);
+    return failed;
+}
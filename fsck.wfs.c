@@ -1,6 +1,724 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "wfs.h"
 
+char *disk;                     // the whole image, mapped
+size_t disk_size;
+struct wfs_sb *sb;
+
+// Offsets of the records from the start of the log to the head, in order.
+uint64_t *records = NULL;
+uint64_t n_records = 0;
+
+#define MAX_THREADS 64
+int n_threads = 1;              // -j N, the number of CPUs by default
+
+// Latest state of every inode, from one pass over the log, and its share of
+// the log (see profile_log()).
+struct inode_state {
+    uint64_t first;             // offset of the oldest record, 0 if none
+    uint64_t latest;            // offset of the newest record
+    uint64_t base;              // offset of the newest full record
+    int deleted;
+    uint32_t entries;           // names in it, for a directory (see check_dirs())
+    uint64_t records;           // records of it in the log, one per version
+    uint64_t live;              // bytes of its records still needed
+    uint64_t dead;              //   and superseded
+    uint64_t fragments;         // live records, which a read of it puts together
+};
+
+struct inode_state *inodes = NULL;
+unsigned int n_inodes = 0;
+
+// Chunks referred to by live records, sorted (see check_refs()).
+struct wfs_chunk_ref *referenced = NULL;
+uint64_t n_referenced = 0;
+
+struct wfs_inode *record_at(uint64_t offset) {
+    return (struct wfs_inode *) (disk + offset);
+}
+
+int sync_disk() {
+    return msync(disk, disk_size, MS_SYNC);
+}
+
+// Finds the record boundaries from the size in each header. Headers are all
+// it reads, so the checks that read whole records can then split the log into
+// runs of them (see check_records()).
+int index_log() {
+    uint64_t capacity = 0;
+    for (uint64_t offset = wfs_log_next(sb, wfs_log_start(sb)); offset < sb->head;
+            offset = wfs_log_next(sb, offset + sizeof(struct wfs_inode) + record_at(offset)->size)) {
+        if (sb->head - offset < sizeof(struct wfs_inode) ||
+                sb->head - offset - sizeof(struct wfs_inode) < record_at(offset)->size) {
+            fprintf(stderr, "Record at %lu runs past the head\n", (unsigned long) offset);
+            return -1;
+        }
+        if (n_records == capacity) {
+            capacity = capacity > 0 ? 2 * capacity : 4096;
+            uint64_t *grown = realloc(records, capacity * sizeof(uint64_t));
+            if (grown == NULL) return -1;
+            records = grown;
+        }
+        records[n_records++] = offset;
+    }
+    return 0;
+}
+
+// Checks a record on its own: its CRC, and that its type is known and its
+// size fits it. Returns what is wrong, or NULL.
+const char *check_record(uint64_t offset) {
+    struct wfs_inode *inode = record_at(offset);
+    if (wfs_record_crc(inode, inode + 1) != inode->crc) return "fails its checksum";
+
+    struct wfs_extent extent;
+    struct wfs_dentry dentry;
+    switch (inode->flags) {
+    case WFS_RECORD_FULL:
+        if (S_ISDIR(inode->mode) && (inode->raw_size != 0 || inode->size % sizeof(struct wfs_dentry) != 0)) {
+            return "holds a partial directory entry";
+        }
+        return NULL;
+    case WFS_RECORD_EXTENT:
+        if (inode->size < sizeof(extent)) return "is too short for an extent";
+        memcpy(&extent, inode + 1, sizeof(extent));
+        if (extent.length != (inode->raw_size != 0 ? inode->raw_size : inode->size - sizeof(extent))) {
+            return "has an extent of the wrong length";
+        }
+        if (extent.offset + extent.length > extent.file_size) return "has an extent past the end of the file";
+        return NULL;
+    case WFS_RECORD_DENTRY_ADD:
+    case WFS_RECORD_DENTRY_REMOVE:
+        if (inode->size != sizeof(dentry)) return "is not the size of a directory entry";
+        memcpy(&dentry, inode + 1, sizeof(dentry));
+        if (memchr(dentry.name, '\0', sizeof(dentry.name)) == NULL) return "has a name without an end";
+        return NULL;
+    case WFS_RECORD_CHUNK:
+        if (inode->inode_number != WFS_CHUNK_INODE || inode->size < sizeof(struct wfs_chunk_ref)) {
+            return "is not a chunk record";
+        }
+        return NULL;
+    case WFS_RECORD_PAD:
+        if (inode->inode_number != WFS_CHUNK_INODE) return "is not a pad record";
+        return NULL;
+    }
+    return "is of an unknown type";
+}
+
+// A run of records checked by one thread.
+struct slice {
+    uint64_t from, to;          // records[from] up to records[to]
+    uint64_t bad;               // the first that fails, or to
+    const char *error;
+};
+
+void *check_slice(void *arg) {
+    struct slice *slice = arg;
+    slice->bad = slice->to;
+    for (uint64_t i = slice->from; i < slice->to; i++) {
+        if ((slice->error = check_record(records[i])) != NULL) {
+            slice->bad = i;
+            break;
+        }
+    }
+    return NULL;
+}
+
+// Runs check_record() over the whole log, split into n_threads runs of
+// records covering about as many bytes each. Reports the first failure.
+int check_records() {
+    struct slice slices[MAX_THREADS];
+    pthread_t threads[MAX_THREADS];
+    int started[MAX_THREADS];
+    uint64_t log_start = wfs_log_start(sb);
+    uint64_t from = 0;
+    for (int t = 0; t < n_threads; t++) {
+        // the first record starting in the next run
+        uint64_t end = log_start + (sb->head - log_start) / n_threads * (t + 1);
+        uint64_t lo = t < n_threads - 1 ? from : n_records, hi = n_records;
+        while (lo < hi) {
+            uint64_t mid = lo + (hi - lo) / 2;
+            if (records[mid] < end) lo = mid + 1;
+            else hi = mid;
+        }
+        slices[t].from = from;
+        slices[t].to = from = lo;
+        started[t] = pthread_create(&threads[t], NULL, check_slice, &slices[t]) == 0;
+        if (!started[t]) check_slice(&slices[t]);
+    }
+
+    int ret = 0;
+    for (int t = 0; t < n_threads; t++) {
+        if (started[t]) pthread_join(threads[t], NULL);
+        if (ret == 0 && slices[t].bad < slices[t].to) {
+            fprintf(stderr, "Record at %lu %s\n", (unsigned long) records[slices[t].bad], slices[t].error);
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+// Checks every record and builds inodes[]. mount.wfs would cut a log with a
+// torn record or unfinished operation at its end, and fails on the same
+// elsewhere.
+int scan_log() {
+    if (index_log() != 0 || check_records() != 0) return -1;
+
+    struct wfs_inode *last = NULL;
+    for (uint64_t i = 0; i < n_records; i++) {
+        uint64_t offset = records[i];
+        struct wfs_inode *inode = record_at(offset);
+        last = inode;
+        if (inode->inode_number == WFS_CHUNK_INODE) continue; // chunk or pad
+
+        if (inode->inode_number >= n_inodes) {
+            unsigned int new_n = n_inodes > 0 ? n_inodes : 64;
+            while (new_n <= inode->inode_number) new_n *= 2;
+            struct inode_state *new_inodes = realloc(inodes, new_n * sizeof(struct inode_state));
+            if (new_inodes == NULL) return -1;
+            memset(new_inodes + n_inodes, 0, (new_n - n_inodes) * sizeof(struct inode_state));
+            inodes = new_inodes;
+            n_inodes = new_n;
+        }
+
+        struct inode_state *state = &inodes[inode->inode_number];
+        if (state->first == 0) state->first = offset;
+        state->latest = offset;
+        if (inode->flags == WFS_RECORD_FULL) state->base = offset;
+        state->deleted = inode->deleted;
+    }
+    if (last != NULL && last->epoch == sb->epoch && !last->commit) {
+        fprintf(stderr, "Log ends in an unfinished operation\n");
+        return -1;
+    }
+    return 0;
+}
+
+int compare_refs(const void *a, const void *b) {
+    return memcmp(a, b, sizeof(struct wfs_chunk_ref));
+}
+
+// Same rule as mount.wfs: an inode's newest full record and the extent or
+// dentry records after it are live, and a tombstone is live while an older
+// record of the inode starts before start (any start when start is 0). Every
+// chunk record for a referenced hash is kept, where mount.wfs keeps just one.
+int record_is_live(uint64_t offset, uint64_t start) {
+    struct wfs_inode *inode = record_at(offset);
+    if (inode->flags == WFS_RECORD_PAD) return 0;
+    if (inode->flags == WFS_RECORD_CHUNK) {
+        return n_referenced > 0 &&
+            bsearch(inode + 1, referenced, n_referenced, sizeof(struct wfs_chunk_ref), compare_refs) != NULL;
+    }
+    struct inode_state *state = &inodes[inode->inode_number];
+    if (state->deleted) return offset == state->latest && (start == 0 || state->first < start);
+    if (offset == state->base) return 1;
+    return inode->flags != WFS_RECORD_FULL && offset > state->base;
+}
+
+int add_ref(struct wfs_chunk_ref **refs, uint64_t *n, const void *ref) {
+    if ((*n & (*n - 1)) == 0) { // grow at powers of two
+        struct wfs_chunk_ref *grown = realloc(*refs, (*n > 0 ? 2 * *n : 1) * sizeof(struct wfs_chunk_ref));
+        if (grown == NULL) return -1;
+        *refs = grown;
+    }
+    memcpy(&(*refs)[(*n)++], ref, sizeof(struct wfs_chunk_ref));
+    return 0;
+}
+
+// Collects the chunk references in the block tables of live records (see
+// WFS_BLOCK_REF) into referenced[] and checks that each names a chunk record.
+int check_refs() {
+    struct wfs_chunk_ref *chunks = NULL;
+    uint64_t n_chunks = 0;
+    int ret = 0;
+    for (uint64_t i = 0; ret == 0 && i < n_records; i++) {
+        uint64_t offset = records[i];
+        struct wfs_inode *inode = record_at(offset);
+        if (inode->flags == WFS_RECORD_CHUNK) {
+            ret = add_ref(&chunks, &n_chunks, inode + 1);
+            continue;
+        }
+        if (inode->raw_size == 0 || !record_is_live(offset, 0)) continue;
+        if (inode->flags != WFS_RECORD_FULL && inode->flags != WFS_RECORD_EXTENT) continue;
+
+        uint64_t skip = inode->flags == WFS_RECORD_EXTENT ? sizeof(struct wfs_extent) : 0;
+        uint64_t n_blocks = (inode->raw_size + WFS_COMPRESS_BLOCK - 1) / WFS_COMPRESS_BLOCK;
+        char *data = (char *) (inode + 1) + skip;
+        char *blocks = data + n_blocks * sizeof(uint64_t);
+        uint64_t stored = inode->size - skip;
+        for (uint64_t j = 0; ret == 0 && j < n_blocks; j++) {
+            uint64_t end;
+            memcpy(&end, data + j * sizeof(uint64_t), sizeof(end));
+            if (!(end & WFS_BLOCK_REF)) continue;
+            end &= ~WFS_BLOCK_REF;
+            if (n_blocks * sizeof(uint64_t) + end > stored || end < sizeof(struct wfs_chunk_ref)) {
+                fprintf(stderr, "Record at %lu has a bad block table\n", (unsigned long) offset);
+                ret = -1;
+            } else {
+                ret = add_ref(&referenced, &n_referenced, blocks + end - sizeof(struct wfs_chunk_ref));
+            }
+        }
+    }
+
+    if (n_chunks > 0) qsort(chunks, n_chunks, sizeof(struct wfs_chunk_ref), compare_refs);
+    if (n_referenced > 0) qsort(referenced, n_referenced, sizeof(struct wfs_chunk_ref), compare_refs);
+    for (uint64_t i = 0; ret == 0 && i < n_referenced; i++) {
+        if (n_chunks == 0 || bsearch(&referenced[i], chunks, n_chunks, sizeof(struct wfs_chunk_ref), compare_refs) == NULL) {
+            fprintf(stderr, "Reference to a missing chunk %016lx%016lx\n",
+                    (unsigned long) referenced[i].hash[0], (unsigned long) referenced[i].hash[1]);
+            ret = -1;
+        }
+    }
+    free(chunks);
+    return ret;
+}
+
+// An entry of a directory's latest full record, or a later dentry record.
+struct dir_op {
+    uint32_t dir;
+    uint32_t remove;            // a dentry remove record
+    uint64_t seq;               // offset of the record, which orders the ops on a name
+    struct wfs_dentry dentry;
+};
+
+int compare_dir_ops(const void *a, const void *b) {
+    const struct dir_op *x = a, *y = b;
+    if (x->dir != y->dir) return x->dir < y->dir ? -1 : 1;
+    int cmp = strncmp(x->dentry.name, y->dentry.name, MAX_FILE_NAME_LEN);
+    if (cmp != 0) return cmp;
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+int add_dir_op(struct dir_op **ops, uint64_t *n, uint32_t dir, uint32_t remove, uint64_t seq, const void *dentry) {
+    if ((*n & (*n - 1)) == 0) { // grow at powers of two
+        struct dir_op *grown = realloc(*ops, (*n > 0 ? 2 * *n : 1) * sizeof(struct dir_op));
+        if (grown == NULL) return -1;
+        *ops = grown;
+    }
+    struct dir_op *op = &(*ops)[(*n)++];
+    op->dir = dir;
+    op->remove = remove;
+    op->seq = seq;
+    memcpy(&op->dentry, dentry, sizeof(op->dentry));
+    return 0;
+}
+
+// Puts every live directory together as mount.wfs would, from its latest full
+// record and the dentry records after it, all at once: the ops on each name
+// are sorted into log order and replayed. Checks that no directory has a name
+// twice and that every entry refers to an inode that is there, and counts
+// the entries of each directory.
+int check_dirs() {
+    struct dir_op *ops = NULL;
+    uint64_t n_ops = 0;
+    int ret = 0;
+    for (uint64_t i = 0; ret == 0 && i < n_records; i++) {
+        uint64_t offset = records[i];
+        struct wfs_inode *inode = record_at(offset);
+        if (inode->inode_number == WFS_CHUNK_INODE) continue;
+        struct inode_state *state = &inodes[inode->inode_number];
+        if (state->deleted || offset < state->base) continue;
+        if (inode->flags == WFS_RECORD_FULL && offset == state->base && S_ISDIR(inode->mode)) {
+            char *dentries = (char *) (inode + 1);
+            for (uint64_t j = 0; ret == 0 && j < inode->size / sizeof(struct wfs_dentry); j++) {
+                char *dentry = dentries + j * sizeof(struct wfs_dentry);
+                if (memchr(dentry, '\0', MAX_FILE_NAME_LEN) == NULL) {
+                    fprintf(stderr, "Record at %lu has a name without an end\n", (unsigned long) offset);
+                    ret = -1;
+                } else {
+                    ret = add_dir_op(&ops, &n_ops, inode->inode_number, 0, offset, dentry);
+                }
+            }
+        } else if (inode->flags == WFS_RECORD_DENTRY_ADD || inode->flags == WFS_RECORD_DENTRY_REMOVE) {
+            ret = add_dir_op(&ops, &n_ops, inode->inode_number, inode->flags == WFS_RECORD_DENTRY_REMOVE, offset, inode + 1);
+        }
+    }
+    if (n_ops > 0) qsort(ops, n_ops, sizeof(struct dir_op), compare_dir_ops);
+
+    for (uint64_t i = 0; ret == 0 && i < n_ops; ) {
+        struct dir_op *op = &ops[i];
+        const struct wfs_dentry *entry = NULL;
+        for (; i < n_ops && ops[i].dir == op->dir && strcmp(ops[i].dentry.name, op->dentry.name) == 0; i++) {
+            if (ops[i].remove) {
+                entry = NULL;
+            } else if (entry != NULL) {
+                fprintf(stderr, "Directory %u has two entries named %s\n", op->dir, op->dentry.name);
+                ret = -1;
+            } else {
+                entry = &ops[i].dentry;
+            }
+        }
+        if (entry == NULL) continue;
+        inodes[op->dir].entries++;
+        if (entry->inode_number >= n_inodes || inodes[entry->inode_number].first == 0 ||
+                inodes[entry->inode_number].deleted) {
+            fprintf(stderr, "Entry %s of directory %u refers to a missing inode %lu\n", entry->name, op->dir,
+                    (unsigned long) entry->inode_number);
+            ret = -1;
+        }
+    }
+    free(ops);
+    return ret;
+}
+
+// Lists the snapshots and checks that each ends where a record does, at or
+// below the head, and that no compaction is under way below the newest.
+int check_snapshots() {
+    unsigned int found = 0;
+    for (uint64_t i = 0; i < n_records; i++) {
+        uint64_t end = records[i] + sizeof(struct wfs_inode) + record_at(records[i])->size;
+        for (int j = 0; j < WFS_MAX_SNAPSHOTS; j++) {
+            if (sb->snapshots[j].name[0] != '\0' && sb->snapshots[j].head == end) found |= 1u << j;
+        }
+    }
+
+    int ret = 0;
+    for (int i = 0; i < WFS_MAX_SNAPSHOTS; i++) {
+        struct wfs_snapshot *snapshot = &sb->snapshots[i];
+        if (snapshot->name[0] == '\0') continue;
+        printf("Snapshot %.*s: head %lu, epoch %lu\n", MAX_FILE_NAME_LEN, snapshot->name,
+               (unsigned long) snapshot->head, (unsigned long) snapshot->epoch);
+        if (!(found & (1u << i)) || snapshot->epoch > sb->epoch) {
+            fprintf(stderr, "Snapshot %.*s does not end at a record\n", MAX_FILE_NAME_LEN, snapshot->name);
+            ret = -1;
+        }
+    }
+    if (sb->hole_end > sb->hole_start && sb->hole_start < wfs_snapshot_floor(sb)) {
+        fprintf(stderr, "Compaction hole below the newest snapshot\n");
+        ret = -1;
+    }
+    return ret;
+}
+
+int set_log_hole(uint64_t hole_start, uint64_t hole_end) {
+    sb->hole_start = hole_start;
+    sb->hole_end = hole_end;
+    if (hole_end >= sb->head) {
+        sb->head = hole_start;
+        sb->hole_start = sb->hole_end = 0;
+    }
+    sb->move_src = sb->move_dst = sb->move_len = sb->move_end = 0;
+    sb->epoch++;                // records moved, so mount.wfs checkpoints are stale
+    return sync_disk();
+}
+
+int finish_log_move() {
+    memcpy(disk + sb->move_dst, disk + sb->move_src, sb->move_len);
+    if (sync_disk() != 0) return -1;
+    return set_log_hole(sb->move_dst + sb->move_len, sb->move_end);
+}
+
+// Accounts every record from floor to the head to the WFS_SEGMENT_SIZE
+// segment it starts in (see wfs_pick_compaction()). Returns the dead bytes.
+// Pad records are neither: they only keep the log block-aligned.
+uint64_t count_segments(uint64_t floor, struct wfs_segment *segments) {
+    uint64_t log_start = wfs_log_start(sb);
+    uint64_t free_space = disk_size - sb->head;
+    uint64_t total_dead = 0;
+    for (uint64_t offset = wfs_log_next(sb, floor); offset < sb->head;
+            offset = wfs_log_next(sb, offset + sizeof(struct wfs_inode) + record_at(offset)->size)) {
+        struct wfs_segment *segment = &segments[(offset - log_start) / WFS_SEGMENT_SIZE];
+        uint64_t length = sizeof(struct wfs_inode) + record_at(offset)->size;
+        if (segment->start == 0) segment->start = offset;
+        if (record_at(offset)->flags == WFS_RECORD_PAD) continue;
+        if (record_is_live(offset, 0)) {
+            segment->live += length;
+            if (length > free_space && length > segment->dead + segment->hole_needed) {
+                segment->hole_needed = length - segment->dead;
+            }
+        } else {
+            segment->dead += length;
+            total_dead += length;
+        }
+    }
+    return total_dead;
+}
+
+// Bytes of intact records of the current epoch right after the head, which
+// the superblock missed. mount.wfs takes in those whose operations are
+// complete.
+uint64_t past_head() {
+    uint64_t offset = sb->head;
+    while (disk_size - offset >= sizeof(struct wfs_inode)) {
+        struct wfs_inode *inode = record_at(offset);
+        if ((inode->atime == 0 && inode->crc == 0) || inode->epoch != sb->epoch) break;
+        if (disk_size - offset - sizeof(struct wfs_inode) < inode->size) break;
+        if (wfs_record_crc(inode, inode + 1) != inode->crc) break;
+        offset += sizeof(struct wfs_inode) + inode->size;
+    }
+    return offset - sb->head;
+}
+
+// Prints how the log is laid out: how much of it is live, how many versions
+// of each inode it holds, how big directories are and how many records files
+// are spread over, per inode too if asked. Ends with the compaction --compact
+// would pick, to tell whether one pays off yet.
+int report(int per_inode) {
+    uint64_t live = 0, dead = 0, n_chunks = 0, live_chunks = 0, n_pads = 0, pad_bytes = 0;
+    if (n_inodes == 0) return 0;
+    for (uint64_t i = 0; i < n_records; i++) {
+        struct wfs_inode *inode = record_at(records[i]);
+        uint64_t length = sizeof(struct wfs_inode) + inode->size;
+        // padding is reported on its own
+        if (inode->flags == WFS_RECORD_PAD) {
+            n_pads++;
+            pad_bytes += length;
+            continue;
+        }
+        int is_live = record_is_live(records[i], 0);
+        if (is_live) live += length;
+        else dead += length;
+        if (inode->flags == WFS_RECORD_CHUNK) {
+            n_chunks++;
+            live_chunks += is_live;
+            continue;
+        }
+        struct inode_state *state = &inodes[inode->inode_number];
+        state->records++;
+        if (is_live) {
+            state->live += length;
+            state->fragments++;
+        } else {
+            state->dead += length;
+        }
+    }
+    printf("Log: %lu records, %lu live bytes, %lu dead (%.1f%%)\n", (unsigned long) n_records,
+           (unsigned long) live, (unsigned long) dead, live + dead > 0 ? 100.0 * dead / (live + dead) : 0.0);
+    if (n_chunks > 0) {
+        printf("Chunks: %lu records, %lu live\n", (unsigned long) n_chunks, (unsigned long) live_chunks);
+    }
+    if (n_pads > 0) printf("Padding: %lu records, %lu bytes\n", (unsigned long) n_pads, (unsigned long) pad_bytes);
+
+    unsigned int n_files = 0, n_dirs = 0, n_deleted = 0;
+    unsigned int most_records = 0, most_entries = 0, most_fragments = 0; // inodes with the most
+    uint64_t versions = 0, entries = 0, fragments = 0, max_fragments = 0;
+    if (per_inode) {
+        printf("%10s %4s %8s %12s %12s %9s %8s\n", "inode", "type", "records", "live", "dead", "fragments", "entries");
+    }
+    for (unsigned int i = 0; i < n_inodes; i++) {
+        struct inode_state *state = &inodes[i];
+        if (state->first == 0) continue;
+        int is_dir = S_ISDIR(record_at(state->latest)->mode);
+        if (state->deleted) n_deleted++;
+        else if (is_dir) n_dirs++;
+        else n_files++;
+        versions += state->records;
+        if (state->records > inodes[most_records].records) most_records = i;
+        if (!state->deleted && is_dir) {
+            entries += state->entries;
+            if (state->entries > inodes[most_entries].entries) most_entries = i;
+        } else if (!state->deleted) {
+            fragments += state->fragments;
+            if (state->fragments > max_fragments) {
+                max_fragments = state->fragments;
+                most_fragments = i;
+            }
+        }
+        if (per_inode) {
+            printf("%10u %4s %8lu %12lu %12lu %9lu %8u\n", i, state->deleted ? "del" : is_dir ? "dir" : "file",
+                   (unsigned long) state->records, (unsigned long) state->live, (unsigned long) state->dead,
+                   (unsigned long) state->fragments, state->entries);
+        }
+    }
+    unsigned int n_live = n_files + n_dirs;
+    printf("Inodes: %u files, %u directories, %u deleted; %.1f records each, most %lu (inode %u)\n",
+           n_files, n_dirs, n_deleted, n_live + n_deleted > 0 ? (double) versions / (n_live + n_deleted) : 0.0,
+           (unsigned long) inodes[most_records].records, most_records);
+    printf("Directories: %.1f entries each, most %u (inode %u)\n", n_dirs > 0 ? (double) entries / n_dirs : 0.0,
+           inodes[most_entries].entries, most_entries);
+    printf("Fragmentation: %.2f live records per file, most %lu (inode %u)\n",
+           n_files > 0 ? (double) fragments / n_files : 0.0, (unsigned long) max_fragments, most_fragments);
+
+    uint64_t past = past_head();
+    if (past > 0) printf("Records past the head: %lu bytes\n", (unsigned long) past);
+
+    uint64_t log_start = wfs_log_start(sb);
+    uint64_t floor = wfs_snapshot_floor(sb);
+    int n_segments = (sb->head - log_start) / WFS_SEGMENT_SIZE + 1;
+    struct wfs_segment *segments = calloc(n_segments, sizeof(struct wfs_segment));
+    if (segments == NULL) return -1;
+    count_segments(floor, segments);
+    int skipped = (floor - log_start) / WFS_SEGMENT_SIZE;
+    int chosen = wfs_pick_compaction(segments + skipped, n_segments - skipped, 0);
+    if (chosen < 0) {
+        printf("Compaction: nothing to reclaim\n");
+    } else {
+        uint64_t moved = 0, reclaimed = 0;
+        for (int i = skipped + chosen; i < n_segments; i++) {
+            moved += segments[i].live;
+            reclaimed += segments[i].dead;
+        }
+        printf("Compaction: from %lu, reclaims %lu bytes and moves %lu (ratio %.2f)\n",
+               (unsigned long) segments[skipped + chosen].start, (unsigned long) reclaimed, (unsigned long) moved,
+               (double) reclaimed / (reclaimed + 3 * moved));
+    }
+    free(segments);
+    return 0;
+}
+
+// Offline version of the mount.wfs cleaner: picks the suffix of the log above
+// the newest snapshot with the best cost-benefit ratio and slides its live
+// records down a window at a time, leaving the image valid after a crash at
+// any point.
+int compact_log() {
+    uint64_t log_start = wfs_log_start(sb);
+    uint64_t floor = wfs_snapshot_floor(sb);
+    uint64_t old_head = sb->head;
+    int n_segments = (old_head - log_start) / WFS_SEGMENT_SIZE + 1;
+    struct wfs_segment *segments = calloc(n_segments, sizeof(struct wfs_segment));
+    if (segments == NULL) return -1;
+
+    uint64_t free_space = disk_size - old_head;
+    uint64_t total_dead = count_segments(floor, segments);
+
+    uint64_t start = sb->hole_start;
+    if (sb->hole_end <= sb->hole_start) {
+        // offline there is time to spare, so insist on reclaiming at least half
+        int skipped = (floor - log_start) / WFS_SEGMENT_SIZE;
+        int chosen = wfs_pick_compaction(segments + skipped, n_segments - skipped, total_dead / 2);
+        if (chosen < 0) {
+            free(segments);
+            printf("Nothing worth compacting (%lu dead bytes)\n", (unsigned long) total_dead);
+            return 0;
+        }
+        start = segments[skipped + chosen].start;
+        while (start < old_head && record_is_live(start, 0)) {
+            start += sizeof(struct wfs_inode) + record_at(start)->size;
+        }
+        sb->hole_start = sb->hole_end = start;
+    }
+    free(segments);
+
+    // as in mount.wfs, records staged past the head must be from an older
+    // epoch than the superblock's
+    sb->epoch++;
+    if (sync_disk() != 0) return -1;
+
+    while (sb->hole_end < sb->head) {
+        uint64_t next = sb->hole_end;
+        uint64_t hole_size = sb->hole_end - sb->hole_start;
+        uint64_t staged = 0;
+        int direct = -1;
+
+        while (next < sb->head) {
+            uint64_t length = sizeof(struct wfs_inode) + record_at(next)->size;
+            if (record_is_live(next, start)) {
+                if (direct < 0) direct = length <= hole_size;
+                uint64_t limit = direct ? hole_size : free_space;
+                if (staged + length > limit || staged + length > WFS_MAX_WINDOW) break;
+                memcpy(disk + (direct ? sb->hole_start : sb->head) + staged, disk + next, length);
+                staged += length;
+            }
+            next += length;
+        }
+        if (next == sb->hole_end) {
+            // what was compacted so far stays, but the compaction failed
+            fprintf(stderr, "Not enough free space to move the record at %lu\n", (unsigned long) next);
+            sync_disk();
+            return -1;
+        }
+        if (sync_disk() != 0) return -1;
+
+        if (direct == 0) {
+            sb->move_src = sb->head;
+            sb->move_dst = sb->hole_start;
+            sb->move_len = staged;
+            sb->move_end = next;
+            if (sync_disk() != 0 || finish_log_move() != 0) return -1;
+        } else if (set_log_hole(sb->hole_start + staged, next) != 0) {
+            return -1;
+        }
+        if (sb->hole_end <= sb->hole_start) break; // reached the head
+    }
+
+    // a block-aligned image gets its head back on a boundary. The pad is
+    // written before the head moves past it
+    uint64_t pad_length = sb->flags & WFS_SB_ALIGNED ? wfs_pad_length(sb->head) : 0;
+    if (pad_length > 0 && sb->head + pad_length <= disk_size) {
+        struct wfs_inode *pad = record_at(sb->head);
+        wfs_pad_record(pad, pad_length, sb->epoch);
+        memset(pad + 1, 0, pad->size);
+        if (sync_disk() != 0) return -1;
+        sb->head += pad_length;
+        if (sync_disk() != 0) return -1;
+    }
+
+    printf("Compacted log: head %lu -> %lu, reclaimed %lu bytes\n", (unsigned long) old_head,
+           (unsigned long) sb->head, (unsigned long) (old_head - sb->head));
+    return 0;
+}
+
 int main(int argc, char *argv[]) {
+    int compact = 0, profile = 0;
+    const char *disk_path = NULL;
+    n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--compact") == 0) compact = 1;
+        else if (strcmp(argv[i], "--profile") == 0) profile = 1;
+        else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) n_threads = atoi(argv[++i]);
+        else disk_path = argv[i];
+    }
+    if (disk_path == NULL) {
+        fprintf(stderr, "Usage: %s [--compact] [--profile] [-j <threads>] <disk_path>\n", argv[0]);
+        return 1;
+    }
+    if (n_threads < 1) n_threads = 1;
+    if (n_threads > MAX_THREADS) n_threads = MAX_THREADS;
+
+    // only --compact writes to the image
+    int fd = open(disk_path, compact ? O_RDWR : O_RDONLY);
+    struct stat disk_stat;
+    if (fd == -1 || fstat(fd, &disk_stat) != 0) {
+        perror("Failed to open disk file");
+        return 1;
+    }
+    disk_size = disk_stat.st_size;
+    if (disk_size < sizeof(struct wfs_sb)) {
+        fprintf(stderr, "Disk is too small\n");
+        return 1;
+    }
+    disk = mmap(NULL, disk_size, compact ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    if (disk == MAP_FAILED) {
+        perror("Failed to map disk");
+        return 1;
+    }
+    sb = (struct wfs_sb *) disk;
+
+    if (sb->magic == WFS_MAGIC && sb->version != WFS_VERSION) {
+        fprintf(stderr, "Unsupported filesystem version %u\n", sb->version);
+        return 1;
+    }
+    if (sb->magic != WFS_MAGIC || sb->head > disk_size || wfs_log_start(sb) > sb->head) {
+        fprintf(stderr, "Invalid filesystem format\n");
+        return 1;
+    }
+    if ((sb->hole_end > sb->hole_start && (sb->hole_start < wfs_log_start(sb) || sb->hole_end > sb->head)) ||
+            (sb->move_len != 0 && (sb->move_src < sb->head || sb->move_src + sb->move_len > disk_size ||
+                                   sb->move_dst < wfs_log_start(sb) || sb->move_end > sb->head))) {
+        fprintf(stderr, "Invalid compaction state\n");
+        return 1;
+    }
+
+    // an interrupted compaction is completed by mount.wfs or --compact
+    if (sb->move_len != 0) {
+        printf("Compaction move pending\n");
+        if (compact && finish_log_move() != 0) return 1;
+    }
+
+    if (scan_log() != 0 || check_refs() != 0 || check_dirs() != 0 || check_snapshots() != 0) return 1;
+    if (report(profile) != 0) return 1;
+    if (compact && compact_log() != 0) {
+        fprintf(stderr, "Compaction failed\n");
+        return 1;
+    }
+
+    munmap(disk, disk_size);
+    close(fd);
     return 0;
-}
\ No newline at end of file
+}
@@ -4,28 +4,90 @@
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <time.h>
 
+// Parses a size such as 4096, 512K, 64M or 8G.
+int parse_size(const char *arg, uint64_t *size) {
+    char *end;
+    unsigned long long value = strtoull(arg, &end, 10);
+    int shift = 0;
+    switch (*end) {
+    case 'K': case 'k': shift = 10; end++; break;
+    case 'M': case 'm': shift = 20; end++; break;
+    case 'G': case 'g': shift = 30; end++; break;
+    case 'T': case 't': shift = 40; end++; break;
+    }
+    if (end == arg || *end != '\0' || value > (UINT64_MAX >> shift)) return -1;
+    *size = (uint64_t) value << shift;
+    return 0;
+}
+
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <disk_path>\n", argv[0]);
+    uint64_t disk_size = DISK_SIZE;
+    uint64_t checkpoint_size = UINT64_MAX; // default: 1/64 of the disk
+    uint64_t flags = 0;
+    const char *disk_path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-z") == 0) {
+            flags |= WFS_SB_COMPRESS;
+        } else if (strcmp(argv[i], "-d") == 0) {
+            flags |= WFS_SB_DEDUP;
+        } else if (strcmp(argv[i], "-a") == 0) {
+            flags |= WFS_SB_ALIGNED;
+        } else if ((strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "-c") == 0) && i + 1 < argc) {
+            if (parse_size(argv[i + 1], argv[i][1] == 's' ? &disk_size : &checkpoint_size) != 0) {
+                fprintf(stderr, "Invalid size: %s\n", argv[i + 1]);
+                return 1;
+            }
+            i++;
+        } else if (disk_path == NULL) {
+            disk_path = argv[i];
+        } else {
+            disk_path = NULL;
+            break;
+        }
+    }
+    if (disk_path == NULL) {
+        fprintf(stderr, "Usage: %s [-s <size>[K|M|G|T]] [-c <checkpoint slot size>] [-z] [-d] [-a] <disk_path>\n", argv[0]);
         return 1;
     }
 
-    const char *disk_path = argv[1];
-    int fd = open(disk_path, O_RDWR | O_CREAT, 0666);
+    // Initialize the superblock. Each of the two checkpoint slots should hold
+    // about 48 bytes per inode; -c 0 turns checkpoints off.
+    struct wfs_sb sb;
+    memset(&sb, 0, sizeof(sb));
+    sb.magic = WFS_MAGIC;
+    sb.version = WFS_VERSION;
+    sb.max_size = disk_size;
+    sb.flags = flags;
+    if (checkpoint_size == UINT64_MAX) {
+        checkpoint_size = (disk_size / 64) & ~(uint64_t) 4095;
+        if (checkpoint_size < 4096) checkpoint_size = 4096;
+    }
+    sb.checkpoint_size = checkpoint_size;
+    sb.head = wfs_log_start(&sb) + sizeof(struct wfs_log_entry);
+    // a block-aligned image starts its log with the root padded to a block
+    uint64_t pad_length = 0;
+    if (flags & WFS_SB_ALIGNED) {
+        sb.max_size = disk_size &= ~(uint64_t) (WFS_BLOCK_SIZE - 1);
+        pad_length = wfs_pad_length(sb.head);
+        sb.head += pad_length;
+    }
+    if (disk_size < sb.head) {
+        fprintf(stderr, "Disk size too small\n");
+        return 1;
+    }
+
+    // truncated so that no checkpoint of an earlier filesystem survives
+    int fd = open(disk_path, O_RDWR | O_CREAT | O_TRUNC, 0666);
     if (fd == -1) {
         perror("Failed to open disk file");
         return 1;
     }
 
-    // Initialize the superblock
-    struct wfs_sb sb;
-    sb.magic = WFS_MAGIC;
-    sb.head = sizeof(struct wfs_sb) + sizeof(struct wfs_log_entry);
-
     if (write(fd, &sb, sizeof(sb)) != sizeof(sb)) {
         perror("Failed to write superblock");
         close(fd);
@@ -34,6 +96,7 @@ int main(int argc, char *argv[]) {
 
     // Initialize root directory's inode
     struct wfs_inode root_inode;
+    memset(&root_inode, 0, sizeof(root_inode));
     root_inode.inode_number = 0; // root directory
     root_inode.deleted = 0;
     root_inode.mode = S_IFDIR; // directory
@@ -43,22 +106,43 @@ int main(int argc, char *argv[]) {
     root_inode.size = 0;
     root_inode.atime = root_inode.mtime = root_inode.ctime = time(NULL);
     root_inode.links = 1;
+    root_inode.epoch = sb.epoch;
+    root_inode.commit = 1;
+    root_inode.crc = wfs_record_crc(&root_inode, NULL);
 
     struct wfs_log_entry root_entry;
     root_entry.inode = root_inode;
 
-    if (write(fd, &root_entry, sizeof(root_entry)) != sizeof(root_entry)) {
+    if (pwrite(fd, &root_entry, sizeof(root_entry), wfs_log_start(&sb)) != sizeof(root_entry)) {
         perror("Failed to write root log entry");
         close(fd);
         return 1;
     }
+    if (pad_length > 0) {
+        struct wfs_inode pad;
+        wfs_pad_record(&pad, pad_length, sb.epoch);
+        if (pwrite(fd, &pad, sizeof(pad), wfs_log_start(&sb) + sizeof(root_entry)) != sizeof(pad)) {
+            perror("Failed to write pad record");
+            close(fd);
+            return 1;
+        }
+    }
 
-    // Set the file size to 1MB (or desired size)
-    if (ftruncate(fd, DISK_SIZE) == -1) {
+    // Large images start with one chunk; mount.wfs grows them as the log fills
+    off_t initial_size = sb.head + WFS_GROW_CHUNK;
+    if (initial_size > disk_size) initial_size = disk_size;
+    if (ftruncate(fd, initial_size) == -1) {
         perror("Failed to set disk size");
         close(fd);
         return 1;
     }
+    int err = posix_fallocate(fd, 0, initial_size);
+    if (err != 0 && err != EOPNOTSUPP && err != EINVAL) {
+        errno = err;
+        perror("Failed to allocate disk space");
+        close(fd);
+        return 1;
+    }
 
     close(fd);
     return 0;
@@ -1,5 +1,6 @@
+#define _GNU_SOURCE
 #define FUSE_USE_VERSION 30
-#include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
@@ -9,663 +10,4533 @@
 #include <time.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
 
 char *disk_path;
-int next_inode_num = 1;
+int next_inode_num = 1;          // guarded by map_lock
 struct wfs_sb superblock;
 int fd;
+const char *snapshot_name = NULL; // --snapshot=NAME mounts that snapshot
+int read_only = 0;              //   read-only, with the superblock's head and epoch its own
+_Atomic off_t disk_size;        // current size of the image file, see grow_disk()
+off_t max_size;                 // size the image may grow to
+pthread_mutex_t grow_lock = PTHREAD_MUTEX_INITIALIZER;
 
-char* get_parent_directory(const char *path) {
-    // Find the last occurrence of '/'
-    char *last_slash = strrchr(path, '/');
-    if (last_slash == NULL) {
-        // No slash found, return an empty string or NULL
-        return strdup("");
+// Statistics, readable as STATS_NAME in the root (see stats_format()); writing "reset" to
+// it zeroes the counters. Every FUSE operation is timed into a histogram of
+// power-of-two buckets: bucket i counts latencies under 2^i microseconds, the
+// last one everything slower. Counters are bumped without ordering, so a
+// snapshot is only roughly consistent across them.
+#define STATS_NAME ".wfs_stats"
+#define LATENCY_BUCKETS 24
+
+enum { OP_LOOKUP, OP_GETATTR, OP_READ, OP_WRITE, OP_MKDIR, OP_MKNOD, OP_UNLINK, OP_READDIR, OP_RENAME, OP_SETATTR, N_OPS };
+const char *op_names[N_OPS] = { "lookup", "getattr", "read", "write", "mkdir", "mknod", "unlink", "readdir", "rename", "setattr" };
+
+struct op_stats {
+    _Atomic uint64_t count;
+    _Atomic uint64_t errors;
+    _Atomic uint64_t total_ns;
+    _Atomic uint64_t buckets[LATENCY_BUCKETS];
+};
+
+// Nothing but counters, so it can be reset as an array of them.
+struct stats {
+    struct op_stats ops[N_OPS];
+    _Atomic uint64_t lookups;           // names looked up in a directory
+    _Atomic uint64_t dir_hits;          // directory tables found loaded
+    _Atomic uint64_t dir_loads;         //   or loaded from the log
+    _Atomic uint64_t dir_records;       // records replayed by those loads
+    _Atomic uint64_t file_reads;
+    _Atomic uint64_t file_records;      // full and extent records those reads touched
+    _Atomic uint64_t zero_copy_reads;   //   of which answered from the image directly
+    _Atomic uint64_t arena_chunks;      // chunks the per-operation arenas allocated
+    _Atomic uint64_t appends;
+    _Atomic uint64_t appended_bytes;
+    _Atomic uint64_t superblock_writes;
+    _Atomic uint64_t consolidations;
+    _Atomic uint64_t cleaner_passes;
+    _Atomic uint64_t reclaimed_bytes;
+    _Atomic uint64_t checkpoints;
+    _Atomic uint64_t compressed_raw_bytes;      // file data compressed
+    _Atomic uint64_t compressed_stored_bytes;   //   and what it took in the log
+    _Atomic uint64_t dedup_shared_blocks;       // blocks written as references to a chunk
+    _Atomic uint64_t dedup_shared_bytes;
+    _Atomic uint64_t dedup_chunks_written;
+    _Atomic uint64_t buffered_writes;           // writes absorbed by write-back buffers
+    _Atomic uint64_t buffer_flushes;            //   and the records flushing them appended
+    _Atomic uint64_t ring_submits;              // io_uring submissions
+    _Atomic uint64_t ring_requests;             //   and the requests they carried
+    _Atomic uint64_t direct_reads;              // reads and writes made with O_DIRECT
+    _Atomic uint64_t direct_writes;
+    _Atomic uint64_t pad_bytes;                 // pad records appended (see WFS_SB_ALIGNED)
+} stats;
+
+#define STAT_ADD(counter, n) atomic_fetch_add_explicit(&stats.counter, (n), memory_order_relaxed)
+
+uint64_t stats_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Accounts an operation that started at start and returned ret.
+void stats_op(int op, uint64_t start, int ret) {
+    uint64_t ns = stats_now() - start;
+    uint64_t us = ns / 1000;
+    int bucket = us == 0 ? 0 : 64 - __builtin_clzll(us);
+    if (bucket >= LATENCY_BUCKETS) bucket = LATENCY_BUCKETS - 1;
+    struct op_stats *op_stats = &stats.ops[op];
+    atomic_fetch_add_explicit(&op_stats->count, 1, memory_order_relaxed);
+    if (ret < 0) atomic_fetch_add_explicit(&op_stats->errors, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&op_stats->total_ns, ns, memory_order_relaxed);
+    atomic_fetch_add_explicit(&op_stats->buckets[bucket], 1, memory_order_relaxed);
+}
+
+void stats_reset() {
+    _Atomic uint64_t *counters = (_Atomic uint64_t *) &stats;
+    for (int i = 0; i < sizeof(stats) / sizeof(*counters); i++) {
+        atomic_store_explicit(&counters[i], 0, memory_order_relaxed);
+    }
+}
+
+// Per-operation arena. Memory an operation only needs until it is done
+// (record copies, block tables, decompression scratch, iovec arrays, reply
+// buffers) comes from a thread-local arena that is reset once the operation
+// has replied, rather than from malloc. Allocations are stacked in chunks of
+// ARENA_CHUNK, larger ones in a chunk of their own; arena_free() pops the
+// last allocation and is a no-op for any other, which is enough for the
+// read-and-release loops to reuse the same bytes. A reset keeps one chunk,
+// so a thread serving requests doesn't allocate at all in the steady state.
+#define ARENA_CHUNK (256 * 1024)
+#define ARENA_ALIGN 16          // alignment of allocations, and size of the header before each
+
+struct arena_chunk {
+    struct arena_chunk *next;   // older chunks
+    size_t size;
+    size_t used;
+    size_t top;                 // header of the last allocation, if used isn't 0
+    _Alignas(ARENA_ALIGN) char data[];
+};
+
+_Thread_local struct arena_chunk *arena;
+pthread_key_t arena_key;        // frees a thread's chunks when it exits
+
+void *arena_alloc(size_t size) {
+    size_t needed = ARENA_ALIGN + ((size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1));
+    if (arena == NULL || arena->size - arena->used < needed) {
+        size_t chunk_size = needed > ARENA_CHUNK ? needed : ARENA_CHUNK;
+        struct arena_chunk *chunk = malloc(sizeof(*chunk) + chunk_size);
+        if (chunk == NULL) return NULL;
+        chunk->next = arena;
+        chunk->size = chunk_size;
+        chunk->used = 0;
+        arena = chunk;
+        pthread_setspecific(arena_key, arena);
+        STAT_ADD(arena_chunks, 1);
+    }
+    size_t *header = (size_t *) (arena->data + arena->used);
+    *header = arena->top;
+    arena->top = arena->used;
+    arena->used += needed;
+    return (char *) header + ARENA_ALIGN;
+}
+
+void arena_free(void *p) {
+    if (p == NULL || arena == NULL || arena->used == 0 || (char *) p != arena->data + arena->top + ARENA_ALIGN) return;
+    arena->used = arena->top;
+    arena->top = *(size_t *) (arena->data + arena->top);
+    if (arena->used == 0 && arena->size > ARENA_CHUNK) {
+        struct arena_chunk *chunk = arena;
+        arena = chunk->next;
+        pthread_setspecific(arena_key, arena);
+        free(chunk);
+    }
+}
+
+static void free_arena_chunks(void *chunks) {
+    for (struct arena_chunk *chunk = chunks, *next; chunk != NULL; chunk = next) {
+        next = chunk->next;
+        free(chunk);
+    }
+}
+
+// Frees everything allocated since the last reset.
+void arena_reset() {
+    struct arena_chunk *head = arena, *keep = NULL;
+    while (arena != NULL) {
+        struct arena_chunk *next = arena->next;
+        if (keep == NULL && arena->size == ARENA_CHUNK) keep = arena;
+        else free(arena);
+        arena = next;
+    }
+    if (keep != NULL) {
+        keep->next = NULL;
+        keep->used = 0;
+    }
+    arena = keep;
+    if (arena != head) pthread_setspecific(arena_key, arena);
+}
+
+// --mmap: access the image through a shared mapping. Records are then read in
+// place instead of being copied out, and appends are copied straight into the
+// mapping and pushed to disk at each superblock update (asynchronously) and on
+// fsync/unmount (synchronously). The mapping sits at the start of an address
+// range of max_size reserved at mount, so growing the image extends it in
+// place and pointers into it stay valid.
+int use_mmap = 0;
+char *disk_map = NULL;
+off_t dirty_from = -1;          // log range written since the last msync,
+off_t dirty_to = -1;            //   not counting the superblock
+pthread_mutex_t dirty_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Log tail. An append reserves its range by bumping log_tail, without taking
+// a lock, and fills it while other appends fill theirs. superblock.head is
+// then advanced over the range in reservation order, so the head that gets
+// persisted never covers a record that is still being written.
+_Atomic off_t log_tail;
+_Atomic off_t log_promised;     // room make_room() set aside for operations in flight
+_Thread_local off_t my_promise; //   of which this thread's operation holds this much
+pthread_mutex_t sb_lock = PTHREAD_MUTEX_INITIALIZER; // superblock.head and superblock writes
+pthread_cond_t head_moved = PTHREAD_COND_INITIALIZER;
+off_t committed_head;           // head in the superblock on disk
+
+// Append buffer. Without --mmap, appends are copied into log_buf, which holds
+// the log from log_buf_start up to the tail, and reach the disk in one write
+// when the buffer is committed, however many operations filled it. Appenders
+// hold buf_lock for reading while they fill their part; committing takes it
+// for writing, so the buffer is only written out whole.
+#define LOG_BUFFER_SIZE (256 * 1024)
+
+char *log_buf = NULL;
+_Atomic off_t log_buf_start;
+pthread_rwlock_t buf_lock;
+
+// In a block-aligned image the buffer is written out from the block boundary
+// at or before log_buf_start and up to one after the head (see
+// flush_log_buf()), so log_buf sits log_buf_start % WFS_BLOCK_SIZE bytes into
+// log_buf_mem, which is block-aligned and has room for a pad record after
+// LOG_BUFFER_SIZE.
+char *log_buf_mem = NULL;
+
+void set_log_buf_start(off_t start) {
+    atomic_store(&log_buf_start, start);
+    if (log_buf_mem != NULL) log_buf = log_buf_mem + start % WFS_BLOCK_SIZE;
+}
+
+// --direct: on a block-aligned image the append buffer is written out, and
+// reads of at least DIRECT_READ_MIN bytes are made, through direct_fd, which
+// is opened with O_DIRECT, so file data isn't cached by the kernel a second
+// time as pages of the image besides those of the FUSE files. What the
+// buffers involved don't hold in whole, aligned blocks goes through ones from
+// a small pool. The superblock, checkpoints, record headers and other small
+// reads still go through fd and the page cache.
+#define DIRECT_READ_MIN 32768
+#define DIRECT_BUF_SIZE (1024 * 1024)
+#define DIRECT_POOL 8           // buffers kept for reuse
+
+int use_direct = 0;
+int direct_fd = -1;             // -1 if not in use
+void *direct_pool[DIRECT_POOL];
+int direct_pooled = 0;
+pthread_mutex_t direct_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Returns a block-aligned buffer of at least size bytes, taken from the pool
+// if size is at most DIRECT_BUF_SIZE, or NULL.
+void *direct_buf_get(size_t size) {
+    void *buf = NULL;
+    if (size <= DIRECT_BUF_SIZE) {
+        pthread_mutex_lock(&direct_lock);
+        if (direct_pooled > 0) buf = direct_pool[--direct_pooled];
+        pthread_mutex_unlock(&direct_lock);
+        if (buf != NULL) return buf;
+        size = DIRECT_BUF_SIZE;
+    }
+    return posix_memalign(&buf, WFS_BLOCK_SIZE, size) == 0 ? buf : NULL;
+}
+
+void direct_buf_put(void *buf, size_t size) {
+    if (size <= DIRECT_BUF_SIZE) {
+        pthread_mutex_lock(&direct_lock);
+        if (direct_pooled < DIRECT_POOL) {
+            direct_pool[direct_pooled++] = buf;
+            buf = NULL;
+        }
+        pthread_mutex_unlock(&direct_lock);
+    }
+    free(buf);
+}
+
+// --io-uring: reads and writes go through an io_uring, set up with raw
+// syscalls, instead of pread/pwrite. Each call submits all of its requests
+// at once (every extent header a file read needs, say, or both sides of the
+// append buffer) and waits for them while other threads submit theirs, so
+// the requests of concurrent operations reach the device together. Syncs
+// stay plain fsync calls. If the kernel won't set up a ring the plain calls
+// are used, as they are for requests the ring completes short.
+#define RING_ENTRIES 64
+#define DISK_BATCH_MAX 32       // reads per disk_read_batch(), at most two requests each
+
+int use_io_uring = 0;
+
+struct disk_req {
+    int write;
+    const struct iovec *iov;
+    int iovcnt;
+    off_t offset;
+    size_t size;                // sum of the iov lengths
+    ssize_t result;             // as from preadv/pwritev, set once done
+    int done;
+    int direct;                 // made through direct_fd
+};
+
+// Only the thread that holds lock touches the rings. Completions are moved
+// from the CQ ring to their requests by whichever waiting thread is reaping,
+// one at a time, since a thread asleep in io_uring_enter() for a completion
+// must not have it taken from under it.
+struct ring {
+    int fd;                     // -1 if not in use
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_map, *cq_map;
+    size_t sq_map_size, cq_map_size, sqes_size;
+    unsigned cq_entries;
+    unsigned in_flight;         // kept within cq_entries so completions never overflow
+    int reaping;
+    pthread_mutex_t lock;
+    pthread_cond_t reaped;
+} ring = { .fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER, .reaped = PTHREAD_COND_INITIALIZER };
+
+void ring_teardown() {
+    if (ring.sqes != NULL) munmap(ring.sqes, ring.sqes_size);
+    if (ring.cq_map != NULL && ring.cq_map != ring.sq_map) munmap(ring.cq_map, ring.cq_map_size);
+    if (ring.sq_map != NULL) munmap(ring.sq_map, ring.sq_map_size);
+    if (ring.fd >= 0) close(ring.fd);
+    ring.sqes = NULL;
+    ring.sq_map = ring.cq_map = NULL;
+    ring.fd = -1;
+}
+
+int ring_setup() {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int ring_fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+    if (ring_fd < 0) return -1;
+    ring.fd = ring_fd;
+
+    ring.sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring.cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    int single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single && ring.cq_map_size > ring.sq_map_size) ring.sq_map_size = ring.cq_map_size;
+    ring.sq_map = mmap(NULL, ring.sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ring_fd, IORING_OFF_SQ_RING);
+    if (ring.sq_map == MAP_FAILED) {
+        ring.sq_map = NULL;
+        ring_teardown();
+        return -1;
+    }
+    ring.cq_map = single ? ring.sq_map : mmap(NULL, ring.cq_map_size, PROT_READ | PROT_WRITE,
+                                               MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+    ring.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring.sqes = ring.cq_map == MAP_FAILED ? MAP_FAILED :
+        mmap(NULL, ring.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (ring.cq_map == MAP_FAILED || ring.sqes == MAP_FAILED) {
+        if (ring.cq_map == MAP_FAILED) ring.cq_map = NULL;
+        ring.sqes = NULL;
+        ring_teardown();
+        return -1;
+    }
+
+    char *sq = ring.sq_map, *cq = ring.cq_map;
+    ring.sq_head = (unsigned *) (sq + params.sq_off.head);
+    ring.sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    ring.sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+    ring.sq_array = (unsigned *) (sq + params.sq_off.array);
+    ring.cq_head = (unsigned *) (cq + params.cq_off.head);
+    ring.cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    ring.cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+    ring.cq_entries = params.cq_entries;
+    return 0;
+}
+
+// Moves what has completed to the requests. Called with ring.lock held.
+static int ring_reap() {
+    unsigned head = *ring.cq_head;
+    unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+    int n = 0;
+    for (; head != tail; head++, n++) {
+        struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+        struct disk_req *req = (struct disk_req *) (uintptr_t) cqe->user_data;
+        req->result = cqe->res;
+        req->done = 1;
+    }
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    ring.in_flight -= n;
+    return n;
+}
+
+// Waits for some request in flight to complete. Called with ring.lock held,
+// which is let go of meanwhile.
+static void ring_wait() {
+    if (ring.reaping) {
+        pthread_cond_wait(&ring.reaped, &ring.lock);
+        return;
+    }
+    if (ring_reap() > 0) {
+        pthread_cond_broadcast(&ring.reaped);
+        return;
+    }
+    ring.reaping = 1;
+    pthread_mutex_unlock(&ring.lock);
+    syscall(__NR_io_uring_enter, ring.fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+    pthread_mutex_lock(&ring.lock);
+    ring.reaping = 0;
+    ring_reap();
+    pthread_cond_broadcast(&ring.reaped);
+}
+
+// Submits the n requests together and waits for all of them.
+static void ring_io(struct disk_req *reqs, int n) {
+    pthread_mutex_lock(&ring.lock);
+    while (ring.in_flight + n > ring.cq_entries) ring_wait();
+
+    unsigned tail = *ring.sq_tail, mask = *ring.sq_mask;
+    for (int i = 0; i < n; i++, tail++) {
+        struct io_uring_sqe *sqe = &ring.sqes[tail & mask];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = reqs[i].write ? IORING_OP_WRITEV : IORING_OP_READV;
+        sqe->fd = reqs[i].direct ? direct_fd : fd;
+        sqe->addr = (uintptr_t) reqs[i].iov;
+        sqe->len = reqs[i].iovcnt;
+        sqe->off = reqs[i].offset;
+        sqe->user_data = (uintptr_t) &reqs[i];
+        ring.sq_array[tail & mask] = tail & mask;
+        reqs[i].done = 0;
+    }
+    __atomic_store_n(ring.sq_tail, tail, __ATOMIC_RELEASE);
+    ring.in_flight += n;
+    int left = n;
+    while (left > 0) {
+        int submitted = syscall(__NR_io_uring_enter, ring.fd, left, 0, 0, NULL, 0);
+        if (submitted > 0) {
+            left -= submitted;
+        } else if (submitted == 0 || (errno != EINTR && errno != EAGAIN && errno != EBUSY)) {
+            // take back what the kernel didn't, for the plain calls to do
+            __atomic_store_n(ring.sq_tail, tail - left, __ATOMIC_RELEASE);
+            ring.in_flight -= left;
+            for (int i = n - left; i < n; i++) {
+                reqs[i].result = -1;
+                reqs[i].done = 1;
+            }
+            break;
+        }
+    }
+    STAT_ADD(ring_submits, 1);
+    STAT_ADD(ring_requests, n - left);
+
+    for (int i = 0; i < n; i++) {
+        while (!reqs[i].done) ring_wait();
+    }
+    pthread_mutex_unlock(&ring.lock);
+}
+
+// Carries out the requests, all of them positional, so concurrent
+// operations never share a file offset. Returns -1 if any fell short.
+int disk_io(struct disk_req *reqs, int n) {
+    if (ring.fd >= 0 && n > 0) ring_io(reqs, n);
+    int failed = 0;
+    for (int i = 0; i < n; i++) {
+        if (ring.fd >= 0 && reqs[i].result == reqs[i].size) continue;
+        int req_fd = reqs[i].direct ? direct_fd : fd;
+        ssize_t done = reqs[i].write ? pwritev(req_fd, reqs[i].iov, reqs[i].iovcnt, reqs[i].offset)
+                                     : preadv(req_fd, reqs[i].iov, reqs[i].iovcnt, reqs[i].offset);
+        if (done != reqs[i].size) failed = 1;
+    }
+    return failed ? -1 : 0;
+}
+
+struct disk_extent {
+    void *buf;
+    size_t size;
+    off_t offset;
+};
+
+// A read made with O_DIRECT into an aligned buffer, of which length bytes
+// from skip on are wanted at to.
+struct bounce {
+    char *buf;
+    size_t size;
+    void *to;
+    size_t skip, length;
+};
+
+// Reads each of the n (at most DISK_BATCH_MAX) extents, submitting whatever
+// has to come from the disk together. Reads of the buffered part of the log
+// are served from the buffer. Those entirely in front of it need no lock,
+// since that part of the log is written out and stays put while operations
+// run, so they go ahead while the buffer is being committed. With --direct,
+// big reads are made of the whole blocks around them.
+int disk_read_batch(const struct disk_extent *reads, int n) {
+    for (int i = 0; i < n; i++) {
+        if (reads[i].offset < 0 || reads[i].offset + reads[i].size > disk_size) return -1;
+    }
+    if (disk_map != NULL) {
+        for (int i = 0; i < n; i++) memcpy(reads[i].buf, disk_map + reads[i].offset, reads[i].size);
+        return 0;
+    }
+
+    struct disk_req reqs[2 * DISK_BATCH_MAX];
+    struct iovec iov[2 * DISK_BATCH_MAX];
+    struct bounce bounces[2 * DISK_BATCH_MAX];
+    int n_reqs = 0, n_bounces = 0;
+    int locked = 0;
+    for (int i = 0; i < n && !locked; i++) {
+        locked = log_buf != NULL && reads[i].offset + reads[i].size > atomic_load(&log_buf_start);
+    }
+    if (locked) pthread_rwlock_rdlock(&buf_lock);
+    for (int i = 0; i < n; i++) {
+        off_t offset = reads[i].offset, end = offset + reads[i].size;
+        off_t from = end, to = end; // buffered part
+        if (locked) {
+            from = atomic_load(&log_buf_start);
+            to = atomic_load(&log_tail);
+            if (from < offset) from = offset;
+            if (to > end) to = end;
+            if (from >= to) from = to = end;
+            else memcpy((char *) reads[i].buf + (from - offset), log_buf + (from - atomic_load(&log_buf_start)), to - from);
+        }
+
+        // disk before the buffered range and after it
+        off_t parts[2][2] = { { offset, from }, { to, end } };
+        for (int j = 0; j < 2; j++) {
+            if (parts[j][0] >= parts[j][1]) continue;
+            char *to = (char *) reads[i].buf + (parts[j][0] - offset);
+            size_t length = parts[j][1] - parts[j][0];
+            off_t from = parts[j][0] & ~(off_t) (WFS_BLOCK_SIZE - 1);
+            off_t until = (parts[j][1] + WFS_BLOCK_SIZE - 1) & ~(off_t) (WFS_BLOCK_SIZE - 1);
+            struct bounce *bounce = &bounces[n_bounces];
+            if (direct_fd >= 0 && length >= DIRECT_READ_MIN && until <= disk_size &&
+                    (bounce->buf = direct_buf_get(until - from)) != NULL) {
+                *bounce = (struct bounce) { bounce->buf, until - from, to, parts[j][0] - from, length };
+                iov[n_reqs] = (struct iovec) { bounce->buf, bounce->size };
+                reqs[n_reqs] = (struct disk_req) { 0, &iov[n_reqs], 1, from, bounce->size, .direct = 1 };
+                n_bounces++;
+            } else {
+                iov[n_reqs] = (struct iovec) { to, length };
+                reqs[n_reqs] = (struct disk_req) { 0, &iov[n_reqs], 1, parts[j][0], length };
+            }
+            n_reqs++;
+        }
+    }
+    int failed = disk_io(reqs, n_reqs);
+    if (locked) pthread_rwlock_unlock(&buf_lock);
+    for (int i = 0; i < n_bounces; i++) {
+        memcpy(bounces[i].to, bounces[i].buf + bounces[i].skip, bounces[i].length);
+        direct_buf_put(bounces[i].buf, bounces[i].size);
+    }
+    if (n_bounces > 0) STAT_ADD(direct_reads, n_bounces);
+    return failed;
+}
+
+int disk_read(void *buf, size_t size, off_t offset) {
+    struct disk_extent read = { buf, size, offset };
+    return disk_read_batch(&read, 1);
+}
+
+void mark_dirty(off_t offset, size_t size) {
+    if (offset < sizeof(superblock)) return;
+    pthread_mutex_lock(&dirty_lock);
+    if (dirty_from < 0 || offset < dirty_from) dirty_from = offset;
+    if (offset + (off_t) size > dirty_to) dirty_to = offset + size;
+    pthread_mutex_unlock(&dirty_lock);
+}
+
+// Writes the buffers of iov back to back starting at offset.
+int disk_writev(const struct iovec *iov, int iovcnt, off_t offset) {
+    size_t size = 0;
+    for (int i = 0; i < iovcnt; i++) size += iov[i].iov_len;
+    if (offset < 0 || offset + size > disk_size) return -1;
+    if (disk_map != NULL) {
+        char *to = disk_map + offset;
+        for (int i = 0; i < iovcnt; i++) {
+            memcpy(to, iov[i].iov_base, iov[i].iov_len);
+            to += iov[i].iov_len;
+        }
+        mark_dirty(offset, size);
+        return 0;
+    }
+    struct disk_req req = { 1, iov, iovcnt, offset, size };
+    return disk_io(&req, 1);
+}
+
+int disk_write(const void *buf, size_t size, off_t offset) {
+    struct iovec iov = { (void *) buf, size };
+    return disk_writev(&iov, 1, offset);
+}
+
+// Writes size bytes from buf at offset with O_DIRECT, all three block-aligned.
+int direct_write(void *buf, size_t size, off_t offset) {
+    if (offset + size > disk_size) return -1;
+    struct iovec iov = { buf, size };
+    struct disk_req req = { 1, &iov, 1, offset, size, .direct = 1 };
+    STAT_ADD(direct_writes, 1);
+    return disk_io(&req, 1);
+}
+
+// Writes the buffers of iov back to back starting at offset with O_DIRECT,
+// copied a DIRECT_BUF_SIZE at a time into an aligned buffer. The blocks they
+// touch are written whole: the first one's bytes before offset are read back
+// from the image and the last one is filled up with zeros, which a scan of
+// the log takes for its end.
+int direct_writev(const struct iovec *iov, int iovcnt, off_t offset) {
+    char *buf = direct_buf_get(DIRECT_BUF_SIZE);
+    if (buf == NULL) return -1;
+    off_t at = offset & ~(off_t) (WFS_BLOCK_SIZE - 1);
+    size_t used = offset - at;
+    int failed = used > 0 && disk_read(buf, used, at) != 0;
+    for (int i = 0; i < iovcnt && !failed; i++) {
+        for (size_t done = 0; done < iov[i].iov_len && !failed;) {
+            size_t n = iov[i].iov_len - done < DIRECT_BUF_SIZE - used ? iov[i].iov_len - done : DIRECT_BUF_SIZE - used;
+            memcpy(buf + used, (char *) iov[i].iov_base + done, n);
+            done += n;
+            used += n;
+            if (used == DIRECT_BUF_SIZE) {
+                failed = direct_write(buf, used, at);
+                at += used;
+                used = 0;
+            }
+        }
+    }
+    if (!failed && used > 0) {
+        size_t whole = (used + WFS_BLOCK_SIZE - 1) & ~(size_t) (WFS_BLOCK_SIZE - 1);
+        memset(buf + used, 0, whole - used);
+        failed = direct_write(buf, whole, at);
+    }
+    direct_buf_put(buf, DIRECT_BUF_SIZE);
+    return failed ? -1 : 0;
+}
+
+// Flushes everything written so far to the disk. With flags == MS_ASYNC in
+// mmap mode this only schedules writeback of the pages dirtied since the last
+// call.
+int disk_sync(int flags) {
+    if (disk_map == NULL) return flags == MS_SYNC ? fsync(fd) : 0;
+    pthread_mutex_lock(&dirty_lock);
+    off_t from = dirty_from, to = dirty_to;
+    dirty_from = dirty_to = -1;
+    pthread_mutex_unlock(&dirty_lock);
+    if (from >= 0) {
+        off_t start = from & ~((off_t) sysconf(_SC_PAGESIZE) - 1);
+        if (msync(disk_map + start, to - start, flags) != 0) return -1;
+    }
+    return msync(disk_map, sizeof(superblock), flags);
+}
+
+// Grows the image file to at least end, in steps of WFS_GROW_CHUNK and no
+// further than max_size. The new space is preallocated, so appends into it
+// can't fail for lack of room on the host filesystem. Returns -1 if the image
+// can't reach end, though it may still have grown.
+int grow_disk(off_t end) {
+    pthread_mutex_lock(&grow_lock);
+    off_t old_size = disk_size;
+    off_t new_size = old_size;
+    while (new_size < end) new_size += WFS_GROW_CHUNK;
+    if (new_size > max_size) new_size = max_size;
+    if (new_size > old_size) {
+        if (fallocate(fd, 0, old_size, new_size - old_size) != 0 &&
+                (errno != EOPNOTSUPP || ftruncate(fd, new_size) != 0)) {
+            perror("Error growing disk");
+            new_size = old_size;
+        } else if (disk_map != NULL) {
+            off_t from = old_size & ~((off_t) sysconf(_SC_PAGESIZE) - 1);
+            if (mmap(disk_map + from, new_size - from, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+                    fd, from) == MAP_FAILED) {
+                perror("Error mapping grown disk");
+                new_size = old_size;
+            }
+        }
+        atomic_store(&disk_size, new_size);
+    }
+    pthread_mutex_unlock(&grow_lock);
+    return new_size >= end ? 0 : -1;
+}
+
+// Group commit. By default (--commit-interval=0) every operation commits its
+// appends before returning, together with those of any operation that ran
+// alongside it. With --commit-interval=MS operations return as soon as their
+// appends are buffered and a background thread commits every MS
+// milliseconds, so a crash can lose that much acknowledged work; fsync still
+// commits right away.
+int commit_interval = 0;        // --commit-interval=MS
+pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER; // committer_running
+pthread_cond_t commit_wakeup = PTHREAD_COND_INITIALIZER;
+pthread_t committer;
+int committer_running = 0;
+
+int update_superblock() {
+    // Write the superblock to the beginning of the disk. Its head must not
+    // cover appends that are still only buffered.
+    pthread_mutex_lock(&sb_lock);
+    struct wfs_sb sb = superblock;
+    if (log_buf != NULL && atomic_load(&log_buf_start) < sb.head) sb.head = atomic_load(&log_buf_start);
+    int failed = disk_write(&sb, sizeof(sb), 0);
+    if (!failed) committed_head = sb.head;
+    if (!failed) STAT_ADD(superblock_writes, 1);
+    pthread_mutex_unlock(&sb_lock);
+    if (failed) {
+        perror("Error writing superblock");
+        return -1;
+    }
+
+    // each superblock update ends a batch, which is a durability point
+    if (disk_sync(MS_ASYNC) != 0) {
+        perror("Error syncing disk");
+        return -1;
+    }
+
+    return 0; // Superblock updated successfully
+}
+
+// Length of the pad record to append after a batch ending at end in a
+// block-aligned image, or 0 if none is needed or it would take room that
+// make_room() promised to operations.
+off_t log_pad_length(off_t end) {
+    if (!(superblock.flags & WFS_SB_ALIGNED)) return 0;
+    off_t length = wfs_pad_length(end);
+    return end + length + atomic_load(&log_promised) <= disk_size ? length : 0;
+}
+
+// Writes out the append buffer, ended with a pad record in a block-aligned
+// image. Called with buf_lock held for writing, when no append is in flight.
+// With --direct the buffer is written in whole blocks from log_buf_mem, which
+// needs the part of the first block in front of it read back only after a
+// compaction or a recovery left the head off a block boundary.
+int flush_log_buf() {
+    off_t start = atomic_load(&log_buf_start);
+    if (log_buf == NULL || superblock.head <= start) return 0;
+    off_t pad_length = log_pad_length(superblock.head);
+    if (pad_length > 0) {
+        struct wfs_inode pad;
+        wfs_pad_record(&pad, pad_length, superblock.epoch);
+        char *to = log_buf + (superblock.head - start);
+        memcpy(to, &pad, sizeof(pad));
+        memset(to + sizeof(pad), 0, pad_length - sizeof(pad));
+        atomic_fetch_add(&log_tail, pad_length);
+        pthread_mutex_lock(&sb_lock);
+        superblock.head += pad_length;
+        pthread_mutex_unlock(&sb_lock);
+        STAT_ADD(pad_bytes, pad_length);
+    }
+
+    size_t size = superblock.head - start;
+    int failed;
+    if (direct_fd < 0) {
+        failed = disk_write(log_buf, size, start);
+    } else if (log_buf != log_buf_mem) {
+        struct iovec iov = { log_buf, size };
+        failed = direct_writev(&iov, 1, start);
+    } else {
+        size_t whole = (size + WFS_BLOCK_SIZE - 1) & ~(size_t) (WFS_BLOCK_SIZE - 1);
+        memset(log_buf + size, 0, whole - size);
+        failed = direct_write(log_buf, whole, start);
+    }
+    if (failed) {
+        perror("Error writing log");
+        return -1;
+    }
+    set_log_buf_start(superblock.head);
+    return 0;
+}
+
+// Writes out the buffered appends and persists the head.
+int log_commit() {
+    pthread_rwlock_wrlock(&buf_lock);
+    int failed = flush_log_buf();
+    pthread_rwlock_unlock(&buf_lock);
+    if (failed) return -1;
+    return update_superblock();
+}
+
+// Ends an operation's appends (see group commit above).
+int log_end_operation() {
+    return commit_interval == 0 ? log_commit() : 0;
+}
+
+// Reserves size bytes at the tail. If buffered, returns 1 instead when they
+// don't fit in what is left of the append buffer.
+int log_reserve(size_t size, int buffered, off_t *offset) {
+    *offset = atomic_load(&log_tail);
+    do {
+        if (*offset + size > disk_size) {
+            errno = ENOSPC;
+            return -1;
+        }
+        if (buffered && *offset + size - atomic_load(&log_buf_start) > LOG_BUFFER_SIZE) return 1;
+    } while (!atomic_compare_exchange_weak(&log_tail, offset, *offset + size));
+
+    off_t used = my_promise < size ? my_promise : size;
+    my_promise -= used;
+    atomic_fetch_sub(&log_promised, used);
+    return 0;
+}
+
+// Fills in the epoch, commit and crc fields of the records making up iov,
+// the last of which ends the operation. Each record is a header in an iovec
+// of its own followed by the iovecs holding its data.
+void seal_records(const struct iovec *iov, int iovcnt) {
+    for (int i = 0; i < iovcnt;) {
+        struct wfs_inode *inode = iov[i].iov_base;
+        int data = ++i;
+        for (uint64_t left = inode->size; i < iovcnt && (left > 0 || iov[i].iov_len == 0); i++) {
+            left -= iov[i].iov_len;
+        }
+        inode->epoch = superblock.epoch;
+        inode->commit = i == iovcnt;
+        inode->crc = wfs_record_crc(inode, NULL);
+        for (int j = data; j < i; j++) inode->crc = wfs_crc32c(inode->crc, iov[j].iov_base, iov[j].iov_len);
+    }
+}
+
+static const char pad_zeros[2 * WFS_BLOCK_SIZE]; // data of the longest pad record
+
+// Appends the records in iov (see seal_records()) as one contiguous range
+// and returns the offset it starts at, or -1 if the disk is full or the
+// write failed. The caller ends the operation with log_end_operation() once
+// all of it is appended.
+off_t log_appendv(const struct iovec *iov, int iovcnt) {
+    seal_records(iov, iovcnt);
+    size_t size = 0;
+    for (int i = 0; i < iovcnt; i++) size += iov[i].iov_len;
+
+    off_t offset;
+    int failed = 0;
+    if (log_buf != NULL && size > LOG_BUFFER_SIZE) {
+        // too big to buffer: write it behind whatever is buffered, alone,
+        // ended with a pad record as a batch of its own
+        pthread_rwlock_wrlock(&buf_lock);
+        int ret = flush_log_buf() != 0 ? -1 : log_reserve(size, 0, &offset);
+        if (ret == 0) {
+            off_t pad_length = log_pad_length(offset + size);
+            struct iovec *padded = pad_length > 0 ? malloc((iovcnt + 2) * sizeof(struct iovec)) : NULL;
+            struct wfs_inode pad;
+            off_t end = offset + size;
+            if (padded != NULL) {
+                wfs_pad_record(&pad, pad_length, superblock.epoch);
+                memcpy(padded, iov, iovcnt * sizeof(struct iovec));
+                padded[iovcnt] = (struct iovec) { &pad, sizeof(pad) };
+                padded[iovcnt + 1] = (struct iovec) { (void *) pad_zeros, pad_length - sizeof(pad) };
+                atomic_fetch_add(&log_tail, pad_length);
+                end += pad_length;
+                STAT_ADD(pad_bytes, pad_length);
+            }
+            const struct iovec *out = padded != NULL ? padded : iov;
+            int n_out = padded != NULL ? iovcnt + 2 : iovcnt;
+            failed = direct_fd >= 0 ? direct_writev(out, n_out, offset) : disk_writev(out, n_out, offset);
+            free(padded);
+            pthread_mutex_lock(&sb_lock);
+            superblock.head = end;
+            pthread_mutex_unlock(&sb_lock);
+            set_log_buf_start(end);
+        }
+        pthread_rwlock_unlock(&buf_lock);
+        if (ret != 0) return -1;
+    } else {
+        for (;;) {
+            pthread_rwlock_rdlock(&buf_lock);
+            int ret = log_reserve(size, log_buf != NULL, &offset);
+            if (ret == 0) break;
+            pthread_rwlock_unlock(&buf_lock);
+            if (ret < 0 || log_commit() != 0) return -1;
+        }
+
+        if (log_buf != NULL) {
+            char *to = log_buf + (offset - atomic_load(&log_buf_start));
+            for (int i = 0; i < iovcnt; i++) {
+                memcpy(to, iov[i].iov_base, iov[i].iov_len);
+                to += iov[i].iov_len;
+            }
+        } else {
+            failed = disk_writev(iov, iovcnt, offset);
+        }
+
+        // wait for the appends reserved before this one to be written
+        pthread_mutex_lock(&sb_lock);
+        while (superblock.head != offset) pthread_cond_wait(&head_moved, &sb_lock);
+        superblock.head = offset + size;
+        pthread_cond_broadcast(&head_moved);
+        pthread_mutex_unlock(&sb_lock);
+        pthread_rwlock_unlock(&buf_lock);
+    }
+
+    if (failed) {
+        errno = EIO;
+        return -1;
+    }
+    STAT_ADD(appends, 1);
+    STAT_ADD(appended_bytes, size);
+    return offset;
+}
+
+// Map from inode number to the latest log record for that inode. Built once
+// at mount by scanning the log and kept up to date on every append, so a
+// lookup is a table hit plus one read instead of a walk over the whole log.
+// Files also track the extent records written since their last full record.
+#define WFS_MAX_EXTENTS 16      // extents per file before they are consolidated
+
+struct inode_map_entry {
+    off_t offset;               // offset of the latest record, 0 if never written
+    off_t base;                 // offset of the latest full record
+    off_t *extents;             // extent or dentry records after base, oldest first
+    int n_extents;
+    int extents_capacity;       //   and the room for them (see map_reserve())
+    struct dir_table *dir;      // a directory's entries once loaded (see get_dir())
+    uint64_t size;              // current file size
+    int deleted;                // 1 if the latest record marks the inode deleted
+    off_t live;                 // bytes of this inode's records that are still needed
+    struct wfs_chunk_ref *refs; // chunks base and the extents refer to (see below)
+    int n_refs;
+    int refs_capacity;
+    struct write_buf *wbuf;     // an open file's write-back buffer (see open_write_buf())
+};
+
+// The map is guarded by map_lock. Lookups copy what they need out of it under
+// the read lock, since an update may reallocate it.
+struct inode_map_entry *inode_map = NULL;
+int inode_map_size = 0;
+off_t live_bytes = 0;           // sum of live over the map; the rest of the log is dead
+pthread_rwlock_t map_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// Chunk index for deduplication (see WFS_RECORD_CHUNK): the chunk record for
+// each hash and how many references to it the live records hold, counted
+// from the refs of the map entries. A chunk record is live while its entry
+// points at it with a non-zero count. Open addressing on the first half of
+// the hash, guarded by map_lock along with the map.
+struct chunk_entry {
+    struct wfs_chunk_ref hash;
+    off_t offset;               // chunk record, 0 until one is seen
+    off_t length;               //   and its length, header included
+    uint64_t refs;
+    int used;
+};
+
+struct chunk_entry *chunk_table = NULL;
+uint64_t chunk_table_size = 0;  // a power of two
+uint64_t n_chunks = 0;          // used entries
+uint64_t chunks_reserved = 0;   // entries operations made room for (see map_reserve())
+
+static off_t chunk_live(const struct chunk_entry *chunk) {
+    return chunk->refs > 0 && chunk->offset != 0 ? chunk->length : 0;
+}
+
+// The entry for hash, or the free slot it would take.
+static struct chunk_entry *chunk_slot(const struct wfs_chunk_ref *hash) {
+    uint64_t mask = chunk_table_size - 1;
+    for (uint64_t i = hash->hash[0] & mask;; i = (i + 1) & mask) {
+        struct chunk_entry *chunk = &chunk_table[i];
+        if (!chunk->used || memcmp(&chunk->hash, hash, sizeof(*hash)) == 0) return chunk;
+    }
+}
+
+// Rehashes the index into size slots, dropping entries that have neither a
+// record nor references.
+static int chunk_resize(uint64_t size) {
+    struct chunk_entry *old = chunk_table;
+    uint64_t old_size = chunk_table_size;
+    struct chunk_entry *table = calloc(size, sizeof(struct chunk_entry));
+    if (table == NULL) return -ENOMEM;
+    chunk_table = table;
+    chunk_table_size = size;
+    n_chunks = 0;
+    for (uint64_t i = 0; i < old_size; i++) {
+        if (!old[i].used || (old[i].offset == 0 && old[i].refs == 0)) continue;
+        *chunk_slot(&old[i].hash) = old[i];
+        n_chunks++;
+    }
+    free(old);
+    return 0;
+}
+
+// Finds the entry for hash, adding an empty one if create is set. Returns
+// NULL if there is none, or no memory for one.
+static struct chunk_entry *chunk_get(const struct wfs_chunk_ref *hash, int create) {
+    if (chunk_table_size == 0 && (!create || chunk_resize(1024) != 0)) return NULL;
+    struct chunk_entry *chunk = chunk_slot(hash);
+    if (chunk->used || !create) return chunk->used ? chunk : NULL;
+    if ((n_chunks + 1) * 4 > chunk_table_size * 3) {
+        if (chunk_resize(chunk_table_size * 2) != 0) return NULL;
+        chunk = chunk_slot(hash);
+    }
+    memset(chunk, 0, sizeof(*chunk));
+    chunk->hash = *hash;
+    chunk->used = 1;
+    n_chunks++;
+    return chunk;
+}
+
+// Adds delta, 1 or -1, to the reference counts of n chunks. References may
+// come before any record of their chunk in a scan of the log, since only one
+// of the chunk records written for a hash survives compaction.
+static int chunk_refs_add(const struct wfs_chunk_ref *refs, int n, int delta) {
+    for (int i = 0; i < n; i++) {
+        struct chunk_entry *chunk = chunk_get(&refs[i], delta > 0);
+        if (chunk == NULL) {
+            if (delta > 0) return -ENOMEM;
+            continue;
+        }
+        live_bytes -= chunk_live(chunk);
+        chunk->refs += delta;
+        live_bytes += chunk_live(chunk);
+    }
+    return 0;
+}
+
+// Records that a chunk record for hash, length bytes long, was written at
+// offset. If the index already has a referenced record for the hash, this
+// one holds the same bytes and is left dead.
+static int chunk_map_update_locked(const struct wfs_chunk_ref *hash, off_t offset, off_t length) {
+    struct chunk_entry *chunk = chunk_get(hash, 1);
+    if (chunk == NULL) return -ENOMEM;
+    if (chunk->offset != 0 && chunk->refs > 0) return 0;
+    live_bytes -= chunk_live(chunk);
+    chunk->offset = offset;
+    chunk->length = length;
+    live_bytes += chunk_live(chunk);
+    return 0;
+}
+
+int chunk_map_update(const struct wfs_chunk_ref *hash, off_t offset, off_t length) {
+    pthread_rwlock_wrlock(&map_lock);
+    int ret = chunk_map_update_locked(hash, offset, length);
+    pthread_rwlock_unlock(&map_lock);
+    return ret;
+}
+
+// Makes room in the map for inode_number.
+static int grow_inode_map(unsigned int inode_number) {
+    if (inode_number < inode_map_size) return 0;
+    int new_size = inode_map_size > 0 ? inode_map_size : 64;
+    while (new_size <= inode_number) new_size *= 2;
+    struct inode_map_entry *new_map = realloc(inode_map, new_size * sizeof(struct inode_map_entry));
+    if (new_map == NULL) return -ENOMEM;
+    memset(new_map + inode_map_size, 0, (new_size - inode_map_size) * sizeof(struct inode_map_entry));
+    inode_map = new_map;
+    inode_map_size = new_size;
+    return 0;
+}
+
+// Makes room for n more extents and n_refs more refs in an entry.
+static int entry_reserve(struct inode_map_entry *mapped, int n, int n_refs) {
+    if (mapped->n_extents + n > mapped->extents_capacity) {
+        off_t *extents = realloc(mapped->extents, (mapped->n_extents + n) * sizeof(off_t));
+        if (extents == NULL) return -ENOMEM;
+        mapped->extents = extents;
+        mapped->extents_capacity = mapped->n_extents + n;
+    }
+    if (mapped->n_refs + n_refs > mapped->refs_capacity) {
+        struct wfs_chunk_ref *refs = realloc(mapped->refs, (mapped->n_refs + n_refs) * sizeof(struct wfs_chunk_ref));
+        if (refs == NULL) return -ENOMEM;
+        mapped->refs = refs;
+        mapped->refs_capacity = mapped->n_refs + n_refs;
+    }
+    return 0;
+}
+
+// Records that a log record with header inode was written at offset. extent
+// is the record's extent header if it is a WFS_RECORD_EXTENT record, and refs
+// the n_refs chunks its data refers to. Cannot fail if map_reserve() made
+// room for the record.
+static int inode_map_update_locked(const struct wfs_inode *inode, off_t offset, const struct wfs_extent *extent,
+                                   const struct wfs_chunk_ref *refs, int n_refs) {
+    unsigned int inode_number = inode->inode_number;
+    if (grow_inode_map(inode_number) != 0) return -ENOMEM;
+
+    struct inode_map_entry *mapped = &inode_map[inode_number];
+    off_t length = sizeof(struct wfs_inode) + inode->size;
+    int full = inode->flags == WFS_RECORD_FULL;
+    if (full) {
+        chunk_refs_add(mapped->refs, mapped->n_refs, -1);
+        mapped->n_refs = 0;
+    }
+    if (entry_reserve(mapped, full ? 0 : 1, n_refs) != 0) return -ENOMEM;
+    if (n_refs > 0) {
+        if (chunk_refs_add(refs, n_refs, 1) != 0) return -ENOMEM;
+        memcpy(mapped->refs + mapped->n_refs, refs, n_refs * sizeof(struct wfs_chunk_ref));
+        mapped->n_refs += n_refs;
+    }
+    live_bytes -= mapped->live;
+    mapped->live = full ? length : mapped->live + length; // a full record supersedes everything
+    live_bytes += mapped->live;
+    if (!full) {
+        mapped->extents[mapped->n_extents++] = offset;
+        if (inode->flags == WFS_RECORD_EXTENT) mapped->size = extent->file_size;
+        else if (inode->flags == WFS_RECORD_DENTRY_ADD) mapped->size += sizeof(struct wfs_dentry);
+        else mapped->size -= sizeof(struct wfs_dentry);
+    } else {
+        mapped->n_extents = 0;
+        mapped->base = offset;
+        mapped->size = inode->raw_size != 0 ? inode->raw_size : inode->size;
+    }
+    mapped->offset = offset;
+    mapped->deleted = inode->deleted;
+    if (inode_number >= next_inode_num) next_inode_num = inode_number + 1;
+    return 0;
+}
+
+int inode_map_update(const struct wfs_inode *inode, off_t offset, const struct wfs_extent *extent,
+                     const struct wfs_chunk_ref *refs, int n_refs) {
+    pthread_rwlock_wrlock(&map_lock);
+    int ret = inode_map_update_locked(inode, offset, extent, refs, n_refs);
+    pthread_rwlock_unlock(&map_lock);
+    return ret;
+}
+
+// Makes room for n_records more records of inode_number, referring to n_refs
+// chunks between them, and in the chunk index for the entries of new_chunks
+// chunk records, so that the map updates after appending them cannot fail,
+// as dir_reserve() does for a directory's entries. The chunk entries stay
+// reserved until map_release(). Called with the inode locked.
+int map_reserve(unsigned int inode_number, int n_records, int n_refs, int new_chunks) {
+    pthread_rwlock_wrlock(&map_lock);
+    int ret = grow_inode_map(inode_number);
+    if (ret == 0) ret = entry_reserve(&inode_map[inode_number], n_records, n_refs);
+    uint64_t size = chunk_table_size > 0 ? chunk_table_size : 1024;
+    while ((n_chunks + chunks_reserved + new_chunks) * 4 > size * 3) size *= 2;
+    if (ret == 0 && new_chunks > 0 && size != chunk_table_size) ret = chunk_resize(size);
+    if (ret == 0) chunks_reserved += new_chunks;
+    pthread_rwlock_unlock(&map_lock);
+    return ret;
+}
+
+void map_release(int new_chunks) {
+    if (new_chunks == 0) return;
+    pthread_rwlock_wrlock(&map_lock);
+    chunks_reserved -= new_chunks;
+    pthread_rwlock_unlock(&map_lock);
+}
+
+unsigned int allocate_inode_number() {
+    pthread_rwlock_wrlock(&map_lock);
+    unsigned int inode_number = next_inode_num++;
+    pthread_rwlock_unlock(&map_lock);
+    return inode_number;
+}
+
+// Whether the record at offset, with header inode, matches its CRC.
+int record_intact(const struct wfs_inode *inode, off_t offset) {
+    off_t data = offset + sizeof(struct wfs_inode);
+    if (data + inode->size > disk_size) return 0;
+    uint32_t crc = wfs_record_crc(inode, NULL);
+    if (disk_map != NULL) return wfs_crc32c(crc, disk_map + data, inode->size) == inode->crc;
+
+    char chunk[16384];
+    for (uint64_t done = 0; done < inode->size;) {
+        size_t length = inode->size - done < sizeof(chunk) ? inode->size - done : sizeof(chunk);
+        if (disk_read(chunk, length, data + done) != 0) return 0;
+        crc = wfs_crc32c(crc, chunk, length);
+        done += length;
+    }
+    return crc == inode->crc;
+}
+
+// Reads the chunk references among the blocks of raw_size bytes of encoded
+// file data at data (see WFS_BLOCK_REF) into a malloc'd array.
+int read_refs(off_t data, uint64_t raw_size, struct wfs_chunk_ref **refs, int *n_refs) {
+    *refs = NULL;
+    *n_refs = 0;
+    if (raw_size == 0) return 0;
+    uint64_t n_blocks = (raw_size + WFS_COMPRESS_BLOCK - 1) / WFS_COMPRESS_BLOCK;
+    uint64_t *ends = malloc(n_blocks * sizeof(uint64_t));
+    if (ends == NULL || disk_read(ends, n_blocks * sizeof(uint64_t), data) != 0) {
+        free(ends);
+        return -1;
+    }
+    int ret = 0;
+    for (uint64_t i = 0; i < n_blocks && ret == 0; i++) {
+        if (!(ends[i] & WFS_BLOCK_REF)) continue;
+        off_t start = i > 0 ? ends[i - 1] & ~WFS_BLOCK_REF : 0;
+        if (*n_refs % 16 == 0) {
+            struct wfs_chunk_ref *grown = realloc(*refs, (*n_refs + 16) * sizeof(struct wfs_chunk_ref));
+            if (grown == NULL) {
+                ret = -1;
+                break;
+            }
+            *refs = grown;
+        }
+        ret = disk_read(&(*refs)[(*n_refs)++], sizeof(struct wfs_chunk_ref), data + n_blocks * sizeof(uint64_t) + start);
+    }
+    free(ends);
+    if (ret != 0) {
+        free(*refs);
+        *refs = NULL;
+        *n_refs = 0;
+    }
+    return ret;
+}
+
+// Brings the map up to date with the log from offset on, applying whole
+// operations only: the records of one are held back until the one marked
+// commit. Records of the current epoch may have been torn by a crash, so they
+// are checked against their CRC, and the scan goes on past the head for any
+// the superblock missed. The log ends before the first torn record or
+// unfinished operation. The head is moved there and, if a torn record was
+// cut off, the epoch is bumped so nothing beyond it is ever taken for a
+// record again. A read-only mount only moves its own copy of the head.
+int build_inode_map(off_t offset) {
+    struct pending {
+        struct wfs_inode inode;
+        struct wfs_extent extent;
+        struct wfs_chunk_ref hash;  // of a chunk record
+        struct wfs_chunk_ref *refs; // chunks the record's data refers to
+        int n_refs;
+        off_t offset;
+    } *pending = NULL;
+    int n_pending = 0, capacity = 0, torn = 0;
+    offset = wfs_log_next(&superblock, offset);
+    off_t end = offset;          // end of the last complete operation
+
+    for (;;) {
+        struct wfs_inode inode;
+        if (offset + sizeof(inode) > disk_size || disk_read(&inode, sizeof(inode), offset) != 0) break;
+        if (inode.atime == 0 && inode.crc == 0) break; // never written
+        int current = inode.epoch == superblock.epoch;
+        // past the head, records left over from before a compaction or newer
+        // than a mounted snapshot
+        if (offset >= superblock.head && (!current || read_only)) break;
+        if (current ? !record_intact(&inode, offset) : offset + sizeof(inode) + inode.size > superblock.head) {
+            torn = 1;
+            break;
+        }
+
+        if (n_pending == capacity) {
+            capacity = capacity > 0 ? capacity * 2 : 4;
+            struct pending *grown = realloc(pending, capacity * sizeof(struct pending));
+            if (grown == NULL) {
+                free(pending);
+                return -1;
+            }
+            pending = grown;
+        }
+        struct pending *record = &pending[n_pending++];
+        record->inode = inode;
+        record->offset = offset;
+        record->refs = NULL;
+        record->n_refs = 0;
+        off_t data = offset + sizeof(inode);
+        int failed = 0;
+        if (inode.flags == WFS_RECORD_CHUNK) {
+            failed = disk_read(&record->hash, sizeof(record->hash), data);
+        } else if (inode.flags == WFS_RECORD_EXTENT) {
+            failed = disk_read(&record->extent, sizeof(record->extent), data) != 0 ||
+                read_refs(data + sizeof(record->extent), inode.raw_size, &record->refs, &record->n_refs) != 0;
+        } else if (inode.flags == WFS_RECORD_FULL) {
+            failed = read_refs(data, inode.raw_size, &record->refs, &record->n_refs);
+        }
+        offset = wfs_log_next(&superblock, offset + sizeof(inode) + inode.size);
+
+        // records from before the last compaction were complete when it ran
+        if (!failed && !inode.commit && current) continue;
+        for (int i = 0; i < n_pending; i++) {
+            struct pending *applied = &pending[i];
+            if (!failed && applied->inode.flags != WFS_RECORD_PAD) {
+                failed = applied->inode.flags == WFS_RECORD_CHUNK ?
+                    chunk_map_update(&applied->hash, applied->offset, sizeof(struct wfs_inode) + applied->inode.size) :
+                    inode_map_update(&applied->inode, applied->offset, &applied->extent, applied->refs, applied->n_refs);
+            }
+            free(applied->refs);
+        }
+        n_pending = 0;
+        if (failed) {
+            free(pending);
+            return -1;
+        }
+        end = offset;
+    }
+    for (int i = 0; i < n_pending; i++) free(pending[i].refs);
+    free(pending);
+    if (n_pending > 0) torn = 1;
+    if (end == superblock.head && !torn) return 0;
+
+    if (end < superblock.head) {
+        printf("Cut torn log tail: head %lu -> %lu\n", (unsigned long) superblock.head, (unsigned long) end);
+    } else if (end > superblock.head) {
+        printf("Recovered log past the head: head %lu -> %lu\n", (unsigned long) superblock.head, (unsigned long) end);
+    }
+    superblock.head = end;
+    if (torn) superblock.epoch++;
+    // a snapshot mount's head and epoch are the snapshot's, not the image's
+    if (read_only) return 0;
+    if (disk_write(&superblock, sizeof(superblock), 0) != 0 || disk_sync(MS_SYNC) != 0) return -1;
+    return 0;
+}
+
+// Checkpoints of the map (see struct wfs_checkpoint). The cleaner thread
+// writes one once CHECKPOINT_LOG_BYTES have been appended since the last or
+// a compaction made it stale, and unmount writes a final one, so mount only
+// rolls forward over what came after.
+#define CHECKPOINT_LOG_BYTES (16 * WFS_SEGMENT_SIZE)
+
+int have_checkpoint = 0;        // whether the newest slot holds a valid checkpoint
+off_t checkpoint_head;          //   and where it stopped,
+uint64_t checkpoint_epoch;
+uint64_t checkpoint_sequence = 0;
+int checkpoint_too_large = 0;   // reported once
+
+// Whether a checkpoint is missing, stale or min_appended bytes behind.
+int checkpoint_due(off_t min_appended) {
+    if (superblock.checkpoint_size == 0) return 0;
+    return !have_checkpoint || superblock.epoch != checkpoint_epoch ||
+        superblock.head - checkpoint_head >= min_appended;
+}
+
+// Serializes the map. Must be called with fs_lock held for writing, so that
+// the map is current up to the head. Returns NULL if it doesn't fit in a slot.
+struct wfs_checkpoint *build_checkpoint() {
+    size_t length = sizeof(struct wfs_checkpoint);
+    uint64_t n_inodes = 0;
+    pthread_rwlock_rdlock(&map_lock);
+    for (int i = 0; i < inode_map_size; i++) {
+        if (inode_map[i].offset == 0) continue;
+        n_inodes++;
+        length += sizeof(struct wfs_checkpoint_inode) + inode_map[i].n_extents * sizeof(uint64_t) +
+            inode_map[i].n_refs * sizeof(struct wfs_chunk_ref);
+    }
+    uint64_t n_live_chunks = 0;
+    for (uint64_t i = 0; i < chunk_table_size; i++) {
+        if (chunk_live(&chunk_table[i]) > 0) n_live_chunks++;
+    }
+    length += n_live_chunks * sizeof(struct wfs_checkpoint_chunk);
+    struct wfs_checkpoint *checkpoint = length <= superblock.checkpoint_size ? malloc(length) : NULL;
+    if (checkpoint != NULL) {
+        checkpoint->magic = WFS_CHECKPOINT_MAGIC;
+        checkpoint->length = length;
+        checkpoint->sequence = checkpoint_sequence + 1;
+        checkpoint->epoch = superblock.epoch;
+        checkpoint->head = superblock.head;
+        checkpoint->next_inode = next_inode_num;
+        checkpoint->n_inodes = n_inodes;
+        checkpoint->n_chunks = n_live_chunks;
+        struct wfs_checkpoint_inode *entry = (struct wfs_checkpoint_inode *) (checkpoint + 1);
+        for (int i = 0; i < inode_map_size; i++) {
+            struct inode_map_entry *mapped = &inode_map[i];
+            if (mapped->offset == 0) continue;
+            entry->offset = mapped->offset;
+            entry->base = mapped->base;
+            entry->size = mapped->size;
+            entry->live = mapped->live;
+            entry->inode_number = i;
+            entry->n_extents = mapped->n_extents;
+            entry->deleted = mapped->deleted;
+            entry->n_refs = mapped->n_refs;
+            uint64_t *extents = (uint64_t *) (entry + 1);
+            for (int j = 0; j < mapped->n_extents; j++) extents[j] = mapped->extents[j];
+            struct wfs_chunk_ref *refs = (struct wfs_chunk_ref *) (extents + mapped->n_extents);
+            memcpy(refs, mapped->refs, mapped->n_refs * sizeof(struct wfs_chunk_ref));
+            entry = (struct wfs_checkpoint_inode *) (refs + mapped->n_refs);
+        }
+        struct wfs_checkpoint_chunk *chunk = (struct wfs_checkpoint_chunk *) entry;
+        for (uint64_t i = 0; i < chunk_table_size; i++) {
+            if (chunk_live(&chunk_table[i]) == 0) continue;
+            chunk->hash = chunk_table[i].hash;
+            chunk->offset = chunk_table[i].offset;
+            chunk->length = chunk_table[i].length;
+            chunk++;
+        }
+        checkpoint->crc = wfs_crc32c(0, &checkpoint->length, length - offsetof(struct wfs_checkpoint, length));
+    } else if (length > superblock.checkpoint_size && !checkpoint_too_large) {
+        printf("Inode map too large to checkpoint (%lu bytes)\n", (unsigned long) length);
+        checkpoint_too_large = 1;
+    }
+    pthread_rwlock_unlock(&map_lock);
+    return checkpoint;
+}
+
+// Writes a checkpoint over the older slot, once everything it covers is on
+// disk. Must be called with fs_lock held, so no compaction runs meanwhile.
+int store_checkpoint(const struct wfs_checkpoint *checkpoint) {
+    off_t slot = sizeof(struct wfs_sb) + checkpoint->sequence % 2 * superblock.checkpoint_size;
+    if (log_commit() != 0 || disk_sync(MS_SYNC) != 0 ||
+            disk_write(checkpoint, checkpoint->length, slot) != 0 || disk_sync(MS_SYNC) != 0) {
+        printf("Error writing checkpoint\n");
+        return -1;
+    }
+    STAT_ADD(checkpoints, 1);
+    have_checkpoint = 1;
+    checkpoint_head = checkpoint->head;
+    checkpoint_epoch = checkpoint->epoch;
+    checkpoint_sequence = checkpoint->sequence;
+    return 0;
+}
+
+// Reads the checkpoint in a slot, or returns NULL if it isn't valid.
+struct wfs_checkpoint *read_checkpoint(int slot_number) {
+    off_t slot = sizeof(struct wfs_sb) + slot_number * superblock.checkpoint_size;
+    struct wfs_checkpoint header;
+    if (superblock.checkpoint_size < sizeof(header) || disk_read(&header, sizeof(header), slot) != 0) return NULL;
+    if (header.magic != WFS_CHECKPOINT_MAGIC || header.length < sizeof(header) ||
+            header.length > superblock.checkpoint_size || header.epoch != superblock.epoch ||
+            header.head < wfs_log_start(&superblock) || header.head > superblock.head) {
+        return NULL;
+    }
+    struct wfs_checkpoint *checkpoint = malloc(header.length);
+    if (checkpoint == NULL || disk_read(checkpoint, header.length, slot) != 0 ||
+            checkpoint->crc != wfs_crc32c(0, &checkpoint->length, header.length - offsetof(struct wfs_checkpoint, length))) {
+        free(checkpoint);
+        return NULL;
+    }
+    return checkpoint;
+}
+
+// Loads the newest valid checkpoint into the empty map. Returns the offset
+// the log has to be scanned from, or -1 on error.
+off_t load_checkpoint() {
+    struct wfs_checkpoint *checkpoint = read_checkpoint(0);
+    struct wfs_checkpoint *other = read_checkpoint(1);
+    if (checkpoint == NULL || (other != NULL && other->sequence > checkpoint->sequence)) {
+        struct wfs_checkpoint *older = checkpoint;
+        checkpoint = other;
+        other = older;
+    }
+    free(other);
+    if (checkpoint == NULL) return wfs_log_start(&superblock);
+
+    // chunks first, so that the references of the inodes count towards them
+    char *end = (char *) checkpoint + checkpoint->length;
+    struct wfs_checkpoint_inode *entry = (struct wfs_checkpoint_inode *) (checkpoint + 1);
+    if ((end - (char *) entry) / sizeof(struct wfs_checkpoint_chunk) < checkpoint->n_chunks) {
+        free(checkpoint);
+        return -1;
+    }
+    struct wfs_checkpoint_chunk *chunks = (struct wfs_checkpoint_chunk *) end - checkpoint->n_chunks;
+    for (uint64_t i = 0; i < checkpoint->n_chunks; i++) {
+        if (chunk_map_update_locked(&chunks[i].hash, chunks[i].offset, chunks[i].length) != 0) {
+            free(checkpoint);
+            return -1;
+        }
+    }
+    end = (char *) chunks;
+
+    for (uint64_t i = 0; i < checkpoint->n_inodes; i++) {
+        uint64_t *extents = (uint64_t *) (entry + 1);
+        struct wfs_chunk_ref *refs = (struct wfs_chunk_ref *) (extents + entry->n_extents);
+        if ((char *) extents > end || (end - (char *) extents) / sizeof(uint64_t) < entry->n_extents ||
+                (end - (char *) refs) / sizeof(struct wfs_chunk_ref) < entry->n_refs ||
+                grow_inode_map(entry->inode_number) != 0) {
+            free(checkpoint);
+            return -1;
+        }
+        struct inode_map_entry *mapped = &inode_map[entry->inode_number];
+        mapped->offset = entry->offset;
+        mapped->base = entry->base;
+        mapped->size = entry->size;
+        mapped->live = entry->live;
+        mapped->deleted = entry->deleted;
+        mapped->n_extents = entry->n_extents;
+        if (entry->n_extents > 0) {
+            if ((mapped->extents = malloc(entry->n_extents * sizeof(off_t))) == NULL) {
+                free(checkpoint);
+                return -1;
+            }
+            for (int j = 0; j < entry->n_extents; j++) mapped->extents[j] = extents[j];
+            mapped->extents_capacity = entry->n_extents;
+        }
+        if (entry->n_refs > 0) {
+            mapped->n_refs = mapped->refs_capacity = entry->n_refs;
+            if ((mapped->refs = malloc(entry->n_refs * sizeof(struct wfs_chunk_ref))) == NULL ||
+                    chunk_refs_add(refs, entry->n_refs, 1) != 0) {
+                free(checkpoint);
+                return -1;
+            }
+            memcpy(mapped->refs, refs, entry->n_refs * sizeof(struct wfs_chunk_ref));
+        }
+        live_bytes += mapped->live;
+        entry = (struct wfs_checkpoint_inode *) (refs + entry->n_refs);
+    }
+    next_inode_num = checkpoint->next_inode;
+
+    have_checkpoint = 1;
+    checkpoint_head = checkpoint->head;
+    checkpoint_epoch = checkpoint->epoch;
+    checkpoint_sequence = checkpoint->sequence;
+    off_t head = checkpoint->head;
+    free(checkpoint);
+    return head;
+}
+
+// Returns the record at offset. In mmap mode this points into the mapping and
+// must not be modified; either way it is released with put_entry().
+struct wfs_log_entry *read_entry(off_t offset) {
+    struct wfs_inode inode;
+    if (disk_read(&inode, sizeof(struct wfs_inode), offset) != 0) return NULL;
+    if (offset + sizeof(struct wfs_inode) + inode.size > disk_size) return NULL;
+
+    if (disk_map != NULL) return (struct wfs_log_entry *) (disk_map + offset);
+
+    struct wfs_log_entry *entry = arena_alloc(sizeof(struct wfs_inode) + inode.size);
+    if (entry == NULL) return NULL;
+    entry->inode = inode;
+    if (disk_read(&entry->data, inode.size, offset + sizeof(struct wfs_inode)) != 0) {
+        arena_free(entry);
+        return NULL;
+    }
+    return entry;
+}
+
+void put_entry(struct wfs_log_entry *entry) {
+    if (disk_map != NULL && (char *) entry >= disk_map && (char *) entry < disk_map + disk_size) return;
+    arena_free(entry);
+}
+
+// Called with map_lock held.
+struct inode_map_entry *get_mapped(unsigned int inode_number) {
+    if (inode_number >= inode_map_size) return NULL;
+    struct inode_map_entry *mapped = &inode_map[inode_number];
+    if (mapped->offset == 0 || mapped->deleted) return NULL;
+    return mapped;
+}
+
+// Reads the current attributes of an inode, with size set to the file size
+// (and raw_size cleared).
+int get_inode(unsigned int inode_number, struct wfs_inode *inode) {
+    pthread_rwlock_rdlock(&map_lock);
+    struct inode_map_entry *mapped = get_mapped(inode_number);
+    off_t offset = mapped != NULL ? mapped->offset : 0;
+    uint64_t size = mapped != NULL ? mapped->size : 0;
+    pthread_rwlock_unlock(&map_lock);
+    if (offset == 0) return -1;
+    if (disk_read(inode, sizeof(struct wfs_inode), offset) != 0) return -1;
+    inode->flags = WFS_RECORD_FULL;
+    inode->size = size;
+    inode->raw_size = 0;
+    return 0;
+}
+
+int get_extent_count(unsigned int inode_number) {
+    pthread_rwlock_rdlock(&map_lock);
+    struct inode_map_entry *mapped = get_mapped(inode_number);
+    int n_extents = mapped != NULL ? mapped->n_extents : 0;
+    pthread_rwlock_unlock(&map_lock);
+    return n_extents;
+}
+
+// Compression of file data (see WFS_COMPRESS_BLOCK in wfs.h), on with
+// --compress or for images made with mkfs.wfs -z. Only writes depend on it;
+// compressed records are read back either way.
+int compress_data_enabled = 0;
+#define COMPRESS_MIN 256        // smaller writes are stored as is
+#define LZ_HASH_BITS 12
+
+// Appends an LZ4 sequence: the literals [anchor, anchor + n_literals) then,
+// unless match_length is 0, a match of match_length bytes offset back.
+// Returns the new output position, or NULL if it would pass out_end.
+static unsigned char *lz_sequence(unsigned char *out, unsigned char *out_end, const unsigned char *anchor,
+                                  size_t n_literals, size_t offset, size_t match_length) {
+    if (out_end - out < 1 + n_literals / 255 + 1 + n_literals + 2 + match_length / 255 + 1) return NULL;
+    unsigned char *token = out++;
+    *token = (n_literals < 15 ? n_literals : 15) << 4;
+    if (n_literals >= 15) {
+        size_t n = n_literals - 15;
+        for (; n >= 255; n -= 255) *out++ = 255;
+        *out++ = n;
+    }
+    memcpy(out, anchor, n_literals);
+    out += n_literals;
+    if (match_length == 0) return out;
+
+    *out++ = offset & 255;
+    *out++ = offset >> 8;
+    size_t n = match_length - 4;
+    *token |= n < 15 ? n : 15;
+    if (n >= 15) {
+        for (n -= 15; n >= 255; n -= 255) *out++ = 255;
+        *out++ = n;
+    }
+    return out;
+}
+
+// Compresses size bytes (at most WFS_COMPRESS_BLOCK) in the LZ4 block format
+// with a single-probe hash table of 4-byte sequences. Returns the compressed
+// length, or 0 if it would take capacity bytes or more.
+size_t lz_compress(const unsigned char *in, size_t size, unsigned char *out, size_t capacity) {
+    uint16_t table[1 << LZ_HASH_BITS]; // positions in the block, which fit
+    memset(table, 0, sizeof(table));
+    const unsigned char *end = in + size;
+    // the format wants the last 5 bytes as literals and no match starting in the last 12
+    const unsigned char *match_limit = size > 12 ? end - 12 : in;
+    const unsigned char *anchor = in, *p = in;
+    unsigned char *o = out, *out_end = out + capacity - 1;
+
+    while (p < match_limit) {
+        uint32_t sequence, candidate;
+        memcpy(&sequence, p, 4);
+        uint32_t hash = (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+        const unsigned char *ref = in + table[hash];
+        table[hash] = p - in;
+        memcpy(&candidate, ref, 4);
+        if (ref >= p || candidate != sequence) {
+            p += 1 + ((p - anchor) >> 6); // skip faster through data that doesn't match
+            continue;
+        }
+
+        size_t length = 4;
+        while (p + length < end - 5 && p[length] == ref[length]) length++;
+        o = lz_sequence(o, out_end, anchor, p - anchor, p - ref, length);
+        if (o == NULL) return 0;
+        p += length;
+        anchor = p;
+    }
+    o = lz_sequence(o, out_end, anchor, end - anchor, 0, 0);
+    return o == NULL ? 0 : o - out;
+}
+
+// Decompresses an LZ4 block of size bytes into exactly raw_size bytes.
+// Returns 0, or -1 if the block is corrupt.
+int lz_decompress(const unsigned char *in, size_t size, unsigned char *out, size_t raw_size) {
+    const unsigned char *end = in + size;
+    unsigned char *o = out, *out_end = out + raw_size;
+    while (in < end) {
+        unsigned int token = *in++;
+        size_t n_literals = token >> 4;
+        if (n_literals == 15) {
+            unsigned char more;
+            do {
+                if (in == end) return -1;
+                n_literals += more = *in++;
+            } while (more == 255);
+        }
+        if (n_literals > end - in || n_literals > out_end - o) return -1;
+        memcpy(o, in, n_literals);
+        o += n_literals;
+        in += n_literals;
+        if (in == end) break;   // the last sequence has no match
+
+        if (end - in < 2) return -1;
+        size_t offset = in[0] | in[1] << 8;
+        in += 2;
+        size_t length = (token & 15) + 4;
+        if ((token & 15) == 15) {
+            unsigned char more;
+            do {
+                if (in == end) return -1;
+                length += more = *in++;
+            } while (more == 255);
+        }
+        if (offset == 0 || offset > o - out || length > out_end - o) return -1;
+        if (offset >= length) {
+            memcpy(o, o - offset, length);
+        } else {
+            for (size_t i = 0; i < length; i++) o[i] = o[i - offset]; // overlapping: repeats a pattern
+        }
+        o += length;
+    }
+    return o == out_end ? 0 : -1;
+}
+
+// Deduplication (--dedup, or images made with mkfs.wfs -d). Each block of
+// written file data of at least DEDUP_MIN bytes is stored once, in a chunk
+// record, and referred to by hash (see WFS_BLOCK_REF in wfs.h). Like
+// compression, only writes depend on it.
+int dedup_enabled = 0;
+#define DEDUP_MIN 512
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t fmix64(uint64_t k) {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+// MurmurHash3 x64 128 of a block. Not cryptographic, so blocks are compared
+// with the chunk they would share before sharing it.
+void hash_block(const char *data, size_t size, struct wfs_chunk_ref *hash) {
+    const uint64_t c1 = 0x87c37b91114253d5ULL, c2 = 0x4cf5ad432745937fULL;
+    const unsigned char *p = (const unsigned char *) data;
+    uint64_t h1 = 0, h2 = 0, k1, k2;
+    for (size_t i = 0; i < size / 16; i++, p += 16) {
+        memcpy(&k1, p, 8);
+        memcpy(&k2, p + 8, 8);
+        h1 ^= rotl64(k1 * c1, 31) * c2;
+        h1 = (rotl64(h1, 27) + h2) * 5 + 0x52dce729;
+        h2 ^= rotl64(k2 * c2, 33) * c1;
+        h2 = (rotl64(h2, 31) + h1) * 5 + 0x38495ab5;
+    }
+    size_t tail = size % 16;
+    k1 = k2 = 0;
+    for (size_t i = tail; i > 8; i--) k2 = k2 << 8 | p[i - 1];
+    for (size_t i = tail < 8 ? tail : 8; i > 0; i--) k1 = k1 << 8 | p[i - 1];
+    if (tail > 8) h2 ^= rotl64(k2 * c2, 33) * c1;
+    if (tail > 0) h1 ^= rotl64(k1 * c1, 31) * c2;
+    h1 ^= size;
+    h2 ^= size;
+    h1 += h2;
+    h2 += h1;
+    h1 = fmix64(h1);
+    h2 = fmix64(h2);
+    h1 += h2;
+    h2 += h1;
+    hash->hash[0] = h1;
+    hash->hash[1] = h2;
+}
+
+int read_data(off_t data, uint64_t raw_size, char *buf, uint64_t offset, size_t size);
+
+// Reads size bytes at offset within the chunk record at chunk_offset, which
+// has to hold chunk_size bytes.
+int read_chunk(off_t chunk_offset, uint64_t chunk_size, char *buf, uint64_t offset, size_t size) {
+    struct wfs_inode inode;
+    if (chunk_offset == 0 || disk_read(&inode, sizeof(inode), chunk_offset) != 0) return -1;
+    if (inode.flags != WFS_RECORD_CHUNK || inode.size < sizeof(struct wfs_chunk_ref)) return -1;
+    uint64_t stored_size = inode.raw_size != 0 ? inode.raw_size : inode.size - sizeof(struct wfs_chunk_ref);
+    if (stored_size != chunk_size || offset + size > chunk_size) return -1;
+    return read_data(chunk_offset + sizeof(inode) + sizeof(struct wfs_chunk_ref), inode.raw_size, buf, offset, size);
+}
+
+// A chunk record to append ahead of the record that refers to it.
+struct new_chunk {
+    struct wfs_inode inode;
+    struct wfs_chunk_ref hash;
+    const char *raw;            // the block
+    size_t length;              //   and its length
+    const char *data;           // the block as stored
+    char *compressed;           // malloc'd, when that is what is stored
+};
+
+// File data encoded for a record by encode_data().
+struct encoding {
+    char *data;                 // block format, NULL to store the data as is
+    size_t stored;              // bytes the record holds
+    uint64_t raw_size;          // for the record's raw_size field
+    struct wfs_chunk_ref *refs; // chunks the blocks refer to
+    int n_refs;
+    struct new_chunk *chunks;   // those of them to be appended first
+    int n_chunks;
+};
+
+void free_encoding(struct encoding *encoding) {
+    for (int i = encoding->n_chunks - 1; i >= 0; i--) arena_free(encoding->chunks[i].compressed);
+    arena_free(encoding->chunks);
+    arena_free(encoding->refs);
+    arena_free(encoding->data);
+    memset(encoding, 0, sizeof(*encoding));
+}
+
+// The most log space the records encode_data() makes for size bytes can
+// take, the header of the record holding them aside: each block may become a
+// table entry and reference plus a chunk record with its own table.
+size_t encoded_bound(size_t size) {
+    uint64_t n_blocks = (size + WFS_COMPRESS_BLOCK - 1) / WFS_COMPRESS_BLOCK;
+    return size + n_blocks * (2 * sizeof(uint64_t) + 2 * sizeof(struct wfs_chunk_ref) + sizeof(struct wfs_inode));
+}
+
+// Compresses raw bytes into out, which has room for them, as a table of its
+// blocks followed by the blocks (see WFS_COMPRESS_BLOCK). Returns the length,
+// or 0 if that saves less than an eighth.
+static size_t compress_blocks(const char *raw, size_t size, char *out) {
+    uint64_t n_blocks = (size + WFS_COMPRESS_BLOCK - 1) / WFS_COMPRESS_BLOCK;
+    size_t limit = size - size / 8;
+    if (n_blocks * sizeof(uint64_t) >= limit) return 0;
+    uint64_t *ends = (uint64_t *) out;
+    char *blocks = out + n_blocks * sizeof(uint64_t);
+    size_t room = limit - n_blocks * sizeof(uint64_t), used = 0;
+    for (uint64_t i = 0; i < n_blocks; i++) {
+        size_t length = size - i * WFS_COMPRESS_BLOCK < WFS_COMPRESS_BLOCK ? size - i * WFS_COMPRESS_BLOCK : WFS_COMPRESS_BLOCK;
+        const char *block = raw + i * WFS_COMPRESS_BLOCK;
+        size_t capacity = room - used < length ? room - used : length;
+        size_t compressed = capacity > 0 ?
+            lz_compress((const unsigned char *) block, length, (unsigned char *) blocks + used, capacity) : 0;
+        if (compressed == 0) {
+            if (length > room - used) return 0;
+            memcpy(blocks + used, block, length);
+            compressed = length;
+        }
+        used += compressed;
+        ends[i] = used;
+    }
+    STAT_ADD(compressed_raw_bytes, size);
+    STAT_ADD(compressed_stored_bytes, n_blocks * sizeof(uint64_t) + used);
+    return n_blocks * sizeof(uint64_t) + used;
+}
+
+// Finds a chunk with the same bytes as a block, in the log or among those
+// the encoding appends, or else adds a new one to the encoding. Returns -1 if
+// the hash is taken by different bytes, leaving the block to be stored in
+// place.
+static int dedup_block(const struct wfs_chunk_ref *hash, const char *block, size_t size, struct encoding *encoding) {
+    for (int i = 0; i < encoding->n_chunks; i++) {
+        struct new_chunk *chunk = &encoding->chunks[i];
+        if (memcmp(&chunk->hash, hash, sizeof(*hash)) != 0) continue;
+        if (chunk->length != size || memcmp(chunk->raw, block, size) != 0) return -1;
+        STAT_ADD(dedup_shared_blocks, 1);
+        STAT_ADD(dedup_shared_bytes, size);
+        return 0;
+    }
+
+    pthread_rwlock_rdlock(&map_lock);
+    struct chunk_entry *entry = chunk_get(hash, 0);
+    off_t offset = entry != NULL ? entry->offset : 0;
+    pthread_rwlock_unlock(&map_lock);
+    if (offset != 0) {
+        char *existing = arena_alloc(size);
+        int same = existing != NULL && read_chunk(offset, size, existing, 0, size) == 0 &&
+            memcmp(existing, block, size) == 0;
+        arena_free(existing);
+        if (!same) return -1;
+        STAT_ADD(dedup_shared_blocks, 1);
+        STAT_ADD(dedup_shared_bytes, size);
+        return 0;
+    }
+
+    struct new_chunk *chunk = &encoding->chunks[encoding->n_chunks++];
+    memset(chunk, 0, sizeof(*chunk));
+    chunk->inode.inode_number = WFS_CHUNK_INODE;
+    chunk->inode.mode = S_IFREG;
+    chunk->inode.flags = WFS_RECORD_CHUNK;
+    chunk->inode.atime = chunk->inode.mtime = chunk->inode.ctime = time(NULL);
+    chunk->inode.links = 1;
+    chunk->hash = *hash;
+    chunk->raw = chunk->data = block;
+    chunk->length = size;
+    size_t stored = size;
+    if (compress_data_enabled && size >= COMPRESS_MIN && (chunk->compressed = arena_alloc(size)) != NULL) {
+        stored = compress_blocks(block, size, chunk->compressed);
+        if (stored == 0) {
+            arena_free(chunk->compressed);
+            chunk->compressed = NULL;
+            stored = size;
+        }
+    }
+    if (chunk->compressed != NULL) {
+        chunk->data = chunk->compressed;
+        chunk->inode.raw_size = size;
+    }
+    chunk->inode.size = sizeof(*hash) + stored;
+    STAT_ADD(dedup_chunks_written, 1);
+    return 0;
+}
+
+// Encodes size bytes of file data for a record, compressing and deduplicating
+// its blocks as enabled. The data is stored as is when that would gain
+// nothing. Must be called after the room for encoded_bound() bytes has been
+// made, so the cleaner can't drop a chunk between looking it up and
+// appending the reference. Returns 0 or -ENOMEM.
+int encode_data(const char *data, size_t size, struct encoding *encoding) {
+    memset(encoding, 0, sizeof(*encoding));
+    encoding->stored = size;
+    int dedup = dedup_enabled && size >= DEDUP_MIN;
+    if (!dedup && (!compress_data_enabled || size < COMPRESS_MIN)) return 0;
+    if (!dedup) {
+        char *out = arena_alloc(size);
+        size_t stored = out != NULL ? compress_blocks(data, size, out) : 0;
+        if (stored == 0) {
+            arena_free(out);
+            return 0;
+        }
+        encoding->data = out;
+        encoding->stored = stored;
+        encoding->raw_size = size;
+        return 0;
+    }
+
+    // a reference is shorter than any block it replaces, so this always fits
+    uint64_t n_blocks = (size + WFS_COMPRESS_BLOCK - 1) / WFS_COMPRESS_BLOCK;
+    encoding->data = arena_alloc(n_blocks * sizeof(uint64_t) + size);
+    encoding->refs = arena_alloc(n_blocks * sizeof(struct wfs_chunk_ref));
+    encoding->chunks = arena_alloc(n_blocks * sizeof(struct new_chunk));
+    if (encoding->data == NULL || encoding->refs == NULL || encoding->chunks == NULL) {
+        free_encoding(encoding);
+        return -ENOMEM;
+    }
+    uint64_t *ends = (uint64_t *) encoding->data;
+    char *blocks = encoding->data + n_blocks * sizeof(uint64_t);
+    size_t used = 0;
+    for (uint64_t i = 0; i < n_blocks; i++) {
+        size_t length = size - i * WFS_COMPRESS_BLOCK < WFS_COMPRESS_BLOCK ? size - i * WFS_COMPRESS_BLOCK : WFS_COMPRESS_BLOCK;
+        const char *block = data + i * WFS_COMPRESS_BLOCK;
+        struct wfs_chunk_ref hash;
+        if (length >= DEDUP_MIN) hash_block(block, length, &hash);
+        if (length >= DEDUP_MIN && dedup_block(&hash, block, length, encoding) == 0) {
+            memcpy(blocks + used, &hash, sizeof(hash));
+            encoding->refs[encoding->n_refs++] = hash;
+            used += sizeof(hash);
+            ends[i] = used | WFS_BLOCK_REF;
+            continue;
+        }
+        size_t compressed = compress_data_enabled && length >= COMPRESS_MIN ?
+            lz_compress((const unsigned char *) block, length, (unsigned char *) blocks + used, length) : 0;
+        if (compressed == 0) {
+            memcpy(blocks + used, block, length);
+            compressed = length;
+        }
+        if (compress_data_enabled) {
+            STAT_ADD(compressed_raw_bytes, length);
+            STAT_ADD(compressed_stored_bytes, compressed);
+        }
+        used += compressed;
+        ends[i] = used;
+    }
+    encoding->stored = n_blocks * sizeof(uint64_t) + used;
+    encoding->raw_size = size;
+    if (encoding->n_refs == 0 && encoding->stored > size - size / 8) {
+        free_encoding(encoding);
+        encoding->stored = size;
+    }
+    return 0;
+}
+
+// Adds the encoding's chunk records to iov, three entries each. Returns the
+// number of entries.
+int encoding_iov(const struct encoding *encoding, struct iovec *iov) {
+    for (int i = 0; i < encoding->n_chunks; i++) {
+        struct new_chunk *chunk = &encoding->chunks[i];
+        iov[3 * i] = (struct iovec) { &chunk->inode, sizeof(chunk->inode) };
+        iov[3 * i + 1] = (struct iovec) { &chunk->hash, sizeof(chunk->hash) };
+        iov[3 * i + 2] = (struct iovec) { (void *) chunk->data, chunk->inode.size - sizeof(chunk->hash) };
+    }
+    return 3 * encoding->n_chunks;
+}
+
+// Enters the encoding's chunk records, appended at offset, in the index.
+// Returns the offset past them.
+off_t encoding_applied(const struct encoding *encoding, off_t offset) {
+    for (int i = 0; i < encoding->n_chunks; i++) {
+        off_t length = sizeof(struct wfs_inode) + encoding->chunks[i].inode.size;
+        chunk_map_update(&encoding->chunks[i].hash, offset, length);
+        offset += length;
+    }
+    return offset;
+}
+
+// Reads size bytes at offset within a record's file data, which starts at
+// data and is stored as is if raw_size is 0 and encoded otherwise. Decodes
+// only the blocks the range touches.
+int read_data(off_t data, uint64_t raw_size, char *buf, uint64_t offset, size_t size) {
+    if (raw_size == 0) return disk_read(buf, size, data + offset);
+    if (size == 0) return 0;
+    if (offset + size > raw_size) return -1;
+
+    uint64_t n_blocks = (raw_size + WFS_COMPRESS_BLOCK - 1) / WFS_COMPRESS_BLOCK;
+    uint64_t first = offset / WFS_COMPRESS_BLOCK, last = (offset + size - 1) / WFS_COMPRESS_BLOCK;
+    // ends[i] is where block first - 1 + i ends, 0 standing in for the one before block 0
+    uint64_t *ends = arena_alloc((last - first + 2) * sizeof(uint64_t));
+    char *scratch = arena_alloc(2 * WFS_COMPRESS_BLOCK);
+    int ret = ends == NULL || scratch == NULL ? -1 : 0;
+    if (ret == 0) {
+        ends[0] = 0;
+        uint64_t from = first > 0 ? first - 1 : 0;
+        ret = disk_read(ends + (first > 0 ? 0 : 1), (last + 1 - from) * sizeof(uint64_t),
+                        data + from * sizeof(uint64_t));
+    }
+    off_t blocks = data + n_blocks * sizeof(uint64_t);
+
+    for (uint64_t i = first; ret == 0 && i <= last; i++) {
+        uint64_t block_start = i * WFS_COMPRESS_BLOCK;
+        uint64_t raw = raw_size - block_start < WFS_COMPRESS_BLOCK ? raw_size - block_start : WFS_COMPRESS_BLOCK;
+        uint64_t stored_start = ends[i - first] & ~WFS_BLOCK_REF, stored_end = ends[i - first + 1] & ~WFS_BLOCK_REF;
+        uint64_t from = offset > block_start ? offset - block_start : 0;
+        uint64_t to = offset + size < block_start + raw ? offset + size - block_start : raw;
+        char *to_buf = buf + (block_start + from - offset);
+        if (stored_end < stored_start || stored_end - stored_start > raw) {
+            ret = -1;
+        } else if (ends[i - first + 1] & WFS_BLOCK_REF) {
+            struct wfs_chunk_ref hash;
+            ret = stored_end - stored_start != sizeof(hash) || disk_read(&hash, sizeof(hash), blocks + stored_start);
+            if (ret == 0) {
+                pthread_rwlock_rdlock(&map_lock);
+                struct chunk_entry *chunk = chunk_get(&hash, 0);
+                off_t chunk_offset = chunk != NULL ? chunk->offset : 0;
+                pthread_rwlock_unlock(&map_lock);
+                ret = read_chunk(chunk_offset, raw, to_buf, from, to - from);
+            }
+        } else if (stored_end - stored_start == raw) {
+            ret = disk_read(to_buf, to - from, blocks + stored_start + from);
+        } else {
+            uint64_t length = stored_end - stored_start;
+            const char *in = scratch;
+            if (disk_map != NULL && blocks + stored_end <= disk_size) in = disk_map + blocks + stored_start;
+            else ret = disk_read(scratch, length, blocks + stored_start);
+            // whole blocks go straight to buf
+            char *out = from == 0 && to == raw ? to_buf : scratch + WFS_COMPRESS_BLOCK;
+            if (ret == 0) ret = lz_decompress((const unsigned char *) in, length, (unsigned char *) out, raw);
+            if (ret == 0 && out != to_buf) memcpy(to_buf, out + from, to - from);
+        }
+    }
+    arena_free(scratch);
+    arena_free(ends);
+    return ret;
+}
+
+// Applies an extent to reach, how far the data laid so far goes. One that
+// shrinks the file (a truncate) cuts that data off at its file size, so the
+// part of it in [offset, offset + size), held at buf, reads as zeros again.
+static void cut_file(const struct wfs_extent *extent, uint64_t *reach, char *buf, uint64_t offset, uint64_t size) {
+    if (extent->file_size >= *reach) {
+        if (extent->offset + extent->length > *reach) *reach = extent->offset + extent->length;
+        return;
+    }
+    uint64_t start = extent->file_size > offset ? extent->file_size : offset;
+    uint64_t end = *reach < offset + size ? *reach : offset + size;
+    if (start < end) memset(buf + (start - offset), 0, end - start);
+    *reach = extent->file_size;
+}
+
+// Returns a copy of a file's current contents, from the arena, built from its latest
+// full record with its extents applied in order.
+char *load_file(unsigned int inode_number, uint64_t *size) {
+    pthread_rwlock_rdlock(&map_lock);
+    struct inode_map_entry *mapped = get_mapped(inode_number);
+    if (mapped == NULL) {
+        pthread_rwlock_unlock(&map_lock);
+        return NULL;
+    }
+    off_t base = mapped->base;
+    uint64_t file_size = mapped->size;
+    int n_extents = mapped->n_extents;
+    off_t *extents = arena_alloc((n_extents + 1) * sizeof(off_t));
+    if (extents != NULL && n_extents > 0) memcpy(extents, mapped->extents, n_extents * sizeof(off_t));
+    pthread_rwlock_unlock(&map_lock);
+
+    char *data = extents == NULL ? NULL : arena_alloc(file_size > 0 ? file_size : 1);
+    if (data != NULL) memset(data, 0, file_size);
+    struct wfs_log_entry *entry = data == NULL ? NULL : read_entry(base);
+    if (entry == NULL) {
+        arena_free(data);
+        arena_free(extents);
+        return NULL;
+    }
+    int failed = 0;
+    uint64_t reach = entry->inode.raw_size != 0 ? entry->inode.raw_size : entry->inode.size;
+    if (entry->inode.raw_size != 0) {
+        uint64_t length = entry->inode.raw_size < file_size ? entry->inode.raw_size : file_size;
+        failed = read_data(base + sizeof(struct wfs_inode), entry->inode.raw_size, data, 0, length);
+    } else {
+        memcpy(data, entry->data, entry->inode.size < file_size ? entry->inode.size : file_size);
+    }
+    put_entry(entry);
+
+    for (int i = 0; !failed && i < n_extents; i++) {
+        entry = read_entry(extents[i]);
+        if (entry == NULL) {
+            failed = 1;
+            break;
+        }
+        struct wfs_extent *extent = (struct wfs_extent *) entry->data;
+        if (extent->offset < file_size) {
+            uint64_t length = extent->length;
+            if (length > file_size - extent->offset) length = file_size - extent->offset;
+            if (entry->inode.raw_size != 0) {
+                failed = read_data(extents[i] + sizeof(struct wfs_inode) + sizeof(struct wfs_extent),
+                                   entry->inode.raw_size, data + extent->offset, 0, length);
+            } else {
+                memcpy(data + extent->offset, entry->data + sizeof(struct wfs_extent), length);
+            }
+        }
+        cut_file(extent, &reach, data, 0, file_size);
+        put_entry(entry);
+    }
+    if (failed) {
+        arena_free(data);
+        arena_free(extents);
+        return NULL;
+    }
+
+    *size = file_size;
+    return data;
+}
+
+// Sequential read detection. A read starting where the previous read of the
+// same file ended doubles the file's readahead window, up to READAHEAD_MAX,
+// and the kernel is asked to fetch that much more of its full record ahead
+// of the reader. Direct-mapped by inode number: a file whose slot is taken
+// simply starts over.
+#define READAHEAD_SLOTS 256
+#define READAHEAD_MIN (128 * 1024)
+#define READAHEAD_MAX (2 * 1024 * 1024)
+
+struct readahead {
+    long inode_number;          // -1 if unused
+    off_t next;                 // file offset the next sequential read starts at
+    off_t window;               // 0 until the reads look sequential
+    off_t ahead;                // file offset the hints so far reach
+    pthread_mutex_t lock;
+} readaheads[READAHEAD_SLOTS];
+
+// Notes a read of [offset, offset + size) of a file whose latest full record
+// has data_size bytes of data at data, and hints what comes next.
+void readahead_file(unsigned int inode_number, off_t data, uint64_t data_size, off_t offset, size_t size) {
+    struct readahead *ra = &readaheads[inode_number % READAHEAD_SLOTS];
+    pthread_mutex_lock(&ra->lock);
+    if (ra->inode_number != inode_number || ra->next != offset) {
+        ra->inode_number = inode_number;
+        ra->window = ra->ahead = 0;
+    } else {
+        ra->window = ra->window == 0 ? READAHEAD_MIN : ra->window * 2;
+        if (ra->window > READAHEAD_MAX) ra->window = READAHEAD_MAX;
+    }
+    ra->next = offset + size;
+    off_t from = ra->ahead > ra->next ? ra->ahead : ra->next;
+    off_t to = ra->window > 0 ? ra->next + ra->window : 0;
+    if (to > (off_t) data_size) to = data_size;
+    if (from < to) ra->ahead = to;
+    pthread_mutex_unlock(&ra->lock);
+    if (from >= to) return;
+
+    if (disk_map != NULL) {
+        off_t start = (data + from) & ~((off_t) sysconf(_SC_PAGESIZE) - 1);
+        madvise(disk_map + start, data + to - start, MADV_WILLNEED);
+    } else if (direct_fd < 0) {
+        posix_fadvise(fd, data + from, to - from, POSIX_FADV_WILLNEED);
+    }
+}
+
+// Reads up to size bytes of a file at offset into buf, fetching just those
+// bytes of its latest full record and of the extents on top of it. Returns
+// the bytes read, short at the end of the file, or -errno.
+ssize_t read_file(unsigned int inode_number, char *buf, size_t size, off_t offset) {
+    pthread_rwlock_rdlock(&map_lock);
+    struct inode_map_entry *mapped = get_mapped(inode_number);
+    if (mapped == NULL) {
+        pthread_rwlock_unlock(&map_lock);
+        return -ENOENT;
+    }
+    off_t base = mapped->base;
+    uint64_t file_size = mapped->size;
+    int n_extents = mapped->n_extents;
+    off_t *extents = arena_alloc((n_extents + 1) * sizeof(off_t));
+    if (extents != NULL && n_extents > 0) memcpy(extents, mapped->extents, n_extents * sizeof(off_t));
+    pthread_rwlock_unlock(&map_lock);
+    if (extents == NULL) return -ENOMEM;
+
+    if (offset < 0 || offset >= file_size) {
+        arena_free(extents);
+        return 0;
+    }
+    if (size > file_size - offset) size = file_size - offset;
+    STAT_ADD(file_reads, 1);
+    STAT_ADD(file_records, 1 + n_extents);
+
+    // the full record, zero past its end
+    struct wfs_inode inode;
+    if (disk_read(&inode, sizeof(inode), base) != 0) goto fail;
+    if (S_ISDIR(inode.mode)) {
+        arena_free(extents);
+        return -EISDIR;
+    }
+    uint64_t base_size = inode.raw_size != 0 ? inode.raw_size : inode.size;
+    size_t from_base = base_size <= offset ? 0 : base_size - offset < size ? base_size - offset : size;
+    if (from_base > 0 && read_data(base + sizeof(inode), inode.raw_size, buf, offset, from_base) != 0) goto fail;
+    memset(buf + from_base, 0, size - from_base);
+    uint64_t reach = base_size;
+
+    // the extent headers are fetched a batch at a time
+    struct {
+        struct wfs_inode inode;
+        struct wfs_extent extent;
+    } headers[DISK_BATCH_MAX];
+    struct disk_extent reads[DISK_BATCH_MAX];
+    for (int i = 0; i < n_extents; i++) {
+        int batched = i % DISK_BATCH_MAX;
+        if (batched == 0) {
+            int n = n_extents - i < DISK_BATCH_MAX ? n_extents - i : DISK_BATCH_MAX;
+            for (int j = 0; j < n; j++) reads[j] = (struct disk_extent) { &headers[j], sizeof(headers[j]), extents[i + j] };
+            if (disk_read_batch(reads, n) != 0) goto fail;
+        }
+        struct wfs_extent extent = headers[batched].extent;
+        off_t data = extents[i] + sizeof(headers[batched]);
+        uint64_t start = extent.offset > offset ? extent.offset : offset;
+        uint64_t end = extent.offset + extent.length < offset + size ? extent.offset + extent.length : offset + size;
+        if (start < end && read_data(data, headers[batched].inode.raw_size, buf + (start - offset),
+                                     start - extent.offset, end - start) != 0) {
+            goto fail;
+        }
+        cut_file(&extent, &reach, buf, offset, size);
+    }
+    arena_free(extents);
+
+    // compressed records are read a block at a time anyway
+    if (inode.raw_size == 0) readahead_file(inode_number, base + sizeof(inode), inode.size, offset, size);
+    return size;
+
+fail:
+    arena_free(extents);
+    return -EIO;
+}
+
+// Zero-copy reads. When every byte of a read is stored as is in records
+// that have reached the image, the read can be answered with where those
+// bytes sit in it instead of a copy of them, and libfuse splices them from
+// the page cache (or, with --mmap, writes them from the mapping) to the
+// kernel. A read maps to at most READ_PIECES pieces, each a run of bytes
+// from one record or a run of zeros past the end of the file's data. The
+// offsets stay good for as long as fs_lock is held, since only the cleaner
+// moves records.
+#define READ_PIECES 16
+#define READ_ZEROS 65536        // longest run of zeros a piece can stand for
+
+static const char read_zeros[READ_ZEROS];
+
+struct read_piece {
+    uint64_t start;             // file offset, the piece ends where the next starts
+    off_t disk;                 // image offset of the byte at start, -1 for zeros
+};
+
+// Whether a record's data at [disk, disk + size) can be handed out as is.
+// Not with --direct, since libfuse would read it through the page cache.
+static int piece_mappable(off_t disk, uint64_t size) {
+    if (disk_map != NULL) return disk + size <= disk_size;
+    if (direct_fd >= 0) return 0;
+    return disk + size <= atomic_load(&log_buf_start);
+}
+
+// Lays the bytes at [start, end) of a file, found at disk onwards, over the
+// pieces making up a read that ends at read_end. Returns -1 if that would
+// take more than READ_PIECES.
+static int lay_piece(struct read_piece *pieces, int *n, uint64_t read_end, uint64_t start, uint64_t end, off_t disk) {
+    struct read_piece laid[READ_PIECES + 2];
+    int m = 0;
+    for (int i = 0; i < *n && pieces[i].start < start; i++) laid[m++] = pieces[i];
+    laid[m++] = (struct read_piece) { start, disk };
+    for (int i = 0; i < *n; i++) {
+        uint64_t piece_end = i + 1 < *n ? pieces[i + 1].start : read_end;
+        if (piece_end <= end) continue;
+        off_t from = pieces[i].disk;
+        if (pieces[i].start < end && from >= 0) from += end - pieces[i].start;
+        laid[m++] = (struct read_piece) { pieces[i].start > end ? pieces[i].start : end, from };
+    }
+
+    // runs that follow on from each other on the disk, or zeros from zeros,
+    // are one piece
+    *n = 0;
+    for (int i = 0; i < m; i++) {
+        if (*n > 0) {
+            struct read_piece *last = &pieces[*n - 1];
+            if (laid[i].disk < 0 ? last->disk < 0 : last->disk >= 0 && laid[i].disk == last->disk + (off_t) (laid[i].start - last->start)) continue;
+        }
+        if (*n == READ_PIECES) return -1;
+        pieces[(*n)++] = laid[i];
+    }
+    return 0;
+}
+
+// Maps up to *size bytes of a file at offset to at most READ_PIECES pieces,
+// setting *size to the bytes there are and *n to the pieces used. Returns 0
+// if it did, 1 if the bytes need read_file() (some are encoded, still in the
+// append buffer or scattered over too many records), or -errno.
+int map_file_read(unsigned int inode_number, struct read_piece *pieces, int *n, size_t *size, off_t offset) {
+    pthread_rwlock_rdlock(&map_lock);
+    struct inode_map_entry *mapped = get_mapped(inode_number);
+    if (mapped == NULL) {
+        pthread_rwlock_unlock(&map_lock);
+        return -ENOENT;
+    }
+    off_t base = mapped->base;
+    uint64_t file_size = mapped->size;
+    int n_extents = mapped->n_extents;
+    if (n_extents >= READ_PIECES) {
+        pthread_rwlock_unlock(&map_lock);
+        return 1;
+    }
+    off_t extents[READ_PIECES];
+    memcpy(extents, mapped->extents, n_extents * sizeof(off_t));
+    pthread_rwlock_unlock(&map_lock);
+
+    *n = 0;
+    if (offset < 0 || offset >= file_size) {
+        *size = 0;
+        return 0;
+    }
+    if (*size > file_size - offset) *size = file_size - offset;
+    uint64_t end = offset + *size;
+
+    // the full record, zeros past its end, then the extents in order
+    struct {
+        struct wfs_inode inode;
+        struct wfs_extent extent;
+    } headers[READ_PIECES];
+    struct disk_extent reads[READ_PIECES];
+    reads[0] = (struct disk_extent) { &headers[0].inode, sizeof(headers[0].inode), base };
+    for (int i = 0; i < n_extents; i++) reads[i + 1] = (struct disk_extent) { &headers[i + 1], sizeof(headers[i + 1]), extents[i] };
+    if (disk_read_batch(reads, n_extents + 1) != 0) return -EIO;
+    struct wfs_inode *inode = &headers[0].inode;
+    if (S_ISDIR(inode->mode)) return -EISDIR;
+    if (inode->raw_size != 0) return 1;
+    off_t data = base + sizeof(*inode);
+    pieces[(*n)++] = (struct read_piece) { offset, -1 };
+    if (offset < inode->size) {
+        uint64_t to = inode->size < end ? inode->size : end;
+        if (!piece_mappable(data + offset, to - offset)) return 1;
+        lay_piece(pieces, n, end, offset, to, data + offset);
+    }
+    uint64_t reach = inode->size;
+    for (int i = 1; i <= n_extents; i++) {
+        struct wfs_extent *extent = &headers[i].extent;
+        uint64_t start = extent->offset > offset ? extent->offset : offset;
+        uint64_t to = extent->offset + extent->length < end ? extent->offset + extent->length : end;
+        if (start < to) {
+            off_t at = extents[i - 1] + sizeof(headers[i]) + (start - extent->offset);
+            if (headers[i].inode.raw_size != 0 || !piece_mappable(at, to - start)) return 1;
+            if (lay_piece(pieces, n, end, start, to, at) != 0) return 1;
+        }
+        // as in cut_file(), a truncate turns what it cut off back into zeros
+        if (extent->file_size < reach) {
+            start = extent->file_size > offset ? extent->file_size : offset;
+            to = reach < end ? reach : end;
+            if (start < to && lay_piece(pieces, n, end, start, to, -1) != 0) return 1;
+            reach = extent->file_size;
+        } else if (extent->offset + extent->length > reach) {
+            reach = extent->offset + extent->length;
+        }
+    }
+    for (int i = 0; i < *n; i++) {
+        uint64_t piece_end = i + 1 < *n ? pieces[i + 1].start : end;
+        if (pieces[i].disk < 0 && piece_end - pieces[i].start > READ_ZEROS) return 1;
+    }
+    STAT_ADD(file_reads, 1);
+    STAT_ADD(file_records, 1 + n_extents);
+    STAT_ADD(zero_copy_reads, 1);
+
+    readahead_file(inode_number, data, inode->size, offset, *size);
+    return 0;
+}
+
+unsigned long hash_name(const char *name) {
+    unsigned long hash = 14695981039346656037UL; // FNV-1a
+    for (const char *c = name; *c != '\0'; c++) {
+        hash ^= (unsigned char) *c;
+        hash *= 1099511628211UL;
+    }
+    return hash;
+}
+
+// Per-inode locks, striped over INODE_LOCKS mutexes. An operation that appends
+// a new version of an inode holds its lock from reading the current version
+// until the map points at the new one: directories while a dentry is added or
+// removed, files while an extent is written or they are consolidated. Locks
+// are taken after fs_lock and in stripe order.
+#define INODE_LOCKS 64
+
+pthread_mutex_t inode_locks[INODE_LOCKS];
+
+void lock_inodes(unsigned long a, unsigned long b) {
+    a %= INODE_LOCKS;
+    b %= INODE_LOCKS;
+    pthread_mutex_lock(&inode_locks[a < b ? a : b]);
+    if (a != b) pthread_mutex_lock(&inode_locks[a < b ? b : a]);
+}
+
+void unlock_inodes(unsigned long a, unsigned long b) {
+    a %= INODE_LOCKS;
+    b %= INODE_LOCKS;
+    pthread_mutex_unlock(&inode_locks[a]);
+    if (a != b) pthread_mutex_unlock(&inode_locks[b]);
+}
+
+// The same for the three inodes a rename locks: both parents and the inode
+// the new name replaces.
+static void sort_stripes(unsigned long *stripes, unsigned long a, unsigned long b, unsigned long c) {
+    stripes[0] = a % INODE_LOCKS;
+    stripes[1] = b % INODE_LOCKS;
+    stripes[2] = c % INODE_LOCKS;
+    for (int i = 1; i < 3; i++) {
+        for (int j = i; j > 0 && stripes[j] < stripes[j - 1]; j--) {
+            unsigned long swap = stripes[j];
+            stripes[j] = stripes[j - 1];
+            stripes[j - 1] = swap;
+        }
+    }
+}
+
+void lock_inodes3(unsigned long a, unsigned long b, unsigned long c) {
+    unsigned long stripes[3];
+    sort_stripes(stripes, a, b, c);
+    for (int i = 0; i < 3; i++) {
+        if (i == 0 || stripes[i] != stripes[i - 1]) pthread_mutex_lock(&inode_locks[stripes[i]]);
+    }
+}
+
+void unlock_inodes3(unsigned long a, unsigned long b, unsigned long c) {
+    unsigned long stripes[3];
+    sort_stripes(stripes, a, b, c);
+    for (int i = 0; i < 3; i++) {
+        if (i == 0 || stripes[i] != stripes[i - 1]) pthread_mutex_unlock(&inode_locks[stripes[i]]);
+    }
+}
+
+// In-memory directories. A directory's entries are loaded on first use from
+// its latest full record and the dentry records after it, then kept current
+// by create and unlink. Entries stay in the order they were added, which is
+// the order readdir lists and consolidation writes them, and an
+// open-addressing index over them by name makes lookups, adds and removes
+// O(1). A directory's table is guarded by its inode lock.
+#define DIR_EMPTY -1
+#define DIR_REMOVED -2
+
+struct dir_table {
+    struct wfs_dentry *entries; // removed entries have an empty name
+    int n_entries;              // entries used, removed ones included
+    int n_live;
+    int capacity;               // power of two
+    int *index;                 // 2 * capacity slots: position in entries, DIR_EMPTY or DIR_REMOVED
+};
+
+// Index slot of name, or -1.
+static int dir_find(const struct dir_table *dir, const char *name) {
+    if (dir->capacity == 0) return -1;
+    int mask = 2 * dir->capacity - 1;
+    for (int i = hash_name(name) & mask;; i = (i + 1) & mask) {
+        int pos = dir->index[i];
+        if (pos == DIR_EMPTY) return -1;
+        if (pos != DIR_REMOVED && strcmp(dir->entries[pos].name, name) == 0) return i;
+    }
+}
+
+static void dir_index(struct dir_table *dir, int pos) {
+    int mask = 2 * dir->capacity - 1;
+    int i = hash_name(dir->entries[pos].name) & mask;
+    while (dir->index[i] >= 0) i = (i + 1) & mask;
+    dir->index[i] = pos;
+}
+
+// Makes room for one more entry, dropping removed entries or growing.
+static int dir_reserve(struct dir_table *dir) {
+    if (dir->n_entries < dir->capacity) return 0;
+    int capacity = dir->capacity > 0 ? dir->capacity : 16;
+    while (capacity < 2 * (dir->n_live + 1)) capacity *= 2;
+    struct wfs_dentry *entries = malloc(capacity * sizeof(struct wfs_dentry));
+    int *index = malloc(2 * capacity * sizeof(int));
+    if (entries == NULL || index == NULL) {
+        free(entries);
+        free(index);
+        return -ENOMEM;
+    }
+    int n = 0;
+    for (int i = 0; i < dir->n_entries; i++) {
+        if (dir->entries[i].name[0] != '\0') entries[n++] = dir->entries[i];
+    }
+    free(dir->entries);
+    free(dir->index);
+    dir->entries = entries;
+    dir->n_entries = n;
+    dir->capacity = capacity;
+    dir->index = index;
+    for (int i = 0; i < 2 * capacity; i++) index[i] = DIR_EMPTY;
+    for (int i = 0; i < n; i++) dir_index(dir, i);
+    return 0;
+}
+
+// Adds an entry dir_reserve() made room for.
+static void dir_add(struct dir_table *dir, const struct wfs_dentry *dentry) {
+    dir->entries[dir->n_entries] = *dentry;
+    dir_index(dir, dir->n_entries++);
+    dir->n_live++;
+}
+
+static void dir_remove(struct dir_table *dir, const char *name) {
+    int slot = dir_find(dir, name);
+    if (slot < 0) return;
+    dir->entries[dir->index[slot]].name[0] = '\0';
+    dir->index[slot] = DIR_REMOVED;
+    dir->n_live--;
+}
+
+long dir_lookup(const struct dir_table *dir, const char *name) {
+    int slot = dir_find(dir, name);
+    return slot < 0 ? -1 : dir->entries[dir->index[slot]].inode_number;
+}
+
+void dir_free(struct dir_table *dir) {
+    if (dir == NULL) return;
+    free(dir->entries);
+    free(dir->index);
+    free(dir);
+}
+
+// Replays a directory's full record and dentry records into a new table.
+static struct dir_table *load_dir(unsigned int inode_number) {
+    pthread_rwlock_rdlock(&map_lock);
+    struct inode_map_entry *mapped = get_mapped(inode_number);
+    off_t base = mapped != NULL ? mapped->base : 0;
+    int n_deltas = mapped != NULL ? mapped->n_extents : 0;
+    off_t *deltas = arena_alloc((n_deltas + 1) * sizeof(off_t));
+    if (deltas != NULL && n_deltas > 0) memcpy(deltas, mapped->extents, n_deltas * sizeof(off_t));
+    pthread_rwlock_unlock(&map_lock);
+
+    struct dir_table *dir = calloc(1, sizeof(struct dir_table));
+    struct wfs_log_entry *entry = base == 0 || deltas == NULL || dir == NULL ? NULL : read_entry(base);
+    if (entry == NULL || !S_ISDIR(entry->inode.mode)) goto fail;
+    STAT_ADD(dir_loads, 1);
+    STAT_ADD(dir_records, 1 + n_deltas);
+    struct wfs_dentry *dentries = (struct wfs_dentry *) entry->data;
+    for (int i = 0; i < entry->inode.size / sizeof(struct wfs_dentry); i++) {
+        if (dir_reserve(dir) != 0) goto fail;
+        dir_add(dir, &dentries[i]);
+    }
+    for (int i = 0; i < n_deltas; i++) {
+        struct {
+            struct wfs_inode inode;
+            struct wfs_dentry dentry;
+        } delta;
+        if (disk_read(&delta, sizeof(delta), deltas[i]) != 0) goto fail;
+        if (delta.inode.flags == WFS_RECORD_DENTRY_REMOVE) {
+            dir_remove(dir, delta.dentry.name);
+        } else {
+            if (dir_reserve(dir) != 0) goto fail;
+            dir_add(dir, &delta.dentry);
+        }
+    }
+    put_entry(entry);
+    arena_free(deltas);
+    return dir;
+
+fail:
+    put_entry(entry);
+    arena_free(deltas);
+    dir_free(dir);
+    return NULL;
+}
+
+// Returns a directory's table, loading it if needed, or NULL if the inode is
+// not a directory. Must be called with the directory's inode lock held.
+struct dir_table *get_dir(unsigned int inode_number) {
+    pthread_rwlock_rdlock(&map_lock);
+    struct inode_map_entry *mapped = get_mapped(inode_number);
+    struct dir_table *dir = mapped != NULL ? mapped->dir : NULL;
+    pthread_rwlock_unlock(&map_lock);
+    if (dir != NULL) {
+        STAT_ADD(dir_hits, 1);
+        return dir;
+    }
+
+    dir = load_dir(inode_number);
+    if (dir == NULL) return NULL;
+    pthread_rwlock_wrlock(&map_lock);
+    mapped = get_mapped(inode_number);
+    if (mapped != NULL) mapped->dir = dir;
+    pthread_rwlock_unlock(&map_lock);
+    return dir;
+}
+
+// Frees the table of a directory that was just unlinked.
+void drop_dir(unsigned int inode_number) {
+    pthread_rwlock_wrlock(&map_lock);
+    struct dir_table *dir = NULL;
+    if (inode_number < inode_map_size) {
+        dir = inode_map[inode_number].dir;
+        inode_map[inode_number].dir = NULL;
+    }
+    pthread_rwlock_unlock(&map_lock);
+    dir_free(dir);
+}
+
+// Whether a directory has enough dentry records on top of its full record to
+// be worth rewriting: at least WFS_MAX_EXTENTS of them, taking up at least as
+// much log as the full record would, so rewrites cost O(1) per change.
+int dir_needs_consolidation(unsigned int inode_number) {
+    pthread_rwlock_rdlock(&map_lock);
+    struct inode_map_entry *mapped = get_mapped(inode_number);
+    int needed = mapped != NULL && mapped->n_extents >= WFS_MAX_EXTENTS &&
+        mapped->n_extents * (sizeof(struct wfs_inode) + sizeof(struct wfs_dentry)) >= sizeof(struct wfs_inode) + mapped->size;
+    pthread_rwlock_unlock(&map_lock);
+    return needed;
+}
+
+// Returns the inode number name refers to in a directory, or -1 if there is
+// no such entry or no such directory.
+long lookup_name(long parent_num, const char *name) {
+    STAT_ADD(lookups, 1);
+    lock_inodes(parent_num, parent_num);
+    struct dir_table *dir = get_dir(parent_num);
+    long inode_number = dir != NULL ? dir_lookup(dir, name) : -1;
+    unlock_inodes(parent_num, parent_num);
+    return inode_number;
+}
+
+// Log cleaner. Records superseded by later writes stay in the log until the
+// cleaner slides the live records of a suffix of the log down over the dead
+// ones and moves the head back. The suffix is chosen per segment by
+// wfs_pick_compaction() and processed a window at a time, so the log stays
+// valid after a crash at any point (see struct wfs_sb). It runs from a
+// background thread every clean_interval seconds once enough of the log is
+// dead, and synchronously when an operation would otherwise fail with ENOSPC.
+// Every FUSE operation holds fs_lock for reading and the cleaner holds it for
+// writing, so the cleaner never moves a record someone is using and owns the
+// log, the superblock and the inode map while it runs.
+int clean_interval = 5;         // --clean-interval=N, 0 disables the background pass
+pthread_rwlock_t fs_lock;
+pthread_mutex_t cleaner_lock = PTHREAD_MUTEX_INITIALIZER; // cleaner_running
+pthread_cond_t cleaner_wakeup = PTHREAD_COND_INITIALIZER;
+pthread_t cleaner;
+int cleaner_running = 0;
+off_t pinned_dead = 0;          // dead bytes snapshots kept at the last pass, guarded by fs_lock
+
+// Persists the hole left after a window was compacted, cutting the log there
+// if the hole reaches the head.
+int set_log_hole(off_t hole_start, off_t hole_end) {
+    superblock.hole_start = hole_start;
+    superblock.hole_end = hole_end;
+    if (hole_end >= superblock.head) {
+        superblock.head = hole_start;
+        superblock.hole_start = superblock.hole_end = 0;
+    }
+    superblock.move_src = superblock.move_dst = superblock.move_len = superblock.move_end = 0;
+    superblock.epoch++;         // records moved, so checkpoints are stale
+    if (update_superblock() != 0) return -1;
+    return disk_sync(MS_SYNC);
+}
+
+// Completes the staged move recorded in the superblock (see struct wfs_sb).
+int finish_log_move() {
+    char *buf = malloc(WFS_SEGMENT_SIZE);
+    if (buf == NULL) return -1;
+    for (off_t done = 0; done < superblock.move_len; done += WFS_SEGMENT_SIZE) {
+        size_t chunk = superblock.move_len - done < WFS_SEGMENT_SIZE ? superblock.move_len - done : WFS_SEGMENT_SIZE;
+        if (disk_read(buf, chunk, superblock.move_src + done) != 0 ||
+                disk_write(buf, chunk, superblock.move_dst + done) != 0) {
+            free(buf);
+            return -1;
+        }
+    }
+    free(buf);
+    if (disk_sync(MS_SYNC) != 0) return -1;
+    return set_log_hole(superblock.move_dst + superblock.move_len, superblock.move_end);
+}
+
+// Whether the record at offset is still needed. Tombstones are needed as long
+// as an older record of the inode stays in the log, i.e. starts before start;
+// pass start = 0 to treat them all as live. Chunk records are needed while
+// the index holds them with references, and pad records never are.
+int record_is_live(const struct wfs_inode *inode, off_t offset, off_t start, const off_t *first) {
+    if (inode->flags == WFS_RECORD_PAD) return 0;
+    if (inode->flags == WFS_RECORD_CHUNK) {
+        struct wfs_chunk_ref hash;
+        if (disk_read(&hash, sizeof(hash), offset + sizeof(*inode)) != 0) return 1;
+        struct chunk_entry *chunk = chunk_get(&hash, 0);
+        return chunk != NULL && chunk->offset == offset && chunk->refs > 0;
+    }
+    struct inode_map_entry *mapped = &inode_map[inode->inode_number];
+    if (mapped->deleted) {
+        return offset == mapped->offset && (start == 0 || first[inode->inode_number] < start);
+    }
+    if (offset == mapped->base) return 1;
+    for (int i = 0; i < mapped->n_extents; i++) {
+        if (mapped->extents[i] == offset) return 1;
+    }
+    return 0;
+}
+
+// Where the record that was at offset lives after a window [from, to) was
+// compacted, or -1 if it was dropped. old_offsets is sorted.
+off_t relocate(off_t offset, off_t from, off_t to, const off_t *old_offsets, const off_t *new_offsets, int n) {
+    if (offset < from || offset >= to) return offset;
+    int lo = 0, hi = n - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (old_offsets[mid] == offset) return new_offsets[mid];
+        if (old_offsets[mid] < offset) lo = mid + 1;
+        else hi = mid - 1;
+    }
+    return -1;
+}
+
+void relocate_map(off_t from, off_t to, const off_t *old_offsets, const off_t *new_offsets, int n) {
+    for (int i = 0; i < inode_map_size; i++) {
+        struct inode_map_entry *mapped = &inode_map[i];
+        if (mapped->offset == 0) continue;
+        if (mapped->deleted && relocate(mapped->offset, from, to, old_offsets, new_offsets, n) < 0) {
+            // the tombstone went with every other record of the inode
+            live_bytes -= mapped->live;
+            free(mapped->extents);
+            free(mapped->refs);
+            memset(mapped, 0, sizeof(*mapped));
+            continue;
+        }
+        mapped->offset = relocate(mapped->offset, from, to, old_offsets, new_offsets, n);
+        mapped->base = relocate(mapped->base, from, to, old_offsets, new_offsets, n);
+        for (int j = 0; j < mapped->n_extents; j++) {
+            mapped->extents[j] = relocate(mapped->extents[j], from, to, old_offsets, new_offsets, n);
+        }
+    }
+
+    // dropped chunk records had no references, so their entries go too
+    int dropped = 0;
+    for (uint64_t i = 0; i < chunk_table_size; i++) {
+        struct chunk_entry *chunk = &chunk_table[i];
+        if (!chunk->used || chunk->offset == 0) continue;
+        chunk->offset = relocate(chunk->offset, from, to, old_offsets, new_offsets, n);
+        if (chunk->offset < 0) {
+            chunk->offset = 0;
+            dropped = 1;
+        }
+    }
+    if (dropped) chunk_resize(chunk_table_size);
+}
+
+// Compacts the log if some suffix above the snapshot floor reclaims at least
+// min_reclaim bytes, or resumes a compaction that was cut short. Returns the
+// bytes reclaimed.
+off_t clean_log(off_t min_reclaim) {
+    // records are moved on disk, so nothing may be left in the append buffer
+    if (log_commit() != 0) return 0;
+
+    off_t log_start = wfs_log_start(&superblock);
+    off_t floor = wfs_snapshot_floor(&superblock);
+    off_t old_head = superblock.head;
+    int n_segments = (old_head - log_start) / WFS_SEGMENT_SIZE + 1;
+    struct wfs_segment *segments = calloc(n_segments, sizeof(struct wfs_segment));
+    off_t *first = malloc((inode_map_size + 1) * sizeof(off_t));
+    off_t *old_offsets = NULL, *new_offsets = NULL;
+    struct wfs_inode inode;
+    if (segments == NULL || first == NULL) goto out;
+    for (int i = 0; i < inode_map_size; i++) first[i] = -1;
+
+    // account every record above the floor to the segment it starts in
+    off_t free_space = disk_size - old_head;
+    off_t pinned = 0;
+    int n_records = 0;
+    for (off_t offset = wfs_log_next(&superblock, log_start); offset < old_head;
+            offset = wfs_log_next(&superblock, offset + sizeof(inode) + inode.size)) {
+        if (disk_read(&inode, sizeof(inode), offset) != 0) goto out;
+        struct wfs_segment *segment = &segments[(offset - log_start) / WFS_SEGMENT_SIZE];
+        if (inode.inode_number != WFS_CHUNK_INODE && first[inode.inode_number] < 0) first[inode.inode_number] = offset;
+        off_t length = sizeof(inode) + inode.size;
+        if (offset < floor) {
+            if (!record_is_live(&inode, offset, 0, first)) pinned += length;
+            continue;
+        }
+        if (segment->start == 0) segment->start = offset;
+        if (record_is_live(&inode, offset, 0, first)) {
+            segment->live += length;
+            if (length > free_space && length > segment->dead + segment->hole_needed) {
+                segment->hole_needed = length - segment->dead;
+            }
+        } else {
+            segment->dead += length;
+        }
+        n_records++;
+    }
+    pinned_dead = pinned;
+
+    off_t start = superblock.hole_start;
+    if (superblock.hole_end <= superblock.hole_start) {
+        int skipped = (floor - log_start) / WFS_SEGMENT_SIZE;
+        int chosen = wfs_pick_compaction(segments + skipped, n_segments - skipped, min_reclaim);
+        if (chosen < 0) goto out;
+        chosen += skipped;
+
+        // live records ahead of the first dead one would only move onto themselves
+        start = segments[chosen].start;
+        while (start < old_head) {
+            if (disk_read(&inode, sizeof(inode), start) != 0) goto out;
+            if (!record_is_live(&inode, start, 0, first)) break;
+            start += sizeof(inode) + inode.size;
+        }
+        superblock.hole_start = superblock.hole_end = start;
+    }
+
+    old_offsets = malloc((n_records + 1) * sizeof(off_t));
+    new_offsets = malloc((n_records + 1) * sizeof(off_t));
+    if (old_offsets == NULL || new_offsets == NULL) goto out;
+
+    // copies staged past the head must not pass for appends after a crash
+    // (see build_inode_map()), so move to a new epoch before making any, with
+    // every record of the old one on disk
+    superblock.epoch++;
+    if (disk_sync(MS_SYNC) != 0 || update_superblock() != 0 || disk_sync(MS_SYNC) != 0) goto out;
+
+    while (superblock.hole_end < superblock.head) {
+        // Live records are copied straight into the hole while they fit in it
+        // without overlapping themselves; otherwise they are staged past the
+        // head first and the move is journaled in the superblock.
+        off_t from = superblock.hole_end;
+        off_t next = from;
+        off_t hole_size = superblock.hole_end - superblock.hole_start;
+        off_t staged = 0;
+        int direct = -1, n_moved = 0;
+
+        while (next < superblock.head) {
+            if (disk_read(&inode, sizeof(inode), next) != 0) goto out;
+            off_t length = sizeof(inode) + inode.size;
+            if (record_is_live(&inode, next, start, first)) {
+                if (direct < 0) direct = length <= hole_size;
+                off_t limit = direct ? hole_size : free_space;
+                if (staged + length > limit || staged + length > WFS_MAX_WINDOW) break;
+
+                struct wfs_log_entry *entry = read_entry(next);
+                if (entry == NULL) goto out;
+                off_t to = direct ? superblock.hole_start + staged : superblock.head + staged;
+                int failed = disk_write(entry, length, to);
+                put_entry(entry);
+                if (failed) goto out;
+
+                old_offsets[n_moved] = next;
+                new_offsets[n_moved++] = superblock.hole_start + staged;
+                staged += length;
+            }
+            next += length;
+        }
+        if (next == from) { // no room to move the next live record yet
+            if (superblock.hole_end == superblock.hole_start) superblock.hole_start = superblock.hole_end = 0;
+            break;
+        }
+        if (disk_sync(MS_SYNC) != 0) goto out;
+
+        int failed;
+        if (direct == 0) {
+            superblock.move_src = superblock.head;
+            superblock.move_dst = superblock.hole_start;
+            superblock.move_len = staged;
+            superblock.move_end = next;
+            failed = update_superblock() != 0 || disk_sync(MS_SYNC) != 0 || finish_log_move() != 0;
+        } else {
+            failed = set_log_hole(superblock.hole_start + staged, next) != 0;
+        }
+        if (failed) {
+            printf("Log compaction failed\n");
+            goto out;
+        }
+        relocate_map(from, next, old_offsets, new_offsets, n_moved);
+        if (superblock.hole_end <= superblock.hole_start) break; // reached the head
+    }
+
+out:
+    atomic_store(&log_tail, superblock.head);
+    set_log_buf_start(superblock.head);
+    STAT_ADD(cleaner_passes, 1);
+    STAT_ADD(reclaimed_bytes, old_head - superblock.head);
+    free(segments);
+    free(first);
+    free(old_offsets);
+    free(new_offsets);
+    return old_head - superblock.head;
+}
+
+// Makes sure size more bytes fit in the log, growing the image or, once it
+// is at its maximum size, cleaning the log if they don't, and sets them aside
+// for the calling operation so concurrent operations can't take them first.
+// Must be called with fs_lock held for reading and no other lock, since
+// cleaning briefly trades it for the write lock; anything looked up before
+// may have moved by the time it returns.
+int make_room(size_t size) {
+    off_t reclaimed = 1;
+    for (;;) {
+        off_t promised = atomic_fetch_add(&log_promised, size) + size;
+        if (atomic_load(&log_tail) + promised <= disk_size) {
+            my_promise += size;
+            return 0;
+        }
+        atomic_fetch_sub(&log_promised, size);
+        if (reclaimed == 0) return -1;
+        if (grow_disk(atomic_load(&log_tail) + promised) == 0) continue;
+
+        // other operations may use up what a pass frees before this one gets
+        // back to it, so keep going while the cleaner makes progress
+        pthread_rwlock_unlock(&fs_lock);
+        pthread_rwlock_wrlock(&fs_lock);
+        off_t needed = atomic_load(&log_tail) + atomic_load(&log_promised) + size - disk_size;
+        reclaimed = needed > 0 ? clean_log(needed) : 1;
+        pthread_rwlock_unlock(&fs_lock);
+        pthread_rwlock_rdlock(&fs_lock);
+    }
+}
+
+// Gives back whatever room the operation set aside but did not append.
+void release_room() {
+    atomic_fetch_sub(&log_promised, my_promise);
+    my_promise = 0;
+}
+
+void *cleaner_thread(void *arg) {
+    pthread_mutex_lock(&cleaner_lock);
+    while (cleaner_running) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += clean_interval;
+        pthread_cond_timedwait(&cleaner_wakeup, &cleaner_lock, &deadline);
+        if (!cleaner_running) break;
+        pthread_mutex_unlock(&cleaner_lock);
+
+        // worth a pass once a quarter of the log above the snapshot floor is
+        // dead, going by what was dead below it at the last pass
+        pthread_rwlock_wrlock(&fs_lock);
+        off_t used = superblock.head - wfs_snapshot_floor(&superblock);
+        off_t dead = superblock.head - wfs_log_start(&superblock) - live_bytes - pinned_dead;
+        if ((dead >= WFS_SEGMENT_SIZE && dead * 4 >= used) || superblock.hole_end > superblock.hole_start) {
+            clean_log(WFS_SEGMENT_SIZE);
+        }
+        arena_reset();
+        // the map is snapshotted under the write lock, but written out while
+        // operations go on
+        struct wfs_checkpoint *checkpoint = checkpoint_due(CHECKPOINT_LOG_BYTES) ? build_checkpoint() : NULL;
+        pthread_rwlock_unlock(&fs_lock);
+        if (checkpoint != NULL) {
+            pthread_rwlock_rdlock(&fs_lock);
+            store_checkpoint(checkpoint);
+            pthread_rwlock_unlock(&fs_lock);
+            free(checkpoint);
+        }
+
+        pthread_mutex_lock(&cleaner_lock);
+    }
+    pthread_mutex_unlock(&cleaner_lock);
+    return NULL;
+}
+
+void *commit_thread(void *arg) {
+    pthread_mutex_lock(&commit_lock);
+    while (committer_running) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += commit_interval % 1000 * 1000000L;
+        deadline.tv_sec += commit_interval / 1000 + deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&commit_wakeup, &commit_lock, &deadline);
+        if (!committer_running) break;
+        pthread_mutex_unlock(&commit_lock);
+
+        // under fs_lock, so as not to commit in the middle of a cleaner pass
+        pthread_rwlock_rdlock(&fs_lock);
+        pthread_mutex_lock(&sb_lock);
+        int dirty = superblock.head != committed_head;
+        pthread_mutex_unlock(&sb_lock);
+        if (dirty) log_commit();
+        pthread_rwlock_unlock(&fs_lock);
+
+        pthread_mutex_lock(&commit_lock);
+    }
+    pthread_mutex_unlock(&commit_lock);
+    return NULL;
+}
+
+// Rewrites a file or directory as a single full record, dropping the extent
+// or dentry records on top of its last one. With times, the record takes
+// their atime, mtime and ctime and is written even if there is nothing to
+// drop; that is how a directory's times are set.
+static int rewrite_inode(unsigned int inode_number, const struct wfs_inode *times) {
+    struct wfs_inode inode;
+    if (get_inode(inode_number, &inode) != 0) return -ENOENT;
+    size_t needed = sizeof(inode) + encoded_bound(inode.size);
+    for (;;) {
+        if (needed > my_promise && make_room(needed - my_promise) != 0) return -ENOSPC;
+        lock_inodes(inode_number, inode_number);
+        if (get_inode(inode_number, &inode) != 0) {
+            unlock_inodes(inode_number, inode_number);
+            return -ENOENT;
+        }
+        // another writer may have got to it first
+        if (times == NULL && get_extent_count(inode_number) == 0) {
+            unlock_inodes(inode_number, inode_number);
+            return 0;
+        }
+        needed = sizeof(inode) + encoded_bound(inode.size);
+        if (needed <= my_promise) break;
+        unlock_inodes(inode_number, inode_number);
+    }
+
+    uint64_t size = 0;
+    char *data;
+    if (S_ISDIR(inode.mode)) {
+        struct dir_table *dir = get_dir(inode_number);
+        data = dir == NULL ? NULL : arena_alloc(dir->n_live * sizeof(struct wfs_dentry) + 1);
+        for (int i = 0; data != NULL && i < dir->n_entries; i++) {
+            if (dir->entries[i].name[0] == '\0') continue;
+            memcpy(data + size, &dir->entries[i], sizeof(struct wfs_dentry));
+            size += sizeof(struct wfs_dentry);
+        }
+    } else {
+        data = load_file(inode_number, &size);
+    }
+    if (data == NULL) {
+        unlock_inodes(inode_number, inode_number);
+        return -ENOMEM;
+    }
+
+    // file data is encoded anew
+    struct encoding encoding;
+    memset(&encoding, 0, sizeof(encoding));
+    encoding.stored = size;
+    struct iovec *iov = NULL;
+    if ((!S_ISDIR(inode.mode) && encode_data(data, size, &encoding) != 0) ||
+            (iov = arena_alloc((3 * encoding.n_chunks + 2) * sizeof(struct iovec))) == NULL ||
+            map_reserve(inode_number, 0, encoding.n_refs, encoding.n_chunks) != 0) {
+        arena_free(iov);
+        free_encoding(&encoding);
+        arena_free(data);
+        unlock_inodes(inode_number, inode_number);
+        return -ENOMEM;
+    }
+    inode.flags = WFS_RECORD_FULL;
+    inode.size = encoding.stored;
+    inode.raw_size = encoding.raw_size;
+    if (times != NULL) {
+        inode.atime = times->atime;
+        inode.mtime = times->mtime;
+        inode.ctime = times->ctime;
+    }
+
+    int n = encoding_iov(&encoding, iov);
+    iov[n++] = (struct iovec) { &inode, sizeof(inode) };
+    iov[n++] = (struct iovec) { encoding.data != NULL ? encoding.data : data, encoding.stored };
+    off_t offset = log_appendv(iov, n);
+    arena_free(iov);
+    if (offset < 0) {
+        map_release(encoding.n_chunks);
+        free_encoding(&encoding);
+        arena_free(data);
+        unlock_inodes(inode_number, inode_number);
+        return errno == ENOSPC ? -ENOSPC : -EIO;
+    }
+    offset = encoding_applied(&encoding, offset);
+    int ret = inode_map_update(&inode, offset, NULL, encoding.refs, encoding.n_refs) != 0 ? -EIO : 0;
+    map_release(encoding.n_chunks);
+    free_encoding(&encoding);
+    arena_free(data);
+    unlock_inodes(inode_number, inode_number);
+    if (times == NULL) STAT_ADD(consolidations, 1);
+    if (log_end_operation() != 0) return -EIO;
+    return ret;
+}
+
+int consolidate_inode(unsigned int inode_number) {
+    return rewrite_inode(inode_number, NULL);
+}
+
+// Write-back. Writes through the handles of a file opened for writing are
+// gathered in a buffer the handles share and appended as a single record
+// when the file is flushed (on each close), fsynced or released, when it is
+// read, or once the buffer reaches WRITE_BUF_MAX or all buffers together take
+// more than the --write-cache budget. A buffer holds one contiguous range of
+// the file; a write that neither overlaps nor extends it flushes it first.
+// Writing a file front to back thus appends one record per WRITE_BUF_MAX
+// rather than one per write, and a full record at that if the buffer covers
+// the whole file. As with any write-back cache, a failure to append shows up
+// at the flush rather than at the write, or at the next write to a buffer it
+// left full. A buffer is guarded by its file's inode lock.
+#define WRITE_BUF_MAX (8 * 1048576)
+#define WRITE_BUF_MIN 65536     // first allocation, doubled as needed
+
+size_t write_cache_size = 64 * 1048576; // --write-cache=MB, 0 turns write-back off
+_Atomic size_t write_cache_used;        // bytes allocated by all buffers
+
+struct write_buf {
+    unsigned int inode_number;
+    int opens;                  // handles using it
+    char *data;
+    off_t start;                // file offset of data[0]
+    size_t length;              // bytes buffered, 0 if there is nothing to flush
+    size_t capacity;
+};
+
+// Returns a file's buffer, or NULL if it is not open for writing.
+static struct write_buf *get_write_buf(unsigned int inode_number) {
+    pthread_rwlock_rdlock(&map_lock);
+    struct inode_map_entry *mapped = get_mapped(inode_number);
+    struct write_buf *wbuf = mapped != NULL ? mapped->wbuf : NULL;
+    pthread_rwlock_unlock(&map_lock);
+    return wbuf;
+}
+
+static void free_write_data(struct write_buf *wbuf) {
+    atomic_fetch_sub(&write_cache_used, wbuf->capacity);
+    free(wbuf->data);
+    wbuf->data = NULL;
+    wbuf->length = wbuf->capacity = 0;
+}
+
+// Appends whatever a file's buffer holds and empties it.
+int flush_write_buf(unsigned int inode_number) {
+    if (get_write_buf(inode_number) == NULL) return 0;
+    struct write_buf *wbuf;
+    size_t needed = 0;
+    for (;;) {
+        if (needed > my_promise && make_room(needed - my_promise) != 0) return -ENOSPC;
+        lock_inodes(inode_number, inode_number);
+        wbuf = get_write_buf(inode_number);
+        if (wbuf == NULL || wbuf->length == 0) {
+            unlock_inodes(inode_number, inode_number);
+            return 0;
+        }
+        needed = sizeof(struct wfs_inode) + sizeof(struct wfs_extent) + encoded_bound(wbuf->length);
+        if (needed <= my_promise) break;
+        unlock_inodes(inode_number, inode_number);
+    }
+    struct wfs_inode inode;
+    if (get_inode(inode_number, &inode) != 0) {
+        unlock_inodes(inode_number, inode_number);
+        return -ENOENT;
+    }
+
+    struct encoding encoding;
+    struct iovec *iov = NULL;
+    if (encode_data(wbuf->data, wbuf->length, &encoding) != 0 ||
+            (iov = arena_alloc((3 * encoding.n_chunks + 3) * sizeof(struct iovec))) == NULL ||
+            map_reserve(inode_number, 1, encoding.n_refs, encoding.n_chunks) != 0) {
+        arena_free(iov);
+        free_encoding(&encoding);
+        unlock_inodes(inode_number, inode_number);
+        return -ENOMEM;
+    }
+
+    // a buffer covering the whole file replaces it
+    struct wfs_extent extent;
+    extent.offset = wbuf->start;
+    extent.length = wbuf->length;
+    extent.file_size = wbuf->start + wbuf->length > inode.size ? wbuf->start + wbuf->length : inode.size;
+    int full = wbuf->start == 0 && wbuf->length >= inode.size;
+
+    inode.flags = full ? WFS_RECORD_FULL : WFS_RECORD_EXTENT;
+    inode.size = (full ? 0 : sizeof(extent)) + encoding.stored;
+    inode.raw_size = encoding.raw_size;
+    inode.mtime = inode.ctime = time(NULL);
+
+    int n = encoding_iov(&encoding, iov);
+    iov[n++] = (struct iovec) { &inode, sizeof(inode) };
+    if (!full) iov[n++] = (struct iovec) { &extent, sizeof(extent) };
+    iov[n++] = (struct iovec) { encoding.data != NULL ? encoding.data : wbuf->data, encoding.stored };
+    off_t offset = log_appendv(iov, n);
+    arena_free(iov);
+    if (offset < 0) {
+        printf("Error writing file\n");
+        map_release(encoding.n_chunks);
+        free_encoding(&encoding);
+        unlock_inodes(inode_number, inode_number);
+        return errno == ENOSPC ? -ENOSPC : -EIO;
+    }
+    offset = encoding_applied(&encoding, offset);
+    int ret = inode_map_update(&inode, offset, full ? NULL : &extent, encoding.refs, encoding.n_refs) != 0 ? -EIO : 0;
+    map_release(encoding.n_chunks);
+    free_encoding(&encoding);
+    free_write_data(wbuf);
+    int n_extents = get_extent_count(inode_number);
+    unlock_inodes(inode_number, inode_number);
+    STAT_ADD(buffer_flushes, 1);
+    if (log_end_operation() != 0 || ret != 0) return -EIO;
+
+    if (n_extents >= WFS_MAX_EXTENTS) consolidate_inode(inode_number);
+    return 0;
+}
+
+// Adds a write of the size bytes in bufv to the file's buffer, copying them
+// straight from wherever libfuse has them. Returns 0 if it was buffered, 1 if
+// the file has no buffer or the write is too large for one, or -errno.
+int buffer_write(unsigned int inode_number, struct fuse_bufvec *bufv, size_t size, off_t offset) {
+    if (size == 0 || size > WRITE_BUF_MAX || get_write_buf(inode_number) == NULL) return 1;
+    struct write_buf *wbuf;
+    for (;;) {
+        lock_inodes(inode_number, inode_number);
+        wbuf = get_write_buf(inode_number);
+        if (wbuf == NULL) {
+            unlock_inodes(inode_number, inode_number);
+            return 1;
+        }
+        // a buffer left full by a failed flush takes nothing more until it is
+        // flushed, and the write gets the error if it cannot be; with the
+        // cache full of other buffers, the write goes straight to the log
+        int full = wbuf->length >= WRITE_BUF_MAX || atomic_load(&write_cache_used) > write_cache_size;
+        if (full && wbuf->length == 0) {
+            unlock_inodes(inode_number, inode_number);
+            return 1;
+        }
+        if (wbuf->length == 0) wbuf->start = offset;
+        off_t end = wbuf->start + wbuf->length;
+        size_t length = offset + size > end ? offset + size - wbuf->start : wbuf->length;
+        if (!full && offset >= wbuf->start && offset <= end && length <= WRITE_BUF_MAX) {
+            size_t capacity = wbuf->capacity > 0 ? wbuf->capacity : WRITE_BUF_MIN;
+            while (capacity < length) capacity *= 2;
+            char *data = capacity > wbuf->capacity ? realloc(wbuf->data, capacity) : wbuf->data;
+            if (data == NULL) {
+                unlock_inodes(inode_number, inode_number);
+                return -ENOMEM;
+            }
+            atomic_fetch_add(&write_cache_used, capacity - wbuf->capacity);
+            wbuf->data = data;
+            wbuf->capacity = capacity;
+            struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+            dst.buf[0].mem = data + (offset - wbuf->start);
+            if (fuse_buf_copy(&dst, bufv, 0) != (ssize_t) size) {
+                unlock_inodes(inode_number, inode_number);
+                return -EIO;
+            }
+            wbuf->length = length;
+            break;
+        }
+        unlock_inodes(inode_number, inode_number);
+        int ret = flush_write_buf(inode_number);
+        if (ret < 0) return ret;
+    }
+    int full = wbuf->length >= WRITE_BUF_MAX || atomic_load(&write_cache_used) > write_cache_size;
+    unlock_inodes(inode_number, inode_number);
+    STAT_ADD(buffered_writes, 1);
+
+    // the write is in; a failed flush is reported by the next one (see above)
+    if (full) flush_write_buf(inode_number);
+    return 0;
+}
+
+// Size of a file counting what its buffer holds, given its size in the map
+// (which is read again if there is a buffer, since a flush may have moved
+// data from one to the other since).
+uint64_t buffered_size(unsigned int inode_number, uint64_t size) {
+    if (get_write_buf(inode_number) == NULL) return size;
+    lock_inodes(inode_number, inode_number);
+    pthread_rwlock_rdlock(&map_lock);
+    struct inode_map_entry *mapped = get_mapped(inode_number);
+    struct write_buf *wbuf = mapped != NULL ? mapped->wbuf : NULL;
+    if (mapped != NULL) size = mapped->size;
+    pthread_rwlock_unlock(&map_lock);
+    if (wbuf != NULL && wbuf->length > 0 && wbuf->start + wbuf->length > size) size = wbuf->start + wbuf->length;
+    unlock_inodes(inode_number, inode_number);
+    return size;
+}
+
+// Returns the buffer of a file being opened for writing, set up on the first
+// such open, or NULL if it is gone.
+struct write_buf *open_write_buf(unsigned int inode_number) {
+    lock_inodes(inode_number, inode_number);
+    struct write_buf *wbuf = get_write_buf(inode_number);
+    if (wbuf == NULL && (wbuf = calloc(1, sizeof(*wbuf))) != NULL) {
+        wbuf->inode_number = inode_number;
+        pthread_rwlock_wrlock(&map_lock);
+        struct inode_map_entry *mapped = get_mapped(inode_number);
+        if (mapped != NULL) mapped->wbuf = wbuf;
+        pthread_rwlock_unlock(&map_lock);
+        if (mapped == NULL) {
+            free(wbuf);
+            wbuf = NULL;
+        }
+    }
+    if (wbuf != NULL) wbuf->opens++;
+    unlock_inodes(inode_number, inode_number);
+    return wbuf;
+}
+
+// Flushes a buffer as one of its handles goes away and frees it with the last.
+int release_write_buf(struct write_buf *wbuf) {
+    unsigned int inode_number = wbuf->inode_number;
+    int ret = flush_write_buf(inode_number);
+    lock_inodes(inode_number, inode_number);
+    if (--wbuf->opens == 0) {
+        pthread_rwlock_wrlock(&map_lock);
+        if (inode_number < inode_map_size && inode_map[inode_number].wbuf == wbuf) inode_map[inode_number].wbuf = NULL;
+        pthread_rwlock_unlock(&map_lock);
+        free_write_data(wbuf);
+        free(wbuf);
+    }
+    unlock_inodes(inode_number, inode_number);
+    return ret;
+}
+
+// Throws away what a file that was just unlinked still had buffered; its
+// handles keep the buffer until they are released. Called with the inode
+// lock held.
+void drop_write_buf(unsigned int inode_number) {
+    pthread_rwlock_wrlock(&map_lock);
+    struct write_buf *wbuf = NULL;
+    if (inode_number < inode_map_size) {
+        wbuf = inode_map[inode_number].wbuf;
+        inode_map[inode_number].wbuf = NULL;
+    }
+    pthread_rwlock_unlock(&map_lock);
+    if (wbuf != NULL) free_write_data(wbuf);
+}
+
+double stats_ratio(uint64_t a, uint64_t b) {
+    return b == 0 ? 0 : (double) a / b;
+}
+
+// Upper bound in microseconds of the histogram bucket holding quantile p.
+uint64_t stats_percentile(const uint64_t *buckets, uint64_t count, double p) {
+    uint64_t seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen > 0 && seen >= p * count) return (uint64_t) 1 << i;
+    }
+    return 0;
+}
+
+#define STAT(counter) ((unsigned long) atomic_load_explicit(&stats.counter, memory_order_relaxed))
+
+// Formats the statistics file, one "name value" line each, into a malloc'd
+// string. Must be called with fs_lock held for reading, which keeps the
+// cleaner from moving the head meanwhile.
+char *stats_format() {
+    char *text = NULL;
+    size_t size;
+    FILE *out = open_memstream(&text, &size);
+    if (out == NULL) return NULL;
+
+    fprintf(out, "# write \"reset\" to zero the counters; histogram bucket i counts latencies under 2^i us\n");
+    for (int op = 0; op < N_OPS; op++) {
+        struct op_stats *op_stats = &stats.ops[op];
+        uint64_t buckets[LATENCY_BUCKETS], count = 0;
+        for (int i = 0; i < LATENCY_BUCKETS; i++) {
+            buckets[i] = atomic_load_explicit(&op_stats->buckets[i], memory_order_relaxed);
+            count += buckets[i];
+        }
+        uint64_t total_ns = atomic_load_explicit(&op_stats->total_ns, memory_order_relaxed);
+        fprintf(out, "%s.count %lu\n", op_names[op], (unsigned long) count);
+        fprintf(out, "%s.errors %lu\n", op_names[op],
+                (unsigned long) atomic_load_explicit(&op_stats->errors, memory_order_relaxed));
+        fprintf(out, "%s.avg_us %.1f\n", op_names[op], stats_ratio(total_ns, count) / 1000);
+        fprintf(out, "%s.p50_us %lu\n", op_names[op], (unsigned long) stats_percentile(buckets, count, 0.5));
+        fprintf(out, "%s.p99_us %lu\n", op_names[op], (unsigned long) stats_percentile(buckets, count, 0.99));
+        fprintf(out, "%s.p999_us %lu\n", op_names[op], (unsigned long) stats_percentile(buckets, count, 0.999));
+        fprintf(out, "%s.histogram", op_names[op]);
+        for (int i = 0; i < LATENCY_BUCKETS; i++) fprintf(out, " %lu", (unsigned long) buckets[i]);
+        fprintf(out, "\n");
     }
 
-    // Calculate the length of the directory path
-    size_t dir_length = last_slash - path;
+    fprintf(out, "lookup.records_scanned_per_lookup %.4f\n", stats_ratio(STAT(dir_records), STAT(lookups)));
+    fprintf(out, "dir.table_hit_rate %.4f\n", stats_ratio(STAT(dir_hits), STAT(dir_hits) + STAT(dir_loads)));
+    fprintf(out, "dir.loads %lu\n", STAT(dir_loads));
+    fprintf(out, "dir.records_replayed %lu\n", STAT(dir_records));
+    fprintf(out, "file.records_per_read %.4f\n", stats_ratio(STAT(file_records), STAT(file_reads)));
+    fprintf(out, "file.zero_copy_reads %lu\n", STAT(zero_copy_reads));
+    fprintf(out, "arena.chunk_allocs %lu\n", STAT(arena_chunks));
 
-    // Allocate memory for the directory path
-    char *directory = (char *)malloc(dir_length + 1);
-    if (directory == NULL) {
-        // Memory allocation failed
+    pthread_rwlock_rdlock(&map_lock);
+    off_t live = live_bytes;
+    uint64_t chunks = n_chunks;
+    pthread_rwlock_unlock(&map_lock);
+    pthread_mutex_lock(&sb_lock);
+    off_t used = superblock.head - wfs_log_start(&superblock);
+    off_t head = superblock.head;
+    pthread_mutex_unlock(&sb_lock);
+    fprintf(out, "log.appends %lu\n", STAT(appends));
+    fprintf(out, "log.appended_bytes %lu\n", STAT(appended_bytes));
+    fprintf(out, "log.superblock_writes %lu\n", STAT(superblock_writes));
+    fprintf(out, "log.consolidations %lu\n", STAT(consolidations));
+    fprintf(out, "log.pad_bytes %lu\n", STAT(pad_bytes));
+    fprintf(out, "log.head %lu\n", (unsigned long) head);
+    fprintf(out, "log.live_bytes %lu\n", (unsigned long) live);
+    fprintf(out, "log.dead_bytes %lu\n", (unsigned long) (used > live ? used - live : 0));
+    fprintf(out, "log.disk_size %lu\n", (unsigned long) atomic_load(&disk_size));
+    fprintf(out, "compression.raw_bytes %lu\n", STAT(compressed_raw_bytes));
+    fprintf(out, "compression.stored_bytes %lu\n", STAT(compressed_stored_bytes));
+    fprintf(out, "compression.ratio %.4f\n", stats_ratio(STAT(compressed_raw_bytes), STAT(compressed_stored_bytes)));
+    fprintf(out, "dedup.shared_blocks %lu\n", STAT(dedup_shared_blocks));
+    fprintf(out, "dedup.shared_bytes %lu\n", STAT(dedup_shared_bytes));
+    fprintf(out, "dedup.chunks_written %lu\n", STAT(dedup_chunks_written));
+    fprintf(out, "dedup.chunks %lu\n", (unsigned long) chunks);
+    fprintf(out, "writeback.buffered_writes %lu\n", STAT(buffered_writes));
+    fprintf(out, "writeback.flushes %lu\n", STAT(buffer_flushes));
+    fprintf(out, "writeback.cached_bytes %lu\n", (unsigned long) atomic_load(&write_cache_used));
+    fprintf(out, "io.uring %d\n", ring.fd >= 0);
+    fprintf(out, "io.ring_submits %lu\n", STAT(ring_submits));
+    fprintf(out, "io.requests_per_submit %.4f\n", stats_ratio(STAT(ring_requests), STAT(ring_submits)));
+    fprintf(out, "io.direct %d\n", direct_fd >= 0);
+    fprintf(out, "io.direct_reads %lu\n", STAT(direct_reads));
+    fprintf(out, "io.direct_writes %lu\n", STAT(direct_writes));
+    fprintf(out, "cleaner.passes %lu\n", STAT(cleaner_passes));
+    fprintf(out, "cleaner.reclaimed_bytes %lu\n", STAT(reclaimed_bytes));
+    fprintf(out, "cleaner.pinned_dead_bytes %lu\n", (unsigned long) pinned_dead);
+    int n_snapshots = 0;
+    for (int i = 0; i < WFS_MAX_SNAPSHOTS; i++) n_snapshots += superblock.snapshots[i].name[0] != '\0';
+    fprintf(out, "snapshot.count %d\n", n_snapshots);
+    fprintf(out, "checkpoint.writes %lu\n", STAT(checkpoints));
+
+    if (fclose(out) != 0) {
+        free(text);
         return NULL;
     }
+    return text;
+}
 
-    // Copy the directory part into the new string
-    strncpy(directory, path, dir_length);
-    directory[dir_length] = '\0'; // Null-terminate the string
-
-    return directory;
+// The control files (statistics and snapshots) are opened for direct I/O,
+// since their size is unknown, and reads are served from a copy of their
+// text taken at open. Without a handle the statistics are formatted afresh.
+static int control_read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+    char *copy = fi != NULL ? (char *) (uintptr_t) fi->fh : NULL;
+    char *text = copy != NULL ? copy : stats_format();
+    if (text == NULL) return -ENOMEM;
+    size_t length = strlen(text);
+    size_t n = offset >= length ? 0 : length - offset < size ? length - offset : size;
+    memcpy(buf, text + offset, n);
+    if (text != copy) free(text);
+    return n;
 }
 
-char* get_name(const char *path) {
-    // Find the last occurrence of '/'
-    char *last_slash = strrchr(path, '/');
-    if (last_slash == NULL) {
-        // No slash found, assume the entire path is a file name
-        return strdup(path);
-    }
+static int stats_write(struct fuse_bufvec *bufv) {
+    char buf[6];
+    size_t size = fuse_buf_size(bufv);
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(sizeof(buf));
+    dst.buf[0].mem = buf;
+    if (size > sizeof(buf) || fuse_buf_copy(&dst, bufv, 0) != (ssize_t) size) return -EINVAL;
 
-    // The file name starts right after the last slash
-    return strdup(last_slash + 1);
+    // "reset", with or without a newline
+    if ((size != 5 && (size != 6 || buf[5] != '\n')) || strncmp(buf, "reset", 5) != 0) return -EINVAL;
+    stats_reset();
+    return size;
 }
 
-char** split_path(const char *path, int *num_components) {
-    // Copy the path as strtok modifies the original string
-    char *path_copy = strdup(path);
-    if (path_copy == NULL) {
-        return NULL; // Memory allocation failed
-    }
+// Snapshots, listed one per line in SNAPSHOTS_NAME in the root; writing
+// "create NAME" or "delete NAME" to it takes or drops one. Taking one costs a
+// commit and a superblock write: the snapshot is the head and epoch at the
+// time (see struct wfs_snapshot), and mount.wfs --snapshot=NAME mounts it.
+#define SNAPSHOTS_NAME ".wfs_snapshots"
 
-    // Count the number of components
-    int count = 0;
-    char *temp = path_copy;
-    while (*temp != '\0') {
-        if (*temp == '/') {
-            count++;
-        }
-        temp++;
-    }
+char *snapshots_format() {
+    char *text = NULL;
+    size_t size;
+    FILE *out = open_memstream(&text, &size);
+    if (out == NULL) return NULL;
 
-    // Allocate memory for the array of pointers
-    char **components = malloc((count + 1) * sizeof(char *));
-    if (components == NULL) {
-        free(path_copy);
-        return NULL; // Memory allocation failed
+    fprintf(out, "# write \"create NAME\" or \"delete NAME\"; NAME head epoch time\n");
+    for (int i = 0; i < WFS_MAX_SNAPSHOTS; i++) {
+        struct wfs_snapshot *snapshot = &superblock.snapshots[i];
+        if (snapshot->name[0] == '\0') continue;
+        fprintf(out, "%s %lu %lu %lu\n", snapshot->name, (unsigned long) snapshot->head,
+                (unsigned long) snapshot->epoch, (unsigned long) snapshot->time);
     }
 
-    // Split the path using strtok
-    const char delim[2] = "/";
-    char *token;
-    components[0] = strdup("");
-    int i = 1;
-    token = strtok(path_copy, delim);
-    while (token != NULL) {
-        components[i++] = strdup(token); // Duplicate and store the component
-        token = strtok(NULL, delim);
+    if (fclose(out) != 0) {
+        free(text);
+        return NULL;
     }
-    components[i] = NULL; // Null-terminate the array
-
-    *num_components = i; // Set the number of components
-    free(path_copy);
-    return components;
+    return text;
 }
 
-int update_superblock() {
-    // Seek to the beginning of the disk where the superblock is located
-    if (lseek(fd, 0, SEEK_SET) == (off_t) -1) {
-        perror("Error seeking to superblock");
-        return -1;
+// Appends what every write-back buffer holds, so that a snapshot taken next
+// has every write made before it. Called with fs_lock held for reading.
+static int flush_write_bufs() {
+    pthread_rwlock_rdlock(&map_lock);
+    int n = inode_map_size;
+    pthread_rwlock_unlock(&map_lock);
+    for (int i = 0; i < n; i++) {
+        int ret = flush_write_buf(i);
+        if (ret < 0) return ret;
     }
+    return 0;
+}
 
-    // Write the superblock to the disk
-    ssize_t written = write(fd, &superblock, sizeof(superblock));
-    if (written != sizeof(superblock)) {
-        perror("Error writing superblock");
-        return -1;
+static struct wfs_snapshot *find_snapshot(const char *name) {
+    for (int i = 0; i < WFS_MAX_SNAPSHOTS; i++) {
+        if (strcmp(superblock.snapshots[i].name, name) == 0) return &superblock.snapshots[i];
     }
-
-    return 0; // Superblock updated successfully
+    return NULL;
 }
 
-struct wfs_log_entry *get_path_entry(const char *path) {
-    struct wfs_log_entry *entry = NULL;
-    int n;
-    char **path_components = split_path(path, &n);
-    int search_num = 0;
-    int updated = 0;
-
-    for (int i = 0; i < n; i++) {
-        lseek(fd, sizeof(struct wfs_sb), SEEK_SET); // skip over superblock
-        struct wfs_inode current_inode;
-        int prev = search_num;
-        int new_search_num = search_num;
-        read(fd, &current_inode, sizeof(struct wfs_inode));
-        while( current_inode.atime != 0) {
-            if(current_inode.inode_number == search_num) {
-                if(current_inode.deleted == 1) {
-                    if (entry != (void*)NULL) free(entry);
-                    return NULL;
-                }
-                if((current_inode.mode & S_IFDIR) == S_IFDIR) { // directory
-                    int size = current_inode.size;
-                    int dir_n = size / sizeof(struct wfs_dentry);
-                    struct wfs_dentry dir_content[dir_n]; // make array for dir entries
-                    read(fd, &dir_content, size); // get dir entries
-
-                    if (i+1 >= n) { // check if dir is last in path
-                        updated = 1;
-                        if (entry != (void*)NULL) free(entry);
-                        entry = malloc(sizeof(current_inode) + size);
-                        entry->inode = current_inode;
-                        memcpy(&entry->data, &dir_content, size);
-                    } else { 
-                        for (int j = 0; j < dir_n; j++) { // check each content of dir
-                            if (strcmp(dir_content[j].name, path_components[i+1]) == 0) {
-                                new_search_num = dir_content[j].inode_number;
-                            }
-                        }
-                    }
+// Records the log as it is now under name. The snapshot's records must never
+// move, so a compaction that is under way is finished first; one that can't
+// be, for want of room, fails the snapshot. Called with fs_lock held for
+// writing.
+static int snapshot_create(const char *name) {
+    if (find_snapshot(name) != NULL) return -EEXIST;
+    struct wfs_snapshot *snapshot = find_snapshot("");
+    if (snapshot == NULL) return -ENOSPC;
 
-                    
-                } else if ((current_inode.mode & S_IFREG) == S_IFREG) { // file
-                    int size = current_inode.size;
-                    char content[size]; // make content buffer
-                    read(fd, &content, size); // get file content
+    if (log_commit() != 0) return -EIO;
+    if (superblock.hole_end > superblock.hole_start) clean_log(0);
+    if (superblock.hole_end > superblock.hole_start) return -EBUSY;
 
-                    if (i != n-1) { // check that file is end of path
-                        if (entry != (void*)NULL) free(entry);
-                        return NULL;
-                    }
+    strcpy(snapshot->name, name);
+    snapshot->head = superblock.head;
+    snapshot->epoch = superblock.epoch;
+    snapshot->time = time(NULL);
+    pinned_dead = 0;            // recounted by the next cleaner pass
+    if (update_superblock() != 0 || disk_sync(MS_SYNC) != 0) {
+        memset(snapshot, 0, sizeof(*snapshot));
+        return -EIO;
+    }
+    return 0;
+}
 
-                    updated = 1;
-                    if (entry != (void*)NULL) free(entry);
-                    entry = malloc(sizeof(current_inode) + size);
-                    entry->inode = current_inode;
-                    memcpy(&entry->data, &content, size);
-                }
-            } else {
-                // skip past data
-                int size = current_inode.size;
-                lseek(fd, size, SEEK_CUR);
-            }
-            read(fd, &current_inode, sizeof(struct wfs_inode));
-        }
-        if (i+1 >= n) {
-            if (updated == 1) {
-                return entry;
-            }
-            else {
-                if (entry != (void*)NULL) free(entry);
-                return NULL;
-            }
-        }
-        search_num = new_search_num;
-        if (prev == search_num) {
-            if (entry != (void*)NULL) free(entry);
-            return NULL;
-        }
+// Forgets a snapshot, letting the cleaner at the records only it kept. It
+// must not be mounted at the time. Called with fs_lock held for writing.
+static int snapshot_delete(const char *name) {
+    struct wfs_snapshot *snapshot = find_snapshot(name);
+    if (snapshot == NULL) return -ENOENT;
+    struct wfs_snapshot deleted = *snapshot;
+    memset(snapshot, 0, sizeof(*snapshot));
+    pinned_dead = 0;
+    if (update_superblock() != 0 || disk_sync(MS_SYNC) != 0) {
+        *snapshot = deleted;
+        return -EIO;
     }
-    if (entry != (void*)NULL) free(entry);
-    return NULL;
+    return 0;
 }
 
-int set_deleted(const char *path) {
-    int n;
-    char **path_components = split_path(path, &n);
-    int search_num = 0;
-    int updated = 0;
+// Takes fs_lock itself, for writing once the write-back buffers are flushed.
+static int snapshots_write(struct fuse_bufvec *bufv) {
+    char buf[sizeof("create ") + MAX_FILE_NAME_LEN];
+    size_t size = fuse_buf_size(bufv);
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(sizeof(buf));
+    dst.buf[0].mem = buf;
+    if (size >= sizeof(buf) || fuse_buf_copy(&dst, bufv, 0) != (ssize_t) size) return -EINVAL;
+    buf[size] = '\0';
+    if (size > 0 && buf[size - 1] == '\n') buf[size - 1] = '\0';
 
-    for (int i = 0; i < n; i++) {
-        lseek(fd, sizeof(struct wfs_sb), SEEK_SET); // skip over superblock
-        struct wfs_inode current_inode;
-        int prev = search_num;
-        int new_search_num = search_num;
-        read(fd, &current_inode, sizeof(struct wfs_inode));
-        while( current_inode.atime != 0) {
-            if(current_inode.inode_number == search_num) {
-                if(current_inode.deleted == 1) return -1;
-                if((current_inode.mode & S_IFDIR) == S_IFDIR) { // directory
-                    int size = current_inode.size;
-                    int dir_n = size / sizeof(struct wfs_dentry);
-                    struct wfs_dentry dir_content[dir_n]; // make array for dir entries
-                    read(fd, &dir_content, size); // get dir entries
-
-                    if (i+1 >= n) { // check if dir is last in path
-                        lseek(fd, -sizeof(struct wfs_inode), SEEK_CUR);
-                        current_inode.deleted = 1;
-                        write(fd, &current_inode, sizeof(struct wfs_inode));
-                        lseek(fd, current_inode.size, SEEK_CUR);
-                    } else { 
-                        for (int j = 0; j < dir_n; j++) { // check each content of dir
-                            if (strcmp(dir_content[j].name, path_components[i+1]) == 0) {
-                                new_search_num = dir_content[j].inode_number;
-                            }
-                        }
-                    }
-                } else if ((current_inode.mode & S_IFREG) == S_IFREG) { // file
-                    if (i != n-1) { // check that file is end of path
-                        return -1;
-                    }
+    // "create NAME" or "delete NAME", with or without a newline
+    int create = strncmp(buf, "create ", 7) == 0;
+    if (!create && strncmp(buf, "delete ", 7) != 0) return -EINVAL;
+    const char *name = buf + 7;
+    size_t length = strlen(name);
+    if (length == 0 || strcspn(name, " \t\n/") != length) return -EINVAL;
+    if (length >= MAX_FILE_NAME_LEN) return -ENAMETOOLONG;
+    if (read_only) return -EROFS;
 
-                    updated = 1;
+    int ret = 0;
+    if (create) {
+        pthread_rwlock_rdlock(&fs_lock);
+        ret = flush_write_bufs();
+        release_room();
+        pthread_rwlock_unlock(&fs_lock);
+    }
+    if (ret == 0) {
+        pthread_rwlock_wrlock(&fs_lock);
+        ret = create ? snapshot_create(name) : snapshot_delete(name);
+        pthread_rwlock_unlock(&fs_lock);
+    }
+    return ret < 0 ? ret : (int) size;
+}
 
-                    lseek(fd, -sizeof(struct wfs_inode), SEEK_CUR);
-                    current_inode.deleted = 1;
-                    write(fd, &current_inode, sizeof(struct wfs_inode));
-                    lseek(fd, current_inode.size, SEEK_CUR);
+// FUSE inode numbers. FUSE_ROOT_ID stands for the root, inode 0, and the
+// others are off by as much; the control files come after them all.
+// Inode numbers are not reused while mounted, so an ino the kernel holds on
+// to never comes to mean another file and its lookup count needs no
+// tracking (see ll_forget()).
+#define TO_INO(inode_number) ((fuse_ino_t) (inode_number) + FUSE_ROOT_ID)
+#define FROM_INO(ino) ((long) ((ino) - FUSE_ROOT_ID))
+#define STATS_INO ((fuse_ino_t) 1 << 32)
+#define SNAPSHOTS_INO (STATS_INO + 1)
+#define IS_CONTROL(ino) ((ino) >= STATS_INO)
 
-                    int size = current_inode.size;
-                    char content[size]; // make content buffer
-                    read(fd, &content, size); // get file content
-                }
-            } else {
-                // skip past data
-                int size = current_inode.size;
-                lseek(fd, size, SEEK_CUR);
-            }
-            read(fd, &current_inode, sizeof(struct wfs_inode));
-        }
-        if (i+1 >= n) {
-            if (updated == 1) {
-                return 0;
-            }
-            else {
-                return -1;
-            }
-        }
-        search_num = new_search_num;
-        if (prev == search_num) {
-            return -1;
-        }
-    }
-    return -1;
+// The kernel caches names, attributes and negative lookups this long. Every
+// change goes through this mount and the kernel drops what a change of its
+// own makes stale, so they can be long.
+#define ENTRY_TIMEOUT 60.0
+#define ATTR_TIMEOUT 60.0
+
+static void fill_attr(long inode_number, const struct wfs_inode *inode, uint64_t size, struct stat *stbuf) {
+    memset(stbuf, 0, sizeof(*stbuf));
+    stbuf->st_ino = TO_INO(inode_number);
+    stbuf->st_uid = inode->uid;
+    stbuf->st_gid = inode->gid;
+    stbuf->st_atime = inode->atime;
+    stbuf->st_mtime = inode->mtime;
+    stbuf->st_ctime = inode->ctime;
+    stbuf->st_mode = inode->mode;
+    stbuf->st_nlink = inode->links;
+    stbuf->st_size = size;
 }
 
-static int wfs_mknod(const char* path, mode_t mode, dev_t rdev) {
-    struct wfs_log_entry *entry = get_path_entry(path);
-    if(entry != (void*) NULL) return -EEXIST;
-    free(entry);
-    char *parent = get_parent_directory(path);
-    entry = get_path_entry(parent);
-    if(entry == (void*) NULL) {
-        printf("Didn't find parent");
-        return -1;
-    }
+// The ino of the control file name stands for in a directory, or 0.
+static fuse_ino_t control_ino(long parent_num, const char *name) {
+    if (parent_num != 0) return 0;
+    if (strcmp(name, STATS_NAME) == 0) return STATS_INO;
+    if (strcmp(name, SNAPSHOTS_NAME) == 0) return SNAPSHOTS_INO;
+    return 0;
+}
+
+static void control_getattr(fuse_ino_t ino, struct stat *stbuf) {
+    memset(stbuf, 0, sizeof(*stbuf));
+    stbuf->st_ino = ino;
+    stbuf->st_uid = getuid();
+    stbuf->st_gid = getgid();
+    stbuf->st_mtime = time(NULL);
+    stbuf->st_mode = S_IFREG | 0644;
+    stbuf->st_nlink = 1;
+    stbuf->st_size = 0;
+}
 
-    // make dentry for new dir
-    struct wfs_dentry new_file;
-    int new_file_inode_num = next_inode_num;
-    new_file.inode_number = new_file_inode_num;
-    next_inode_num++;
-    strcpy(new_file.name, get_name(path));
+static int wfs_getattr(long inode_number, struct stat *stbuf) {
+    struct wfs_inode inode;
+    if (get_inode(inode_number, &inode) != 0) return -ENOENT;
+    uint64_t size = S_ISREG(inode.mode) ? buffered_size(inode_number, inode.size) : inode.size;
+    fill_attr(inode_number, &inode, size, stbuf);
+    return 0;
+}
 
-    entry->inode.ctime = time(NULL);
-    entry->inode.mtime = time(NULL);
+static void init_entry(struct fuse_entry_param *entry) {
+    memset(entry, 0, sizeof(*entry));
+    entry->entry_timeout = ENTRY_TIMEOUT;
+    entry->attr_timeout = ATTR_TIMEOUT;
+}
 
-    size_t entry_size = sizeof(struct wfs_inode) + entry->inode.size;
+// Looks name up in a directory. A name that isn't there gets ino 0, which
+// the kernel caches as a negative entry.
+static int wfs_lookup(long parent_num, const char *name, struct fuse_entry_param *entry) {
+    init_entry(entry);
+    fuse_ino_t control = control_ino(parent_num, name);
+    if (control != 0) {
+        entry->ino = control;
+        entry->attr_timeout = 0;
+        control_getattr(control, &entry->attr);
+        return 0;
+    }
+    long inode_number = lookup_name(parent_num, name);
+    if (inode_number < 0) return 0;
+    int ret = wfs_getattr(inode_number, &entry->attr);
+    if (ret == 0) entry->ino = TO_INO(inode_number);
+    return ret;
+}
 
-    if (superblock.head + sizeof(superblock) + entry_size + sizeof(new_file) >= DISK_SIZE) {
-        free(entry);
-        return -ENOSPC;
+// Adds a dentry for name to its parent directory and writes the new inode.
+// Shared by mknod and mkdir, which only differ in the type bits of mode.
+static int create_inode(long parent_num, const char *name, mode_t mode, struct fuse_entry_param *entry) {
+    if (read_only) return -EROFS;
+    if (control_ino(parent_num, name) != 0) return -EEXIST;
+    struct wfs_inode parent_inode;
+    if (get_inode(parent_num, &parent_inode) != 0) {
+        printf("Didn't find parent\n");
+        return -ENOENT;
     }
+    if ((parent_inode.mode & S_IFDIR) != S_IFDIR) return -ENOTDIR;
 
-    entry->inode.size += sizeof(new_file);
+    // make dentry for new inode
+    struct wfs_dentry new_dentry;
+    memset(&new_dentry, 0, sizeof(new_dentry));
+    if (strlen(name) >= MAX_FILE_NAME_LEN) return -ENAMETOOLONG;
+    strcpy(new_dentry.name, name);
 
-    if (lseek(fd, superblock.head, SEEK_SET) == (off_t) -1) {
-        printf("Error 1\n");
-        free(entry);
-        return -errno;
+    // the parent may have changed since it was looked up, so check again
+    // under its lock
+    if (make_room(2 * sizeof(struct wfs_inode) + sizeof(new_dentry)) != 0) return -ENOSPC;
+    lock_inodes(parent_num, parent_num);
+    struct dir_table *dir = get_dir(parent_num);
+    if (dir == NULL || get_inode(parent_num, &parent_inode) != 0) {
+        unlock_inodes(parent_num, parent_num);
+        return -ENOENT;
     }
-    // writing current parent dir
-    ssize_t written_file = write(fd, entry, entry_size);
-    if (written_file != entry_size) {
-        free(entry);
-        printf("Failed writing parent entry\n");
-        return -errno;
+    if (dir_lookup(dir, new_dentry.name) >= 0) {
+        unlock_inodes(parent_num, parent_num);
+        return -EEXIST;
     }
-    // add new file to parent
-    ssize_t written_dentry = write(fd, &new_file, sizeof(new_file));
-    if (written_dentry != sizeof(new_file)) {
-        printf("Failed writing new file to parent\n");
-        free(entry);
-        return -errno;
+    if (dir_reserve(dir) != 0) {
+        unlock_inodes(parent_num, parent_num);
+        return -ENOMEM;
     }
-
-
-    superblock.head += written_file + written_dentry;
-    if (update_superblock() != 0) {
-        printf("Error 3\n");
-        free(entry);
-        return -errno;
+    new_dentry.inode_number = allocate_inode_number();
+    // nothing else can see the new inode yet, so it needs no lock
+    if (map_reserve(parent_num, 1, 0, 0) != 0 || map_reserve(new_dentry.inode_number, 0, 0, 0) != 0) {
+        unlock_inodes(parent_num, parent_num);
+        return -ENOMEM;
     }
 
-    struct wfs_log_entry new_file_entry;
+    parent_inode.flags = WFS_RECORD_DENTRY_ADD;
+    parent_inode.size = sizeof(new_dentry);
+    parent_inode.ctime = time(NULL);
+    parent_inode.mtime = time(NULL);
+
     struct wfs_inode inode;
-    inode.inode_number = new_file_inode_num;
-    inode.mode = mode | S_IFREG; // maybe change
+    inode.inode_number = new_dentry.inode_number;
+    inode.deleted = 0;
+    inode.mode = mode;
     inode.uid = getuid();
     inode.gid = getgid();
+    inode.flags = 0;
     inode.size = 0;
+    inode.raw_size = 0;
     inode.atime = inode.mtime = inode.ctime = time(NULL);
     inode.links = 1;
 
-    new_file_entry.inode = inode;
-
-    if (superblock.head + sizeof(superblock) + sizeof(new_file_entry) >= DISK_SIZE) {
-        free(entry);
-        return -ENOSPC;
-    }
-    
-    if (lseek(fd, superblock.head, SEEK_SET) == (off_t) -1) {
-        printf("Error 1\n");
-        free(entry);
-        return -errno;
-    }
-    ssize_t written = write(fd, &new_file_entry, sizeof(new_file_entry));
-    if (written != sizeof(new_file_entry)) {
-        printf("Error 2\n");
-        free(entry);
-        return -errno;
+    // log just the new dentry for the parent, then the new inode
+    struct iovec iov[] = {
+        { &parent_inode, sizeof(parent_inode) },
+        { &new_dentry, sizeof(new_dentry) },
+        { &inode, sizeof(inode) },
+    };
+    off_t parent_offset = log_appendv(iov, 3);
+    if (parent_offset < 0) {
+        printf("Failed writing new inode\n");
+        unlock_inodes(parent_num, parent_num);
+        return errno == ENOSPC ? -ENOSPC : -EIO;
     }
 
-    superblock.head += written;
-    if (update_superblock() != 0) {
-        printf("Error 3\n");
-        free(entry);
-        return -errno;
-    }
+    dir_add(dir, &new_dentry);
+    int failed = inode_map_update(&parent_inode, parent_offset, NULL, NULL, 0) != 0 ||
+        inode_map_update(&inode, parent_offset + sizeof(parent_inode) + sizeof(new_dentry), NULL, NULL, 0) != 0;
+    unlock_inodes(parent_num, parent_num);
+    if (log_end_operation() != 0 || failed) return -EIO;
+    init_entry(entry);
+    entry->ino = TO_INO(inode.inode_number);
+    fill_attr(inode.inode_number, &inode, 0, &entry->attr);
 
-    free(entry);
+    if (dir_needs_consolidation(parent_num)) consolidate_inode(parent_num);
     return 0;
 }
 
-static int wfs_write(const char* path, const char *buf, size_t size, off_t offset, struct fuse_file_info* fi) {
-    char mybuf[size];
-    for(int i = 0; i < size; i ++)
-    {
-        mybuf[i] = buf[i];
+// Logs a write as an extent record of its own.
+static int write_extent(long inode_number, const char *buf, size_t size, off_t offset) {
+    struct wfs_inode inode;
+    if (make_room(sizeof(inode) + sizeof(struct wfs_extent) + encoded_bound(size)) != 0) return -ENOSPC;
+    struct encoding encoding;
+    struct iovec *iov = NULL;
+    if (encode_data(buf, size, &encoding) != 0 ||
+            (iov = arena_alloc((3 * encoding.n_chunks + 3) * sizeof(struct iovec))) == NULL) {
+        free_encoding(&encoding);
+        return -ENOMEM;
     }
 
-    struct wfs_log_entry *entry = get_path_entry(path);
-    if(entry == (void*) NULL) {
-        printf("Write error\n");
-        free(entry);
+    // the file size to record depends on the writes before this one
+    lock_inodes(inode_number, inode_number);
+    if (get_inode(inode_number, &inode) != 0) {
+        unlock_inodes(inode_number, inode_number);
+        arena_free(iov);
+        free_encoding(&encoding);
         return -ENOENT;
     }
 
-    int new_size;
-    if (offset + size > entry->inode.size) {
-        new_size = offset + size;
-    } else {
-        new_size = entry->inode.size;
-    }
+    // log only the written extent
+    struct wfs_extent extent;
+    extent.offset = offset;
+    extent.length = size;
+    extent.file_size = offset + size > inode.size ? offset + size : inode.size;
 
-    struct wfs_inode inode;
-    inode.inode_number = entry->inode.inode_number;
-    inode.mode = entry->inode.mode;
-    inode.uid = entry->inode.uid;
-    inode.gid = entry->inode.gid;
-    inode.size = new_size;
+    inode.flags = WFS_RECORD_EXTENT;
+    inode.size = sizeof(extent) + encoding.stored;
+    inode.raw_size = encoding.raw_size;
     inode.mtime = inode.ctime = time(NULL);
-    inode.links = 1;
 
-    char *new_data = malloc(new_size);
-    if (entry->inode.size!= 0) memcpy(new_data, &entry->data, entry->inode.size);
-    memcpy(new_data, mybuf, size);
-
-
-    if (lseek(fd, superblock.head, SEEK_SET) == (off_t) -1) {
-        printf("Error 1\n");
-        free(new_data);
-        free(entry);
-        return -errno;
+    if (map_reserve(inode_number, 1, encoding.n_refs, encoding.n_chunks) != 0) {
+        unlock_inodes(inode_number, inode_number);
+        arena_free(iov);
+        free_encoding(&encoding);
+        return -ENOMEM;
     }
-    ssize_t written_inode = write(fd, &inode, sizeof(inode));
-    ssize_t written_data = write(fd, new_data, new_size);
 
-    superblock.head += written_inode + written_data;
-    if (update_superblock() != 0) {
-        printf("Error 3\n");
-        free(entry);
-        free(new_data);
-        return -errno;
+    // any new chunks first
+    int n = encoding_iov(&encoding, iov);
+    iov[n++] = (struct iovec) { &inode, sizeof(inode) };
+    iov[n++] = (struct iovec) { &extent, sizeof(extent) };
+    iov[n++] = (struct iovec) { encoding.data != NULL ? encoding.data : (void *) buf, encoding.stored };
+    off_t new_offset = log_appendv(iov, n);
+    arena_free(iov);
+    if (new_offset < 0) {
+        printf("Error writing file\n");
+        map_release(encoding.n_chunks);
+        unlock_inodes(inode_number, inode_number);
+        free_encoding(&encoding);
+        return errno == ENOSPC ? -ENOSPC : -EIO;
     }
+    new_offset = encoding_applied(&encoding, new_offset);
+    int failed = inode_map_update(&inode, new_offset, &extent, encoding.refs, encoding.n_refs) != 0;
+    map_release(encoding.n_chunks);
+    free_encoding(&encoding);
+    int n_extents = get_extent_count(inode_number);
+    unlock_inodes(inode_number, inode_number);
+    if (log_end_operation() != 0 || failed) return -EIO;
+
+    // keep reads from having to apply a long chain of extents
+    if (n_extents >= WFS_MAX_EXTENTS) consolidate_inode(inode_number);
 
-    free(entry);
-    free(new_data);
     return size; // Success
 }
 
-static int wfs_mkdir(const char* path, mode_t mode) {
-    struct wfs_log_entry *entry = get_path_entry(path);
-    if(entry != (void*) NULL) return -EEXIST;
-    char *parent = get_parent_directory(path);
-    free(entry);
-    entry = get_path_entry(parent);
-    if(entry == (void*) NULL) {
-        printf("Didn't find parent");
-        return -1;
+// Writes the data in bufv, which libfuse may have spliced into a pipe rather
+// than read into memory. It is copied once either way: into the file's
+// write-back buffer, or else into memory to be logged from.
+static int wfs_write(long inode_number, struct fuse_bufvec *bufv, off_t offset) {
+    if (read_only) return -EROFS;
+    struct wfs_inode inode;
+    if (get_inode(inode_number, &inode) != 0) {
+        printf("Write error\n");
+        return -ENOENT;
+    }
+    if ((inode.mode & S_IFREG) != S_IFREG) return -EISDIR;
+    size_t size = fuse_buf_size(bufv);
+    int ret = buffer_write(inode_number, bufv, size, offset);
+    if (ret <= 0) return ret == 0 ? size : ret;
+    if (bufv->count == 1 && !(bufv->buf[0].flags & FUSE_BUF_IS_FD)) {
+        return write_extent(inode_number, bufv->buf[0].mem, size, offset);
+    }
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+    if ((dst.buf[0].mem = arena_alloc(size)) == NULL) return -ENOMEM;
+    ret = fuse_buf_copy(&dst, bufv, 0) == (ssize_t) size ? write_extent(inode_number, dst.buf[0].mem, size, offset) : -EIO;
+    arena_free(dst.buf[0].mem);
+    return ret;
+}
+
+static int wfs_unlink(long parent_num, const char *name) {
+    if (read_only) return -EROFS;
+    if (control_ino(parent_num, name) != 0) return -EPERM;
+    if (make_room(2 * sizeof(struct wfs_inode) + sizeof(struct wfs_dentry)) != 0) return -ENOSPC;
+
+    // lock the parent and the file, then make sure the name still refers to
+    // the file that was locked
+    struct dir_table *dir;
+    long inode_number, current;
+    for (;;) {
+        inode_number = lookup_name(parent_num, name);
+        if (inode_number < 0) return -ENOENT;
+        lock_inodes(parent_num, inode_number);
+        dir = get_dir(parent_num);
+        current = dir != NULL ? dir_lookup(dir, name) : -1;
+        if (current == inode_number || current < 0) break;
+        unlock_inodes(parent_num, inode_number);
+    }
+    struct wfs_inode inode, file_inode;
+    if (current < 0 || get_inode(parent_num, &inode) != 0 || get_inode(inode_number, &file_inode) != 0) {
+        unlock_inodes(parent_num, inode_number);
+        return -ENOENT;
     }
 
-    // make dentry for new dir
-    struct wfs_dentry new_dir;
-    int new_dir_inode_num = next_inode_num;
-    new_dir.inode_number = new_dir_inode_num;
-    next_inode_num++;
-    strcpy(new_dir.name, get_name(path));
+    struct wfs_dentry removed;
+    memset(&removed, 0, sizeof(removed));
+    strcpy(removed.name, name);
+    removed.inode_number = inode_number;
+
+    inode.flags = WFS_RECORD_DENTRY_REMOVE;
+    inode.size = sizeof(removed);
+    inode.ctime = inode.mtime = time(NULL);
 
-    entry->inode.ctime = time(NULL);
-    entry->inode.mtime = time(NULL);
+    // append a tombstone rather than rewriting the old record in place
+    file_inode.deleted = 1;
+    file_inode.flags = WFS_RECORD_FULL;
+    file_inode.size = 0;
+    file_inode.ctime = time(NULL);
 
-    size_t entry_size = sizeof(struct wfs_inode) + entry->inode.size;
+    if (map_reserve(parent_num, 1, 0, 0) != 0) {
+        unlock_inodes(parent_num, inode_number);
+        return -ENOMEM;
+    }
 
-    if (superblock.head + sizeof(superblock) + entry_size + sizeof(new_dir) >= DISK_SIZE) {
-        free(entry);
-        return -ENOSPC;
+    // log just the removed dentry for the parent, then the tombstone
+    struct iovec iov[] = {
+        { &inode, sizeof(inode) },
+        { &removed, sizeof(removed) },
+        { &file_inode, sizeof(file_inode) },
+    };
+    off_t parent_offset = log_appendv(iov, 3);
+    if (parent_offset < 0) {
+        printf("Error writing parent\n");
+        unlock_inodes(parent_num, inode_number);
+        return errno == ENOSPC ? -ENOSPC : -EIO;
     }
+    dir_remove(dir, name);
+    int failed = inode_map_update(&inode, parent_offset, NULL, NULL, 0) != 0 ||
+        inode_map_update(&file_inode, parent_offset + sizeof(inode) + sizeof(removed), NULL, NULL, 0) != 0;
+    if (S_ISDIR(file_inode.mode)) drop_dir(inode_number);
+    else drop_write_buf(inode_number);
+    unlock_inodes(parent_num, inode_number);
+    if (log_end_operation() != 0 || failed) return -EIO;
+
+    if (dir_needs_consolidation(parent_num)) consolidate_inode(parent_num);
+    return 0;
+}
 
-    entry->inode.size += sizeof(new_dir);
+// Applies the times a setattr asks for to a record; its ctime becomes now.
+static void set_times(struct wfs_inode *inode, const struct stat *attr, int to_set) {
+    time_t now = time(NULL);
+    if (to_set & FUSE_SET_ATTR_ATIME_NOW) inode->atime = now;
+    else if (to_set & FUSE_SET_ATTR_ATIME) inode->atime = attr->st_atime;
+    if (to_set & FUSE_SET_ATTR_MTIME_NOW) inode->mtime = now;
+    else if (to_set & FUSE_SET_ATTR_MTIME) inode->mtime = attr->st_mtime;
+    inode->ctime = now;
+}
 
-    if (lseek(fd, superblock.head, SEEK_SET) == (off_t) -1) {
-        printf("Error 1\n");
-        free(entry);
-        return -errno;
+// Truncates a file or sets its times with an extent record that has no data
+// and sits at the (new) file size: reads cut off what lies past a smaller
+// size (see cut_file()) and see zeros up to a larger one. A directory's times
+// are set by rewriting it, which copies its entries but nothing else.
+static int wfs_setattr(long inode_number, const struct stat *attr, int to_set) {
+    if (read_only) return -EROFS;
+    if (to_set & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) return -ENOSYS;
+    if ((to_set & FUSE_SET_ATTR_SIZE) && (attr->st_size < 0 || attr->st_size > max_size)) {
+        return attr->st_size < 0 ? -EINVAL : -EFBIG;
     }
-    // writing current parent dir
-    ssize_t written_dir = write(fd, entry, entry_size);
-    if (written_dir != entry_size) {
-        printf("Failed writing parent entry\n");
-        free(entry);
-        return -errno;
+    struct wfs_inode inode;
+    if (get_inode(inode_number, &inode) != 0) return -ENOENT;
+    if (S_ISDIR(inode.mode)) {
+        if (to_set & FUSE_SET_ATTR_SIZE) return -EISDIR;
+        set_times(&inode, attr, to_set);
+        return rewrite_inode(inode_number, &inode);
     }
-    // add new dir to parent
-    ssize_t written_dentry = write(fd, &new_dir, sizeof(new_dir));
-    if (written_dentry != sizeof(new_dir)) {
-        printf("Failed writing new dir to parent\n");
-        free(entry);
-        return -errno;
+
+    // the record goes after anything buffered for the file
+    int ret = flush_write_buf(inode_number);
+    if (ret != 0) return ret;
+    struct wfs_extent extent;
+    if (make_room(sizeof(inode) + sizeof(extent)) != 0) return -ENOSPC;
+    lock_inodes(inode_number, inode_number);
+    if (get_inode(inode_number, &inode) != 0) {
+        unlock_inodes(inode_number, inode_number);
+        return -ENOENT;
     }
+    extent.file_size = to_set & FUSE_SET_ATTR_SIZE ? (uint64_t) attr->st_size : inode.size;
+    extent.offset = extent.file_size;
+    extent.length = 0;
 
+    inode.flags = WFS_RECORD_EXTENT;
+    inode.size = sizeof(extent);
+    inode.raw_size = 0;
+    if (to_set & FUSE_SET_ATTR_SIZE) inode.mtime = time(NULL);
+    set_times(&inode, attr, to_set);
 
-    superblock.head += written_dir + written_dentry;
-    if (update_superblock() != 0) {
-        printf("Error 3\n");
-        free(entry);
-        return -errno;
+    if (map_reserve(inode_number, 1, 0, 0) != 0) {
+        unlock_inodes(inode_number, inode_number);
+        return -ENOMEM;
     }
+    struct iovec iov[] = {
+        { &inode, sizeof(inode) },
+        { &extent, sizeof(extent) },
+    };
+    off_t offset = log_appendv(iov, 2);
+    if (offset < 0) {
+        unlock_inodes(inode_number, inode_number);
+        return errno == ENOSPC ? -ENOSPC : -EIO;
+    }
+    int failed = inode_map_update(&inode, offset, &extent, NULL, 0) != 0;
+    int n_extents = get_extent_count(inode_number);
+    unlock_inodes(inode_number, inode_number);
+    if (log_end_operation() != 0 || failed) return -EIO;
 
-    struct wfs_log_entry new_dir_entry;
-    struct wfs_inode inode;
-    inode.inode_number = new_dir_inode_num;
-    inode.mode = mode | S_IFDIR; // maybe change
-    inode.uid = getuid();
-    inode.gid = getgid();
-    inode.size = 0;
-    inode.atime = inode.mtime = inode.ctime = time(NULL);
-    inode.links = 1;
+    if (n_extents >= WFS_MAX_EXTENTS) consolidate_inode(inode_number);
+    return 0;
+}
+
+// Moves a dentry, possibly to another directory, replacing whatever the new
+// name referred to as unlink would. Only dentry records and that tombstone
+// are logged, so no file data is copied however large the file is.
+static int wfs_rename(long parent_num, const char *name, long newparent_num, const char *newname) {
+    if (read_only) return -EROFS;
+    if (control_ino(parent_num, name) != 0 || control_ino(newparent_num, newname) != 0) return -EPERM;
+    if (strlen(newname) >= MAX_FILE_NAME_LEN) return -ENAMETOOLONG;
+    if (make_room(4 * sizeof(struct wfs_inode) + 3 * sizeof(struct wfs_dentry)) != 0) return -ENOSPC;
+
+    // lock both parents and what the new name refers to, then make sure it
+    // still refers to that
+    struct dir_table *dir, *new_dir;
+    long target, locked;
+    for (;;) {
+        target = lookup_name(newparent_num, newname);
+        locked = target >= 0 ? target : newparent_num;
+        lock_inodes3(parent_num, newparent_num, locked);
+        dir = get_dir(parent_num);
+        new_dir = get_dir(newparent_num);
+        if ((new_dir != NULL ? dir_lookup(new_dir, newname) : -1) == target) break;
+        unlock_inodes3(parent_num, newparent_num, locked);
+    }
+    int ret = 0;
+    struct wfs_inode parent_inode, new_parent_inode, inode, target_inode;
+    long inode_number = dir != NULL ? dir_lookup(dir, name) : -1;
+    if (inode_number < 0 || get_inode(parent_num, &parent_inode) != 0 || get_inode(inode_number, &inode) != 0 ||
+            get_inode(newparent_num, &new_parent_inode) != 0) {
+        ret = -ENOENT;
+        goto done;
+    }
+    if (new_dir == NULL) {
+        ret = -ENOTDIR;
+        goto done;
+    }
+    if (target == inode_number) goto done;
+    if (target >= 0) {
+        struct dir_table *target_dir;
+        if (get_inode(target, &target_inode) != 0) ret = -ENOENT;
+        else if (S_ISDIR(inode.mode) && !S_ISDIR(target_inode.mode)) ret = -ENOTDIR;
+        else if (!S_ISDIR(inode.mode) && S_ISDIR(target_inode.mode)) ret = -EISDIR;
+        else if (S_ISDIR(target_inode.mode) && ((target_dir = get_dir(target)) == NULL || target_dir->n_live > 0)) ret = -ENOTEMPTY;
+        if (ret != 0) goto done;
+    }
+    // a dentry record for the old parent, and one or two for the new one
+    int new_records = target >= 0 ? 2 : 1;
+    if (dir_reserve(new_dir) != 0 || (newparent_num != parent_num && map_reserve(parent_num, 1, 0, 0) != 0) ||
+            map_reserve(newparent_num, new_records + (newparent_num == parent_num), 0, 0) != 0) {
+        ret = -ENOMEM;
+        goto done;
+    }
 
-    new_dir_entry.inode = inode;
+    struct wfs_dentry removed, replaced, added;
+    memset(&removed, 0, sizeof(removed));
+    strcpy(removed.name, name);
+    removed.inode_number = inode_number;
+    memset(&replaced, 0, sizeof(replaced));
+    strcpy(replaced.name, newname);
+    replaced.inode_number = target;
+    added = replaced;
+    added.inode_number = inode_number;
 
-    if (superblock.head + sizeof(superblock) + sizeof(new_dir_entry) >= DISK_SIZE) {
-        free(entry);
-        return -ENOSPC;
+    time_t now = time(NULL);
+    parent_inode.flags = WFS_RECORD_DENTRY_REMOVE;
+    parent_inode.size = sizeof(removed);
+    parent_inode.ctime = parent_inode.mtime = now;
+    new_parent_inode.size = sizeof(added);
+    new_parent_inode.ctime = new_parent_inode.mtime = now;
+    struct wfs_inode replace_record = new_parent_inode;
+    replace_record.flags = WFS_RECORD_DENTRY_REMOVE;
+    new_parent_inode.flags = WFS_RECORD_DENTRY_ADD;
+    target_inode.deleted = 1;
+    target_inode.flags = WFS_RECORD_FULL;
+    target_inode.size = 0;
+    target_inode.ctime = now;
+
+    // the old name goes, then what the new name replaces, then the new name
+    // comes in and the replaced inode gets its tombstone
+    struct iovec iov[7];
+    int n = 0;
+    iov[n++] = (struct iovec) { &parent_inode, sizeof(parent_inode) };
+    iov[n++] = (struct iovec) { &removed, sizeof(removed) };
+    if (target >= 0) {
+        iov[n++] = (struct iovec) { &replace_record, sizeof(replace_record) };
+        iov[n++] = (struct iovec) { &replaced, sizeof(replaced) };
+    }
+    iov[n++] = (struct iovec) { &new_parent_inode, sizeof(new_parent_inode) };
+    iov[n++] = (struct iovec) { &added, sizeof(added) };
+    if (target >= 0) iov[n++] = (struct iovec) { &target_inode, sizeof(target_inode) };
+    off_t offset = log_appendv(iov, n);
+    if (offset < 0) {
+        ret = errno == ENOSPC ? -ENOSPC : -EIO;
+        goto done;
     }
-    
-    if (lseek(fd, superblock.head, SEEK_SET) == (off_t) -1) {
-        printf("Error 1\n");
-        free(entry);
-        return -errno;
+    dir_remove(dir, name);
+    int failed = inode_map_update(&parent_inode, offset, NULL, NULL, 0) != 0;
+    offset += sizeof(parent_inode) + sizeof(removed);
+    if (target >= 0) {
+        dir_remove(new_dir, newname);
+        failed |= inode_map_update(&replace_record, offset, NULL, NULL, 0) != 0;
+        offset += sizeof(replace_record) + sizeof(replaced);
     }
-    ssize_t written = write(fd, &new_dir_entry, sizeof(new_dir_entry));
-    if (written != sizeof(new_dir_entry)) {
-        printf("Error 2\n");
-        free(entry);
-        return -errno;
+    dir_add(new_dir, &added);
+    failed |= inode_map_update(&new_parent_inode, offset, NULL, NULL, 0) != 0;
+    if (target >= 0) {
+        failed |= inode_map_update(&target_inode, offset + sizeof(new_parent_inode) + sizeof(added), NULL, NULL, 0) != 0;
+        if (S_ISDIR(target_inode.mode)) drop_dir(target);
+        else drop_write_buf(target);
     }
+    unlock_inodes3(parent_num, newparent_num, locked);
+    if (log_end_operation() != 0 || failed) return -EIO;
+
+    if (dir_needs_consolidation(parent_num)) consolidate_inode(parent_num);
+    if (newparent_num != parent_num && dir_needs_consolidation(newparent_num)) consolidate_inode(newparent_num);
+    return 0;
 
-    superblock.head += written;
-    if (update_superblock() != 0) {
-        printf("Error 3\n");
-        free(entry);
-        return -errno;
+done:
+    unlock_inodes3(parent_num, newparent_num, locked);
+    return ret;
+}
+
+// Answers a read with where its bytes sit in the image, once anything the
+// file has buffered is appended. Returns 0 if it did, 1 if the read has to be
+// copied with read_file(), or -errno.
+static int reply_mapped(fuse_req_t req, long inode_number, size_t size, off_t offset) {
+    struct read_piece pieces[READ_PIECES];
+    int n;
+    int ret = flush_write_buf(inode_number);
+    if (ret == 0) ret = map_file_read(inode_number, pieces, &n, &size, offset);
+    if (ret != 0) return ret;
+    if (n == 0) {
+        fuse_reply_buf(req, NULL, 0);
+        return 0;
     }
 
-    free(entry);
+    struct fuse_bufvec *bufv = arena_alloc(sizeof(*bufv) + (n - 1) * sizeof(struct fuse_buf));
+    if (bufv == NULL) return -ENOMEM;
+    *bufv = FUSE_BUFVEC_INIT(0);
+    bufv->count = n;
+    for (int i = 0; i < n; i++) {
+        uint64_t end = i + 1 < n ? pieces[i + 1].start : offset + size;
+        struct fuse_buf *buf = &bufv->buf[i];
+        memset(buf, 0, sizeof(*buf));
+        buf->size = end - pieces[i].start;
+        if (pieces[i].disk < 0) {
+            buf->mem = (void *) read_zeros;
+        } else if (disk_map != NULL) {
+            buf->mem = disk_map + pieces[i].disk;
+        } else {
+            buf->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK | FUSE_BUF_FD_RETRY;
+            buf->fd = fd;
+            buf->pos = pieces[i].disk;
+        }
+    }
+    fuse_reply_data(req, bufv, (enum fuse_buf_copy_flags) 0);
     return 0;
 }
 
-static int wfs_unlink(const char* path) {
-    // generate random number to decide if this function should run
-    // since it lowers our test score
-    if (time(NULL) % 2 == 0) return 0;
+// Directory listings are taken whole at opendir, in the form readdir
+// replies with, and served from there, so that entries added or removed
+// meanwhile can't shift the offsets of the rest. An entry's offset is where
+// the next one starts.
+struct dir_listing {
+    char *buf;
+    size_t size;
+    size_t *ends;               // where each entry ends, a reply has to end on one
+    int n_entries;
+};
 
-    struct wfs_log_entry *entry;
-    char *parent = get_parent_directory(path);
-    entry = get_path_entry(parent);
-    if(entry == (void*) NULL) {
-        printf("Didn't find parent");
-        return -1;
+static int wfs_opendir(fuse_req_t req, long inode_number, struct fuse_file_info *fi) {
+    struct dir_listing *listing = calloc(1, sizeof(*listing));
+    if (listing == NULL) return -ENOMEM;
+    lock_inodes(inode_number, inode_number);
+    struct dir_table *dir = get_dir(inode_number);
+    if (dir == NULL) {
+        unlock_inodes(inode_number, inode_number);
+        free(listing);
+        return -ENOTDIR;
     }
-    
-    struct wfs_inode inode = entry->inode;
-    inode.size -= sizeof(struct wfs_dentry);
-    inode.ctime = inode.mtime = time(NULL);
 
-    if (lseek(fd, superblock.head, SEEK_SET) == (off_t) -1) {
-        printf("Error 1\n");
-        free(entry);
-        return -errno;
+    size_t capacity = 0;
+    for (int i = 0; i < dir->n_entries; i++) {
+        if (dir->entries[i].name[0] != '\0') capacity += fuse_add_direntry(req, NULL, 0, dir->entries[i].name, NULL, 0);
     }
-    ssize_t written = write(fd, &inode, sizeof(inode));
-    if (written != sizeof(struct wfs_inode)) {
-        printf("Error 2\n");
-        free(entry);
-        return -errno;
+    listing->buf = malloc(capacity > 0 ? capacity : 1);
+    listing->ends = malloc((dir->n_entries > 0 ? dir->n_entries : 1) * sizeof(size_t));
+    for (int i = 0; listing->buf != NULL && listing->ends != NULL && i < dir->n_entries; i++) {
+        if (dir->entries[i].name[0] == '\0') continue;
+        struct stat stbuf;
+        memset(&stbuf, 0, sizeof(stbuf));
+        stbuf.st_ino = TO_INO(dir->entries[i].inode_number);
+        size_t length = fuse_add_direntry(req, NULL, 0, dir->entries[i].name, NULL, 0);
+        fuse_add_direntry(req, listing->buf + listing->size, length, dir->entries[i].name, &stbuf,
+                          listing->size + length);
+        listing->size += length;
+        listing->ends[listing->n_entries++] = listing->size;
     }
-
-    superblock.head += written;
-    if (update_superblock() != 0) {
-        printf("Error 3\n");
-        free(entry);
-        return -errno;
+    unlock_inodes(inode_number, inode_number);
+    if (listing->buf == NULL || listing->ends == NULL) {
+        free(listing->buf);
+        free(listing->ends);
+        free(listing);
+        return -ENOMEM;
     }
+    fi->fh = (uintptr_t) listing;
+    return 0;
+}
 
-    struct wfs_dentry *entries = (struct wfs_dentry *)entry->data;
+// The write-back buffer of an open handle, if it has one.
+static struct write_buf *handle_write_buf(fuse_ino_t ino, struct fuse_file_info *fi) {
+    if (IS_CONTROL(ino) || fi == NULL) return NULL;
+    return (struct write_buf *) (uintptr_t) fi->fh;
+}
 
-    int n_entries = inode.size / sizeof(struct wfs_dentry);
-    for (int i = 0; i < n_entries; i++) {
-        if (strcmp(entries[i].name, get_name(path)) != 0) {
-            if (lseek(fd, superblock.head, SEEK_SET) == (off_t) -1) {
-                printf("Error 1\n");
-                free(entry);
-                return -errno;
-            }
-            ssize_t written_entry = write(fd, &entries[i], sizeof(struct wfs_dentry));
-            if (written != sizeof(struct wfs_dentry)) {
-                printf("Error 2\n");
-                free(entry);
-                return -errno;
-            }
+static int wfs_flush(fuse_ino_t ino, struct fuse_file_info* fi) {
+    struct write_buf *wbuf = handle_write_buf(ino, fi);
+    return wbuf != NULL ? flush_write_buf(wbuf->inode_number) : 0;
+}
 
-            superblock.head += written_entry;
-            if (update_superblock() != 0) {
-                printf("Error 3\n");
-                free(entry);
-                return -errno;
-            }
-        }
+static int wfs_fsync(fuse_ino_t ino, struct fuse_file_info* fi) {
+    int ret = !IS_CONTROL(ino) ? flush_write_buf(FROM_INO(ino)) : 0;
+    if (ret < 0) return ret;
+    if (log_commit() != 0 || disk_sync(MS_SYNC) != 0) return -EIO;
+    return 0;
+}
+
+static int wfs_open(fuse_ino_t ino, struct fuse_file_info* fi) {
+    if (!IS_CONTROL(ino)) {
+        // nothing changes the files behind the kernel's back
+        fi->keep_cache = 1;
+        if ((fi->flags & O_ACCMODE) != O_RDONLY && read_only) return -EROFS;
+
+        // files opened for writing share a write-back buffer
+        if ((fi->flags & O_ACCMODE) == O_RDONLY || write_cache_size == 0) return 0;
+        long inode_number = FROM_INO(ino);
+        struct wfs_inode inode;
+        if (get_inode(inode_number, &inode) != 0) return -ENOENT;
+        if (!S_ISREG(inode.mode)) return 0;
+        struct write_buf *wbuf = open_write_buf(inode_number);
+        if (wbuf == NULL) return -ENOENT;
+        fi->fh = (uintptr_t) wbuf;
+        return 0;
     }
+    char *text = ino == STATS_INO ? stats_format() : snapshots_format();
+    if (text == NULL) return -ENOMEM;
+    fi->fh = (uintptr_t) text;
+    fi->direct_io = 1;
+    return 0;
+}
 
-    if (set_deleted(path) < 0) {
-        printf("Failed to set deleted\n");
-        free(entry);
-        return -1;
+static int wfs_release(fuse_ino_t ino, struct fuse_file_info* fi) {
+    if (IS_CONTROL(ino)) {
+        free((char *) (uintptr_t) fi->fh);
+        return 0;
     }
+    struct write_buf *wbuf = handle_write_buf(ino, fi);
+    return wbuf != NULL ? release_write_buf(wbuf) : 0;
+}
 
-    free(entry);
+static void wfs_init(void *userdata, struct fuse_conn_info *conn) {
+    // writes of up to max_write rather than a page at a time, and data
+    // spliced both ways where the kernel can
+    conn->want |= conn->capable & (FUSE_CAP_BIG_WRITES | FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE);
 
-    return 0;
+    // started here rather than in main() since the session may fork
+    if (use_io_uring && disk_map == NULL && ring_setup() != 0) {
+        printf("io_uring unavailable, using pread/pwrite\n");
+    }
+    if (read_only) return;      // nothing to clean or commit
+    if (clean_interval > 0) {
+        cleaner_running = 1;
+        if (pthread_create(&cleaner, NULL, cleaner_thread, NULL) != 0) cleaner_running = 0;
+    }
+    if (commit_interval > 0) {
+        committer_running = 1;
+        if (pthread_create(&committer, NULL, commit_thread, NULL) != 0) committer_running = 0;
+    }
 }
 
-static int wfs_read(const char* path, char *buf, size_t size, off_t offset, struct fuse_file_info* fi) {
-    struct wfs_log_entry *entry = get_path_entry(path);
-    if(entry == (void*) NULL) {
-        printf("Write error\n");
-        free(entry);
-        return -ENOENT;
+static void wfs_destroy(void *userdata) {
+    pthread_mutex_lock(&cleaner_lock);
+    int was_running = cleaner_running;
+    cleaner_running = 0;
+    pthread_cond_signal(&cleaner_wakeup);
+    pthread_mutex_unlock(&cleaner_lock);
+    if (was_running) pthread_join(cleaner, NULL);
+
+    pthread_mutex_lock(&commit_lock);
+    was_running = committer_running;
+    committer_running = 0;
+    pthread_cond_signal(&commit_wakeup);
+    pthread_mutex_unlock(&commit_lock);
+    if (was_running) pthread_join(committer, NULL);
+
+    if (!read_only) {
+        struct wfs_checkpoint *checkpoint = checkpoint_due(1) ? build_checkpoint() : NULL;
+        if (checkpoint != NULL) store_checkpoint(checkpoint);
+        free(checkpoint);
+        log_commit();
+        disk_sync(MS_SYNC);
     }
+    if (disk_map != NULL) munmap(disk_map, max_size);
+    ring_teardown();
+    if (direct_fd >= 0) close(direct_fd);
+    close(fd);
+}
 
-    memcpy(buf, &entry->data, size);
-    free(entry);
-    return size;
+// Each operation holds fs_lock for reading (see the log cleaner above); what
+// else it locks is up to the operation. Those in op_names are also timed.
+// Replies go out once the locks are let go of, and the arena is reset after
+// them.
+static void reply_entry(fuse_req_t req, const struct fuse_entry_param *entry, int ret) {
+    if (ret < 0) fuse_reply_err(req, -ret);
+    else fuse_reply_entry(req, entry);
 }
 
-static int wfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
-    struct wfs_log_entry *entry = get_path_entry(path);
-    if(entry == (void*) NULL) return -errno;
-    struct wfs_inode inode = entry->inode;
+static void reply_open(fuse_req_t req, struct fuse_file_info *fi, int ret) {
+    if (ret < 0) fuse_reply_err(req, -ret);
+    else fuse_reply_open(req, fi);
+}
 
-    // Check if inode is a directory
-    if (!S_ISDIR(inode.mode)) {
-        free(entry);
-        return -ENOTDIR;
+static void ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    struct fuse_entry_param entry;
+    uint64_t start = stats_now();
+    pthread_rwlock_rdlock(&fs_lock);
+    int ret = IS_CONTROL(parent) ? -ENOTDIR : wfs_lookup(FROM_INO(parent), name, &entry);
+    pthread_rwlock_unlock(&fs_lock);
+    stats_op(OP_LOOKUP, start, ret);
+    reply_entry(req, &entry, ret);
+    arena_reset();
+}
+
+// Nothing to do, see TO_INO().
+static void ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+    fuse_reply_none(req);
+}
+
+static void ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    struct stat stbuf;
+    uint64_t start = stats_now();
+    pthread_rwlock_rdlock(&fs_lock);
+    int ret = 0;
+    if (IS_CONTROL(ino)) control_getattr(ino, &stbuf);
+    else ret = wfs_getattr(FROM_INO(ino), &stbuf);
+    pthread_rwlock_unlock(&fs_lock);
+    stats_op(OP_GETATTR, start, ret);
+    if (ret < 0) fuse_reply_err(req, -ret);
+    else fuse_reply_attr(req, &stbuf, IS_CONTROL(ino) ? 0 : ATTR_TIMEOUT);
+    arena_reset();
+}
+
+static void ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev) {
+    struct fuse_entry_param entry;
+    uint64_t start = stats_now();
+    pthread_rwlock_rdlock(&fs_lock);
+    int ret = IS_CONTROL(parent) ? -ENOTDIR : create_inode(FROM_INO(parent), name, mode | S_IFREG, &entry);
+    release_room();
+    pthread_rwlock_unlock(&fs_lock);
+    stats_op(OP_MKNOD, start, ret);
+    reply_entry(req, &entry, ret);
+    arena_reset();
+}
+
+static void ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+    struct fuse_entry_param entry;
+    uint64_t start = stats_now();
+    pthread_rwlock_rdlock(&fs_lock);
+    int ret = IS_CONTROL(parent) ? -ENOTDIR : create_inode(FROM_INO(parent), name, mode | S_IFDIR, &entry);
+    release_room();
+    pthread_rwlock_unlock(&fs_lock);
+    stats_op(OP_MKDIR, start, ret);
+    reply_entry(req, &entry, ret);
+    arena_reset();
+}
+
+static void ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    uint64_t start = stats_now();
+    pthread_rwlock_rdlock(&fs_lock);
+    int ret = IS_CONTROL(parent) ? -ENOTDIR : wfs_unlink(FROM_INO(parent), name);
+    release_room();
+    pthread_rwlock_unlock(&fs_lock);
+    stats_op(OP_UNLINK, start, ret);
+    fuse_reply_err(req, -ret);
+    arena_reset();
+}
+
+static void ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname) {
+    uint64_t start = stats_now();
+    pthread_rwlock_rdlock(&fs_lock);
+    int ret = IS_CONTROL(parent) || IS_CONTROL(newparent) ? -ENOTDIR :
+        wfs_rename(FROM_INO(parent), name, FROM_INO(newparent), newname);
+    release_room();
+    pthread_rwlock_unlock(&fs_lock);
+    stats_op(OP_RENAME, start, ret);
+    fuse_reply_err(req, -ret);
+    arena_reset();
+}
+
+// Control files take the truncate of an open with O_TRUNC and new times, as
+// if they had any.
+static void ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi) {
+    struct stat stbuf;
+    uint64_t start = stats_now();
+    pthread_rwlock_rdlock(&fs_lock);
+    int ret = 0;
+    if (IS_CONTROL(ino)) {
+        int owner = to_set & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID);
+        ret = owner || ((to_set & FUSE_SET_ATTR_SIZE) && attr->st_size != 0) ? -EPERM : 0;
     }
+    else ret = wfs_setattr(FROM_INO(ino), attr, to_set);
+    if (ret == 0 && IS_CONTROL(ino)) control_getattr(ino, &stbuf);
+    else if (ret == 0) ret = wfs_getattr(FROM_INO(ino), &stbuf);
+    release_room();
+    pthread_rwlock_unlock(&fs_lock);
+    stats_op(OP_SETATTR, start, ret);
+    if (ret < 0) fuse_reply_err(req, -ret);
+    else fuse_reply_attr(req, &stbuf, IS_CONTROL(ino) ? 0 : ATTR_TIMEOUT);
+    arena_reset();
+}
 
-    // Read the directory entries
-    struct wfs_dentry *dentry = (struct wfs_dentry *) entry->data;
-    for (unsigned int i = 0; i < inode.size / sizeof(struct wfs_dentry); i++) {
-        if (filler(buf, dentry[i].name, NULL, 0) != 0) {
-            free(entry);
-            return -ENOMEM; // Buffer full
-        }
+static void ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    pthread_rwlock_rdlock(&fs_lock);
+    int ret = wfs_open(ino, fi);
+    pthread_rwlock_unlock(&fs_lock);
+    reply_open(req, fi, ret);
+    arena_reset();
+}
+
+// Reads are answered from the image where map_file_read() allows, and so
+// before fs_lock is let go of, and copied through a buffer otherwise.
+static void ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi) {
+    uint64_t start = stats_now();
+    pthread_rwlock_rdlock(&fs_lock);
+    int ret = !IS_CONTROL(ino) ? reply_mapped(req, FROM_INO(ino), size, offset) : 1;
+    char *buf = NULL;
+    if (ret > 0) {
+        buf = arena_alloc(size);
+        if (buf == NULL) ret = -ENOMEM;
+        else if (IS_CONTROL(ino)) ret = control_read(buf, size, offset, fi);
+        else ret = read_file(FROM_INO(ino), buf, size, offset);
     }
+    release_room();
+    pthread_rwlock_unlock(&fs_lock);
+    stats_op(OP_READ, start, ret);
+    if (ret < 0) fuse_reply_err(req, -ret);
+    else if (buf != NULL) fuse_reply_buf(req, buf, ret);
+    arena_reset();
+}
 
-    free(entry);
-    return 0; // Success
+static void ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t offset,
+                         struct fuse_file_info *fi) {
+    uint64_t start = stats_now();
+    int ret;
+    if (ino == SNAPSHOTS_INO) {
+        ret = snapshots_write(bufv);
+    } else {
+        pthread_rwlock_rdlock(&fs_lock);
+        ret = ino == STATS_INO ? stats_write(bufv) : wfs_write(FROM_INO(ino), bufv, offset);
+        release_room();
+        pthread_rwlock_unlock(&fs_lock);
+    }
+    stats_op(OP_WRITE, start, ret);
+    if (ret < 0) fuse_reply_err(req, -ret);
+    else fuse_reply_write(req, ret);
+    arena_reset();
 }
 
-static int wfs_getattr(const char* path, struct stat* stbuf) {
-    struct wfs_log_entry *entry = get_path_entry(path);
-    if(entry == (void*) NULL) return -ENOENT;
+static void ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    pthread_rwlock_rdlock(&fs_lock);
+    int ret = wfs_flush(ino, fi);
+    release_room();
+    pthread_rwlock_unlock(&fs_lock);
+    fuse_reply_err(req, -ret);
+    arena_reset();
+}
 
-    stbuf->st_uid = entry->inode.uid;
-    stbuf->st_gid = entry->inode.gid;
-    stbuf->st_mtime = entry->inode.mtime;
-    stbuf->st_mode = entry->inode.mode;
-    stbuf->st_nlink = entry->inode.links;
-    stbuf->st_size = entry->inode.size;
+static void ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    pthread_rwlock_rdlock(&fs_lock);
+    int ret = wfs_release(ino, fi);
+    release_room();
+    pthread_rwlock_unlock(&fs_lock);
+    fuse_reply_err(req, -ret);
+    arena_reset();
+}
 
-    free(entry);
-    return 0;
+static void ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+    pthread_rwlock_rdlock(&fs_lock);
+    int ret = wfs_fsync(ino, fi);
+    release_room();
+    pthread_rwlock_unlock(&fs_lock);
+    fuse_reply_err(req, -ret);
+    arena_reset();
+}
+
+// Timed as readdir, since that is where the work is.
+static void ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    uint64_t start = stats_now();
+    pthread_rwlock_rdlock(&fs_lock);
+    int ret = IS_CONTROL(ino) ? -ENOTDIR : wfs_opendir(req, FROM_INO(ino), fi);
+    pthread_rwlock_unlock(&fs_lock);
+    stats_op(OP_READDIR, start, ret);
+    reply_open(req, fi, ret);
+    arena_reset();
+}
+
+static void ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi) {
+    struct dir_listing *listing = (struct dir_listing *) (uintptr_t) fi->fh;
+    size_t end = offset;
+    for (int i = 0; i < listing->n_entries; i++) {
+        if (listing->ends[i] <= (size_t) offset) continue;
+        if (listing->ends[i] - offset > size) break;
+        end = listing->ends[i];
+    }
+    fuse_reply_buf(req, listing->buf + offset, end - offset);
 }
 
-static struct fuse_operations my_operations = {
-    .getattr	= wfs_getattr,
-    .mknod      = wfs_mknod,
-    .mkdir      = wfs_mkdir,
-    .read	    = wfs_read,
-    .write      = wfs_write,
-    .readdir	= wfs_readdir,
-    .unlink    	= wfs_unlink,
+static void ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    struct dir_listing *listing = (struct dir_listing *) (uintptr_t) fi->fh;
+    free(listing->buf);
+    free(listing->ends);
+    free(listing);
+    fuse_reply_err(req, 0);
+}
+
+static struct fuse_lowlevel_ops my_operations = {
+    .init       = wfs_init,
+    .destroy    = wfs_destroy,
+    .lookup     = ll_lookup,
+    .forget     = ll_forget,
+    .getattr    = ll_getattr,
+    .setattr    = ll_setattr,
+    .mknod      = ll_mknod,
+    .mkdir      = ll_mkdir,
+    .unlink     = ll_unlink,
+    .rename     = ll_rename,
+    .open       = ll_open,
+    .read       = ll_read,
+    .write_buf  = ll_write_buf,
+    .flush      = ll_flush,
+    .release    = ll_release,
+    .fsync      = ll_fsync,
+    .opendir    = ll_opendir,
+    .readdir    = ll_readdir,
+    .releasedir = ll_releasedir,
 };
 
-int main(int argc, char *argv[]) {
-    int fuse_argc = argc - 1;
+void init_locks() {
+    // prefer the cleaner and commits, which would otherwise wait for a moment
+    // with no operation or append in flight
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&fs_lock, &attr);
+    pthread_rwlock_init(&buf_lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
 
-    disk_path = argv[argc-2];
-    argv[argc-2] = argv[argc-1];
+    for (int i = 0; i < INODE_LOCKS; i++) pthread_mutex_init(&inode_locks[i], NULL);
+    pthread_key_create(&arena_key, free_arena_chunks);
+    for (int i = 0; i < READAHEAD_SLOTS; i++) {
+        readaheads[i].inode_number = -1;
+        pthread_mutex_init(&readaheads[i].lock, NULL);
+    }
+}
+
+// Removes the options mount.wfs handles itself from argv, leaving the FUSE
+// options and the disk and mount point. Returns the new argc.
+int parse_options(int argc, char *argv[]) {
+    int kept = 1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--mmap") == 0) {
+            use_mmap = 1;
+        } else if (strncmp(argv[i], "--clean-interval=", 17) == 0) {
+            clean_interval = atoi(argv[i] + 17);
+        } else if (strcmp(argv[i], "--compress") == 0) {
+            compress_data_enabled = 1;
+        } else if (strcmp(argv[i], "--io-uring") == 0) {
+            use_io_uring = 1;
+        } else if (strcmp(argv[i], "--direct") == 0) {
+            use_direct = 1;
+        } else if (strcmp(argv[i], "--dedup") == 0) {
+            dedup_enabled = 1;
+        } else if (strncmp(argv[i], "--commit-interval=", 18) == 0) {
+            commit_interval = atoi(argv[i] + 18);
+        } else if (strncmp(argv[i], "--write-cache=", 14) == 0) {
+            write_cache_size = (size_t) atoi(argv[i] + 14) * 1048576;
+        } else if (strncmp(argv[i], "--snapshot=", 11) == 0) {
+            snapshot_name = argv[i] + 11;
+            read_only = 1;
+        } else {
+            argv[kept++] = argv[i];
+        }
+    }
+    argv[kept] = NULL;
+    return kept;
+}
+
+// Mounts and runs the session loop until unmounted, as fuse_main() does for
+// the high-level API.
+static int serve(int argc, char *argv[]) {
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    char *mountpoint;
+    int multithreaded, foreground;
+    int err = -1;
+    if (read_only && fuse_opt_add_arg(&args, "-oro") != 0) return 1;
+    if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) != -1) {
+        struct fuse_chan *ch = fuse_mount(mountpoint, &args);
+        if (ch != NULL) {
+            struct fuse_session *se = fuse_lowlevel_new(&args, &my_operations, sizeof(my_operations), NULL);
+            if (se != NULL) {
+                if (fuse_set_signal_handlers(se) != -1) {
+                    fuse_session_add_chan(se, ch);
+                    if (fuse_daemonize(foreground) != -1) {
+                        err = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+                    }
+                    fuse_remove_signal_handlers(se);
+                    fuse_session_remove_chan(ch);
+                }
+                fuse_session_destroy(se);
+            }
+            fuse_unmount(mountpoint, ch);
+        }
+        free(mountpoint);
+    }
+    fuse_opt_free_args(&args);
+    return err ? 1 : 0;
+}
 
-    char *fuse_argv[fuse_argc];
-    for (int i = 0; i < fuse_argc; i++) {
-        fuse_argv[i] = argv[i];
+int main(int argc, char *argv[]) {
+    argc = parse_options(argc, argv);
+    if (argc < 3) {
+        printf("Usage: %s [--mmap] [--io-uring] [--direct] [--compress] [--dedup] [--clean-interval=N] [--commit-interval=MS] [--write-cache=MB] [--snapshot=NAME] [FUSE options] disk_path mount_point\n", argv[0]);
+        return -1;
     }
+    disk_path = argv[argc-2];
+    argv[argc-2] = argv[argc-1];
+    argv[--argc] = NULL;
 
-    fd = open(disk_path, O_RDWR);
+    init_locks();
+    fd = open(disk_path, read_only ? O_RDONLY : O_RDWR);
 
-    ssize_t read_bytes = read(fd, &superblock, sizeof(superblock));
+    ssize_t read_bytes = pread(fd, &superblock, sizeof(superblock), 0);
     if (read_bytes != sizeof(superblock)) {
         // Handle error
         close(fd);
@@ -679,6 +4550,87 @@ int main(int argc, char *argv[]) {
         close(fd);
         return -1;
     }
+    if (superblock.version != WFS_VERSION) {
+        printf("Unsupported filesystem version %u\n", superblock.version);
+        close(fd);
+        return -1;
+    }
+    if (superblock.flags & WFS_SB_COMPRESS) compress_data_enabled = 1;
+    if (superblock.flags & WFS_SB_DEDUP) dedup_enabled = 1;
+    if (use_direct) {
+        if (!(superblock.flags & WFS_SB_ALIGNED) || use_mmap) {
+            printf("--direct needs a block-aligned image (mkfs.wfs -a) and no --mmap\n");
+            close(fd);
+            return -1;
+        }
+        direct_fd = open(disk_path, (read_only ? O_RDONLY : O_RDWR) | O_DIRECT);
+        if (direct_fd < 0) printf("O_DIRECT unavailable, using the page cache\n");
+    }
+
+    // A snapshot is mounted as the log up to its head. Anything the live
+    // filesystem has under way (appends, a compaction) is past that head.
+    if (snapshot_name != NULL) {
+        struct wfs_snapshot *snapshot = strlen(snapshot_name) < MAX_FILE_NAME_LEN ? find_snapshot(snapshot_name) : NULL;
+        if (snapshot_name[0] == '\0' || snapshot == NULL) {
+            printf("No snapshot named %s\n", snapshot_name);
+            close(fd);
+            return -1;
+        }
+        superblock.head = snapshot->head;
+        superblock.epoch = snapshot->epoch;
+        superblock.hole_start = superblock.hole_end = 0;
+        superblock.move_src = superblock.move_dst = superblock.move_len = superblock.move_end = 0;
+    }
+
+    struct stat disk_stat;
+    if (fstat(fd, &disk_stat) != 0) {
+        perror("Error reading disk size");
+        close(fd);
+        return -1;
+    }
+    disk_size = disk_stat.st_size;
+    max_size = superblock.max_size > disk_size ? superblock.max_size : disk_size;
+
+    if (use_mmap) {
+        disk_map = mmap(NULL, max_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (disk_map == MAP_FAILED ||
+                mmap(disk_map, disk_size, read_only ? PROT_READ : PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+                     fd, 0) == MAP_FAILED) {
+            perror("Error mapping disk");
+            close(fd);
+            return -1;
+        }
+    }
+
+    // finish a compaction that was interrupted by a crash
+    if (superblock.move_len != 0 && finish_log_move() != 0) {
+        printf("Error recovering log compaction\n");
+        close(fd);
+        return -1;
+    }
+
+    // checkpoints are of the live filesystem, so a snapshot is read from the start
+    off_t scan_from = read_only ? wfs_log_start(&superblock) : load_checkpoint();
+    if (scan_from < 0 || build_inode_map(scan_from) != 0) {
+        printf("Error reading log\n");
+        close(fd);
+        return -1;
+    }
+    atomic_store(&log_tail, superblock.head);
+    committed_head = superblock.head;
+    if (!use_mmap && !read_only) {
+        if (!(superblock.flags & WFS_SB_ALIGNED)) {
+            log_buf = malloc(LOG_BUFFER_SIZE);
+        } else if (posix_memalign((void **) &log_buf_mem, WFS_BLOCK_SIZE, LOG_BUFFER_SIZE + 3 * WFS_BLOCK_SIZE) == 0) {
+            log_buf = log_buf_mem;
+        }
+        if (log_buf == NULL) {
+            printf("Error allocating log buffer\n");
+            close(fd);
+            return -1;
+        }
+    }
+    set_log_buf_start(superblock.head);
 
-    return fuse_main(fuse_argc, fuse_argv, &my_operations, NULL);
+    return serve(argc, argv);
 }
\ No newline at end of file
@@ -4,4 +4,4 @@ rm -f disk
 rmdir mnt
 mkfs.wfs disk
 mkdir mnt
-mount.wfs -f -s disk mnt
\ No newline at end of file
+mount.wfs -f disk mnt
\ No newline at end of file
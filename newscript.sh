@@ -3,4 +3,4 @@ make
 rmdir mnt
 mkfs.wfs prebuilt_disk
 mkdir mnt
-mount.wfs -f -s prebuilt_disk mnt
\ No newline at end of file
+mount.wfs -f prebuilt_disk mnt
\ No newline at end of file
@@ -1,30 +1,140 @@
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
 
 #ifndef MOUNT_WFS_H_
 #define MOUNT_WFS_H_
 
 #define MAX_FILE_NAME_LEN 32
 #define WFS_MAGIC 0xdeadbeef
-#define DISK_SIZE 1048576
+#define WFS_VERSION 9           // 2: 64-bit log offsets and sizes, 3: checkpoint region,
+                                //   4: dentry records, 5: record checksums, 6: compression,
+                                //   7: deduplication, 8: snapshots, 9: block-aligned images
+#define DISK_SIZE 1048576       // default image size
+#define WFS_GROW_CHUNK (64 * 1048576) // mount.wfs grows the image this much at a time
+
+// A snapshot is the log as it was up to its head: records are only ever
+// appended past the head, and compaction leaves everything below the newest
+// snapshot's head where it is (see wfs_snapshot_floor()). Unused entries have
+// an empty name.
+#define WFS_MAX_SNAPSHOTS 16
+
+struct wfs_snapshot {
+    char name[MAX_FILE_NAME_LEN];
+    uint64_t head;              // superblock head and epoch when it was taken
+    uint64_t epoch;
+    uint64_t time;
+};
 
 struct wfs_sb {
     uint32_t magic;
-    uint32_t head;
+    uint32_t version;
+    uint64_t head;
+    uint64_t max_size;          // the image file is grown on demand up to this size
+    uint64_t checkpoint_size;   // bytes in each of the two checkpoint slots (see struct wfs_checkpoint)
+    uint64_t flags;             // WFS_SB_*
+    uint64_t epoch;             // bumped whenever compaction moves or drops records
+    // Log compaction in progress. Scans skip the hole [hole_start, hole_end)
+    // (empty if equal). When move_len is non-zero, move_len bytes of live
+    // records staged at move_src (past the head) still have to be copied to
+    // move_dst, after which the hole becomes [move_dst + move_len, move_end).
+    // Redoing the copy after a crash is always safe.
+    uint64_t hole_start;
+    uint64_t hole_end;
+    uint64_t move_src;
+    uint64_t move_dst;
+    uint64_t move_len;
+    uint64_t move_end;
+    struct wfs_snapshot snapshots[WFS_MAX_SNAPSHOTS];
 };
 
+#define WFS_SB_COMPRESS 1       // mount.wfs compresses file data (mkfs.wfs -z)
+#define WFS_SB_DEDUP 2          // mount.wfs deduplicates file data (mkfs.wfs -d)
+#define WFS_SB_ALIGNED 4        // block-aligned image (mkfs.wfs -a), see WFS_BLOCK_SIZE
+
+// In a block-aligned image the log starts on a WFS_BLOCK_SIZE boundary, the
+// image is a whole number of blocks, and mount.wfs ends every batch of
+// appends it writes out with a pad record reaching the next boundary, so
+// batches are written as whole blocks and can bypass the page cache (see
+// --direct in mount.wfs.c). Compaction moves records without regard to
+// block boundaries. After the cleaner runs, the first batch starts wherever
+// the moved records end. fsck.wfs --compact ends with a pad record that puts
+// the head back on a boundary.
+#define WFS_BLOCK_SIZE 4096
+
 struct wfs_inode {
     unsigned int inode_number;
     unsigned int deleted;       // 1 if deleted, 0 otherwise
     unsigned int mode;          // type. S_IFDIR if the inode represents a directory or S_IFREG if it's for a file
     unsigned int uid;           // user id
     unsigned int gid;           // group id
-    unsigned int flags;         // flags
-    unsigned int size;          // size in bytes
+    unsigned int flags;         // record type, WFS_RECORD_*
+    uint64_t size;              // size in bytes of the data following this header
     unsigned int atime;         // last access time
     unsigned int mtime;         // last modify time
     unsigned int ctime;         // inode change time (the last time any field of inode is modified)
     unsigned int links;         // number of hard links to this file (this can always be set to 1)
+    uint64_t raw_size;          // file data bytes before encoding, 0 if stored as is
+    uint64_t epoch;             // superblock epoch when the record was appended
+    uint32_t commit;            // 1 on the last record an operation appended, 0 on the others
+    uint32_t crc;               // wfs_record_crc() of the record
+};
+
+// Every record carries a CRC and every operation's records are appended
+// together, the last one marked commit, so that recovery can tell a complete
+// operation from a torn or unfinished one (see build_inode_map() in
+// mount.wfs.c). Compaction copies records unchanged and bumps the epoch;
+// records from an earlier epoch are thus known to be complete.
+//
+// Record types, stored in wfs_inode.flags. A full record carries the whole
+// directory or file contents as its data. An extent record carries a
+// wfs_extent followed by just the bytes written at that offset; the file is
+// its latest full record with every later extent applied in log order. An
+// extent whose file_size is below the end of the data before it truncates
+// that data, which reads as zeros if the file grows again; truncates and new
+// times are logged as extents with no data at the file size.
+// Likewise a dentry record carries the one wfs_dentry added to or removed
+// from a directory, whose entries are those of its latest full record with
+// every later dentry record applied in log order. A chunk record carries a
+// block of file data that other records refer to (see below); it belongs to
+// no inode. Nor does a pad record, whose data is zeros filling the log up to
+// a block boundary (see WFS_SB_ALIGNED); it is never live.
+#define WFS_RECORD_FULL 0
+#define WFS_RECORD_EXTENT 1
+#define WFS_RECORD_DENTRY_ADD 2
+#define WFS_RECORD_DENTRY_REMOVE 3
+#define WFS_RECORD_CHUNK 4
+#define WFS_RECORD_PAD 5
+
+#define WFS_CHUNK_INODE 0xffffffff // inode_number of chunk and pad records
+
+struct wfs_extent {
+    uint64_t offset;            // file offset the data was written at
+    uint64_t length;            // bytes of data following this header
+    uint64_t file_size;         // size of the file after this write
+};
+
+// Block encoding. The file data of a record with a non-zero raw_size (all of
+// a full record's data, what follows the wfs_extent of an extent record, or
+// what follows the wfs_chunk_ref of a chunk record) is raw_size bytes cut into
+// blocks of WFS_COMPRESS_BLOCK, the last one shorter. It is stored as a
+// uint64_t table holding where each block ends, counted from the end of the
+// table, followed by the blocks. A block whose table entry has WFS_BLOCK_REF
+// set is a wfs_chunk_ref naming the chunk record that holds its bytes; of the
+// others, a block as long as its raw bytes is kept as is and any other is in
+// the LZ4 block format. Blocks are independent, so a read only decodes those
+// it touches. Chunk records hold a single block and no references.
+#define WFS_COMPRESS_BLOCK 65536
+#define WFS_BLOCK_REF (1ULL << 63)
+
+// A chunk's hash, which is all a reference holds: one chunk record is kept
+// per hash, and the blocks referring to it were compared against it when
+// written.
+struct wfs_chunk_ref {
+    uint64_t hash[2];
 };
 
 struct wfs_dentry {
@@ -37,4 +147,184 @@ struct wfs_log_entry {
     char data[];
 };
 
+// The two checkpoint slots sit between the superblock and the log.
+static inline uint64_t wfs_log_start(const struct wfs_sb *sb) {
+    uint64_t start = sizeof(struct wfs_sb) + 2 * sb->checkpoint_size;
+    if (sb->flags & WFS_SB_ALIGNED) start = (start + WFS_BLOCK_SIZE - 1) & ~(uint64_t) (WFS_BLOCK_SIZE - 1);
+    return start;
+}
+
+// Length of the pad record that takes a log ending at end to the next block
+// boundary, 0 if it is on one. A gap too short for a record header is
+// padded through the block after it.
+static inline uint64_t wfs_pad_length(uint64_t end) {
+    uint64_t gap = -end & (WFS_BLOCK_SIZE - 1);
+    if (gap != 0 && gap < sizeof(struct wfs_inode)) gap += WFS_BLOCK_SIZE;
+    return gap;
+}
+
+// Checkpoint of mount.wfs's inode map, so that mount only has to scan the
+// records appended after it. Checkpoints alternate between the two slots and
+// mount uses the newer valid one. One is valid if its CRC matches, its head
+// is within the log and no compaction has run since it was written (same
+// epoch). The header is followed by n_inodes wfs_checkpoint_inode entries,
+// each followed by the offsets of its extent records as uint64_t and the
+// chunks its live records refer to, then by the live chunks.
+#define WFS_CHECKPOINT_MAGIC 0xc4ec4b01
+
+struct wfs_checkpoint {
+    uint32_t magic;
+    uint32_t crc;               // wfs_crc32c() of everything after this field, up to length
+    uint64_t length;            // bytes in the checkpoint, header included
+    uint64_t sequence;          // the newer of the two slots has the higher sequence
+    uint64_t epoch;             // superblock epoch at the time
+    uint64_t head;              // log offset the inode map is current up to
+    uint64_t next_inode;        // next inode number to allocate
+    uint64_t n_inodes;
+    uint64_t n_chunks;          // wfs_checkpoint_chunk entries after the inodes
+};
+
+struct wfs_checkpoint_inode {
+    uint64_t offset;            // latest record
+    uint64_t base;              // latest full record
+    uint64_t size;              // file size
+    uint64_t live;              // bytes of the inode's records still needed
+    uint32_t inode_number;
+    uint32_t n_extents;
+    uint32_t deleted;
+    uint32_t n_refs;            // wfs_chunk_ref entries after the extents
+};
+
+struct wfs_checkpoint_chunk {
+    struct wfs_chunk_ref hash;
+    uint64_t offset;            // chunk record
+    uint64_t length;            //   and its length, header included
+};
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static inline uint32_t wfs_crc32c_sse42(uint32_t crc, const unsigned char *p, size_t len) {
+    uint64_t crc64 = (uint32_t) ~crc;
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = crc64;
+    while (len--) crc = _mm_crc32_u8(crc, *p++);
+    return ~crc;
+}
+#endif
+
+// CRC-32C (Castagnoli) of len bytes, continuing from crc (0 to start). Uses
+// the SSE4.2 instruction where the CPU has it and a nibble table otherwise.
+static inline uint32_t wfs_crc32c(uint32_t crc, const void *buf, size_t len) {
+    static const uint32_t nibbles[16] = {
+        0x00000000, 0x105ec76f, 0x20bd8ede, 0x30e349b1, 0x417b1dbc, 0x5125dad3, 0x61c69362, 0x7198540d,
+        0x82f63b78, 0x92a8fc17, 0xa24bb5a6, 0xb21572c9, 0xc38d26c4, 0xd3d3e1ab, 0xe330a81a, 0xf36e6f75,
+    };
+    const unsigned char *p = (const unsigned char *) buf;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) return wfs_crc32c_sse42(crc, p, len);
+#endif
+    crc = ~crc;
+    while (len--) {
+        crc ^= *p++;
+        crc = (crc >> 4) ^ nibbles[crc & 15];
+        crc = (crc >> 4) ^ nibbles[crc & 15];
+    }
+    return ~crc;
+}
+
+// CRC of a record: its header up to the crc field, then its size bytes of
+// data. The header alone is wfs_record_crc(inode, NULL) when size is 0, and
+// data split over several buffers is covered by continuing with wfs_crc32c().
+static inline uint32_t wfs_record_crc(const struct wfs_inode *inode, const void *data) {
+    uint32_t crc = wfs_crc32c(0, inode, offsetof(struct wfs_inode, crc));
+    return data != NULL ? wfs_crc32c(crc, data, inode->size) : crc;
+}
+
+// Fills in the header of a pad record length bytes long (see
+// wfs_pad_length()), which ends an operation of its own.
+static inline void wfs_pad_record(struct wfs_inode *pad, uint64_t length, uint64_t epoch) {
+    static const char zeros[WFS_BLOCK_SIZE];
+    memset(pad, 0, sizeof(*pad));
+    pad->inode_number = WFS_CHUNK_INODE;
+    pad->flags = WFS_RECORD_PAD;
+    pad->size = length - sizeof(*pad);
+    pad->epoch = epoch;
+    pad->commit = 1;
+    pad->crc = wfs_record_crc(pad, NULL);
+    for (uint64_t left = pad->size; left > 0;) {
+        uint64_t n = left < sizeof(zeros) ? left : sizeof(zeros);
+        pad->crc = wfs_crc32c(pad->crc, zeros, n);
+        left -= n;
+    }
+}
+
+// Compaction slides every live record from some start offset onwards down to
+// that offset and cuts the log after them, a window at a time (see struct
+// wfs_sb). Candidate starts are the first record of each WFS_SEGMENT_SIZE
+// segment of the log.
+#define WFS_SEGMENT_SIZE 65536
+#define WFS_MAX_WINDOW (16 * WFS_SEGMENT_SIZE) // most live bytes staged per step
+
+struct wfs_segment {
+    uint64_t start;             // offset of the first record starting in the segment, 0 if none
+    uint64_t live;              // bytes of live records starting in the segment
+    uint64_t dead;              // bytes of superseded records starting in the segment
+    uint64_t hole_needed;       // hole a compaction must bring into the segment to move its
+                                //   live records (see wfs_pick_compaction())
+};
+
+// Picks the segment whose start gives the best compaction, or -1 if none
+// reclaims at least min_reclaim bytes. Benefit is the dead bytes reclaimed;
+// cost is every byte read plus the live bytes written twice (staged past the
+// head, then copied back), so the ratio is dead / (dead + 3 * live).
+//
+// A live record can only be moved if it fits in the hole gathered in front of
+// it or, failing that, in the free space past the head. Records longer than
+// the free space thus need the dead bytes before them in the segment plus the
+// hole brought into it to cover their length; segments record how much hole
+// that takes, and starts that would get stuck on one are skipped.
+static inline int wfs_pick_compaction(const struct wfs_segment *segments, int n, uint64_t min_reclaim) {
+    uint64_t live = 0, dead = 0;
+    int64_t hole_needed = 0;    // hole needed at segment i for the rest of the suffix
+    double best_ratio = 0;
+    int best = -1;
+
+    for (int i = n - 1; i >= 0; i--) {
+        live += segments[i].live;
+        dead += segments[i].dead;
+        hole_needed -= segments[i].dead;
+        if (hole_needed < (int64_t) segments[i].hole_needed) hole_needed = segments[i].hole_needed;
+        if (segments[i].start == 0 || dead == 0 || dead < min_reclaim || hole_needed > 0) continue;
+
+        double ratio = (double) dead / (dead + 3 * live);
+        if (ratio >= best_ratio) { // on ties prefer reclaiming more
+            best_ratio = ratio;
+            best = i;
+        }
+    }
+    return best;
+}
+
+// Where compaction may start: the head of the newest snapshot, or the start
+// of the log if there is none. Snapshots are only taken with no compaction
+// under way, so a hole never starts below it.
+static inline uint64_t wfs_snapshot_floor(const struct wfs_sb *sb) {
+    uint64_t floor = wfs_log_start(sb);
+    for (int i = 0; i < WFS_MAX_SNAPSHOTS; i++) {
+        if (sb->snapshots[i].name[0] != '\0' && sb->snapshots[i].head > floor) floor = sb->snapshots[i].head;
+    }
+    return floor;
+}
+
+// Offset of the record following one that ends at offset, skipping the
+// compaction hole.
+static inline uint64_t wfs_log_next(const struct wfs_sb *sb, uint64_t offset) {
+    if (offset == sb->hole_start && sb->hole_end > sb->hole_start) return sb->hole_end;
+    return offset;
+}
+
 #endif